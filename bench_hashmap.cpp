@@ -0,0 +1,743 @@
+/*
+    Benchmarks of HashMap against std::unordered_map and, if their headers are found, absl::flat_hash_map,
+    robin_hood::unordered_flat_map and ankerl::unordered_dense::map.
+
+        g++ -std=c++17 -O2 -march=native -DNDEBUG -pthread bench_hashmap.cpp -o bench_hashmap
+        ./bench_hashmap [--quick] [--threads=N] [--filter=TEXT] [--memory]
+
+    Built with -std=c++20 it also runs the find-async lines: the lookups of find-hit interleaved as coroutines
+    by LookupScheduler, which pays off once the map is much larger than the last level cache.
+
+    With absl the binary is linked with -labsl_hash -labsl_raw_hash_set -labsl_city -labsl_low_level_hash.
+
+    Every result line is: map, key and value types, workload, number of elements, mean ns per operation,
+    p50 and p99 of the latency, the longest pause and the bytes of memory per element.
+    The latency is measured over batches of BatchSize operations, so it is the mean latency within a batch;
+    a rehash is one long batch, and the longest batch is the pause. --filter runs only the lines which contain TEXT.
+
+    --memory reports the memory instead: bytes per element of HashMap across max load factors and subtable
+    counts, as memory_usage breaks them down and as the allocations count them, next to std::unordered_map.
+*/
+
+#include "hash_map.h"
+#include "concurrent_hash_map.h"
+#include "lookup_scheduler.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if __has_include(<absl/container/flat_hash_map.h>)
+#include <absl/container/flat_hash_map.h>
+#define BENCH_ABSL
+#endif
+#if __has_include(<robin_hood.h>)
+#include <robin_hood.h>
+#define BENCH_ROBIN_HOOD
+#endif
+#if __has_include(<ankerl/unordered_dense.h>)
+#include <ankerl/unordered_dense.h>
+#define BENCH_ANKERL
+#endif
+
+// All allocations are counted, so the memory of any map is known without its help
+std::atomic<int64_t> allocated_bytes{0};
+
+void* CountedAllocate(size_t size, size_t alignment) {
+    alignment = std::max(alignment, alignof(std::max_align_t));
+    void* memory = std::aligned_alloc(alignment, (size + 2 * alignment - 1) / alignment * alignment);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    *static_cast<size_t*>(memory) = size;
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    return static_cast<char*>(memory) + alignment;
+}
+
+void CountedFree(void* memory, size_t alignment) {
+    if (memory == nullptr) {
+        return;
+    }
+    alignment = std::max(alignment, alignof(std::max_align_t));
+    char* start = static_cast<char*>(memory) - alignment;
+    allocated_bytes.fetch_sub(*reinterpret_cast<size_t*>(start), std::memory_order_relaxed);
+    std::free(start);
+}
+
+void* operator new(size_t size) {
+    return CountedAllocate(size, 0);
+}
+
+void* operator new[](size_t size) {
+    return CountedAllocate(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return CountedAllocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* memory) noexcept {
+    CountedFree(memory, 0);
+}
+
+void operator delete[](void* memory) noexcept {
+    CountedFree(memory, 0);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    CountedFree(memory, 0);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+    CountedFree(memory, 0);
+}
+
+void operator delete(void* memory, std::align_val_t alignment) noexcept {
+    CountedFree(memory, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void* memory, std::align_val_t alignment) noexcept {
+    CountedFree(memory, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* memory, size_t, std::align_val_t alignment) noexcept {
+    CountedFree(memory, static_cast<size_t>(alignment));
+}
+
+void operator delete[](void* memory, size_t, std::align_val_t alignment) noexcept {
+    CountedFree(memory, static_cast<size_t>(alignment));
+}
+
+namespace benchmarks {
+    const size_t BatchSize = 16;
+    const size_t LookupCount = 1 << 20;
+
+    struct Options {
+        bool quick = false;
+        size_t threads = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+        std::string filter;
+        bool memory = false;
+    };
+
+    Options options;
+
+    // A value much larger than a key, so moves of the elements dominate
+    using LargeValue = std::array<uint64_t, 16>;
+
+    // A bijection, so different indices always give different keys
+    uint64_t Scramble(uint64_t x) {
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    uint32_t Scramble32(uint32_t x) {
+        x = (x ^ (x >> 16)) * 0x7FEB352Du;
+        x = (x ^ (x >> 15)) * 0x846CA68Bu;
+        return x ^ (x >> 16);
+    }
+
+    // Sequential keys are the indices themselves, the others are scrambled indices
+    template<class Key>
+    Key MakeKey(uint64_t index, bool sequential);
+
+    template<>
+    int MakeKey<int>(uint64_t index, bool sequential) {
+        return static_cast<int>(sequential ? static_cast<uint32_t>(index) : Scramble32(static_cast<uint32_t>(index)));
+    }
+
+    template<>
+    uint64_t MakeKey<uint64_t>(uint64_t index, bool sequential) {
+        return sequential ? index : Scramble(index);
+    }
+
+    // Longer than the small string buffer, so every key lives on the heap
+    template<>
+    std::string MakeKey<std::string>(uint64_t index, bool sequential) {
+        std::string key = std::to_string(sequential ? index : Scramble(index));
+        return std::string(24 - std::min<size_t>(key.size(), 20), 'k') + key;
+    }
+
+    template<class Value>
+    Value MakeValue(uint64_t index);
+
+    template<>
+    int MakeValue<int>(uint64_t index) {
+        return static_cast<int>(index);
+    }
+
+    template<>
+    uint64_t MakeValue<uint64_t>(uint64_t index) {
+        return index;
+    }
+
+    template<>
+    std::string MakeValue<std::string>(uint64_t index) {
+        return MakeKey<std::string>(index, false);
+    }
+
+    template<>
+    LargeValue MakeValue<LargeValue>(uint64_t index) {
+        LargeValue value;
+        value.fill(index);
+        return value;
+    }
+
+    template<class Type>
+    const char* TypeName();
+
+    template<>
+    const char* TypeName<int>() {
+        return "int";
+    }
+
+    template<>
+    const char* TypeName<uint64_t>() {
+        return "uint64";
+    }
+
+    template<>
+    const char* TypeName<std::string>() {
+        return "string";
+    }
+
+    template<>
+    const char* TypeName<LargeValue>() {
+        return "large";
+    }
+
+    /*
+        Zipfian ranks in [0, n) with skew theta (the generator of YCSB, Gray et al. "Quickly generating
+        billion-record synthetic databases"): rank 0 is the most frequent one.
+    */
+    class Zipfian {
+    public:
+        Zipfian(size_t n, double theta = 0.99) : n_(n), theta_(theta) {
+            double zeta2 = 1 + std::pow(0.5, theta);
+            for (size_t i = 1; i <= n; ++i) {
+                zetan_ += 1 / std::pow((double)i, theta);
+            }
+            alpha_ = 1 / (1 - theta);
+            eta_ = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan_);
+        }
+
+        template<class Generator>
+        size_t operator()(Generator& generator) {
+            double u = std::uniform_real_distribution<double>(0, 1)(generator);
+            double uz = u * zetan_;
+            if (uz < 1) {
+                return 0;
+            }
+            if (uz < 1 + std::pow(0.5, theta_)) {
+                return 1;
+            }
+            return std::min(n_ - 1, (size_t)(n_ * std::pow(eta_ * u - eta_ + 1, alpha_)));
+        }
+
+    private:
+        size_t n_;
+        double theta_;
+        double zetan_ = 0;
+        double alpha_;
+        double eta_;
+    };
+
+    // Collects the time of every batch and reports the figures of one result line
+    class Recorder {
+    public:
+        explicit Recorder(size_t operations) {
+            batches_.reserve(operations / BatchSize + 1);
+        }
+
+        void Start() {
+            start_ = Clock::now();
+            batch_start_ = start_;
+        }
+
+        // Called after every operation with the number of operations done so far
+        void Tick(size_t done) {
+            if (done % BatchSize == 0) {
+                auto now = Clock::now();
+                batches_.push_back(std::chrono::duration<double, std::nano>(now - batch_start_).count());
+                batch_start_ = now;
+            }
+        }
+
+        void Report(const std::string& name, size_t operations, size_t elements, int64_t bytes) {
+            double total = std::chrono::duration<double, std::nano>(Clock::now() - start_).count();
+            Print(name, total / operations, Percentile(0.5) / BatchSize, Percentile(0.99) / BatchSize,
+                  batches_.empty() ? 0 : *std::max_element(batches_.begin(), batches_.end()), elements, bytes);
+        }
+
+        static void Print(const std::string& name, double mean, double p50, double p99, double pause,
+                          size_t elements, int64_t bytes) {
+            std::printf("%-64s %10.2f %10.2f %10.2f %12.0f %10.1f\n", name.c_str(), mean, p50, p99, pause,
+                        elements == 0 ? 0.0 : (double)bytes / elements);
+            std::fflush(stdout);
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        Clock::time_point start_;
+        Clock::time_point batch_start_;
+        std::vector<double> batches_;
+
+        double Percentile(double fraction) {
+            if (batches_.empty()) {
+                return 0;
+            }
+            auto position = batches_.begin() + (size_t)(fraction * (batches_.size() - 1));
+            std::nth_element(batches_.begin(), position, batches_.end());
+            return *position;
+        }
+    };
+
+    bool Selected(const std::string& name) {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+
+    // Keeps the compiler from dropping the lookups
+    template<class Value>
+    void DoNotOptimize(const Value& value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    // The key and value types of the standard maps and of HashMap, which does not declare them
+    template<class Map>
+    struct MapTypes {
+        using Key = typename Map::key_type;
+        using Value = typename Map::mapped_type;
+    };
+
+    template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+    struct MapTypes<HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>> {
+        using Key = KeyType;
+        using Value = ValueType;
+    };
+
+    template<class Map, class Key>
+    bool Contains(const Map& map, const Key& key) {
+        return map.find(key) != map.end();
+    }
+
+    template<class Map>
+    struct Keys {
+        using Key = typename MapTypes<Map>::Key;
+
+        std::vector<Key> present;
+        std::vector<Key> absent;
+    };
+
+    template<class Map, class Key = typename MapTypes<Map>::Key, class Value = typename MapTypes<Map>::Value>
+    void Fill(Map& map, const std::vector<Key>& keys) {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            map.insert({keys[i], MakeValue<Value>(i)});
+        }
+    }
+
+    template<class Map, class Key = typename MapTypes<Map>::Key, class Value = typename MapTypes<Map>::Value>
+    void BenchInsert(const std::string& name, const std::vector<Key>& keys) {
+        if (!Selected(name)) {
+            return;
+        }
+        int64_t before = allocated_bytes.load();
+        Map map;
+        Recorder recorder(keys.size());
+        recorder.Start();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            map.insert({keys[i], MakeValue<Value>(i)});
+            recorder.Tick(i + 1);
+        }
+        recorder.Report(name, keys.size(), map.size(), allocated_bytes.load() - before);
+    }
+
+    // Finds present keys with probability hit_ratio, ranks follows the Zipfian distribution if zipfian is set
+    template<class Map, class Key = typename MapTypes<Map>::Key>
+    void BenchFind(const std::string& name, const Map& map, const Keys<Map>& keys, double hit_ratio,
+                   bool zipfian) {
+        if (!Selected(name)) {
+            return;
+        }
+        std::mt19937_64 generator(1);
+        std::bernoulli_distribution hit(hit_ratio);
+        std::uniform_int_distribution<size_t> index(0, keys.present.size() - 1);
+        std::vector<const Key*> queries(LookupCount);
+        if (zipfian) {
+            Zipfian ranks(keys.present.size());
+            for (auto& query : queries) {
+                query = &keys.present[ranks(generator)];
+            }
+        } else {
+            for (auto& query : queries) {
+                query = hit(generator) ? &keys.present[index(generator)] : &keys.absent[index(generator)];
+            }
+        }
+        Recorder recorder(queries.size());
+        size_t found = 0;
+        recorder.Start();
+        for (size_t i = 0; i < queries.size(); ++i) {
+            found += Contains(map, *queries[i]);
+            recorder.Tick(i + 1);
+        }
+        DoNotOptimize(found);
+        recorder.Report(name, queries.size(), 0, 0);
+    }
+
+    /*
+        read_ratio of the operations find a present key, the rest alternately erase the oldest key and insert
+        a new one, so the map changes all the time but its size stays the same.
+    */
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+    // Looks up every window-th query starting from first
+    template<class Map, class Key>
+    LookupTask FindQueries(const Map& map, const std::vector<const Key*>& queries, size_t first, size_t window,
+                           size_t& found) {
+        for (size_t i = first; i < queries.size(); i += window) {
+            found += (co_await map.find_async(*queries[i])) != map.end();
+        }
+    }
+
+    // The queries of find-hit run by LookupWindow coroutines, a lookup waits for its prefetch while the others run
+    template<class Map, class Key = typename MapTypes<Map>::Key>
+    void BenchFindAsync(const std::string& name, const Map& map, const Keys<Map>& keys) {
+        if (!Selected(name)) {
+            return;
+        }
+        std::mt19937_64 generator(1);
+        std::uniform_int_distribution<size_t> index(0, keys.present.size() - 1);
+        std::vector<const Key*> queries(LookupCount);
+        for (auto& query : queries) {
+            query = &keys.present[index(generator)];
+        }
+        size_t found = 0;
+        LookupScheduler scheduler;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < scheduler.window(); ++i) {
+            scheduler.spawn(FindQueries(map, queries, i, scheduler.window(), found));
+        }
+        scheduler.run();
+        double total = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        DoNotOptimize(found);
+        Recorder::Print(name, total / queries.size(), 0, 0, 0, 0, 0);
+    }
+#endif
+
+    template<class Map, class Key = typename MapTypes<Map>::Key, class Value = typename MapTypes<Map>::Value>
+    void BenchMixed(const std::string& name, const std::vector<Key>& keys, double read_ratio) {
+        if (!Selected(name)) {
+            return;
+        }
+        size_t n = keys.size() / 2;
+        Map map;
+        Fill(map, std::vector<Key>(keys.begin(), keys.begin() + n));
+        std::mt19937_64 generator(2);
+        std::bernoulli_distribution read(read_ratio);
+        size_t oldest = 0;
+        size_t next = n;
+        size_t found = 0;
+        Recorder recorder(LookupCount);
+        recorder.Start();
+        for (size_t i = 0; i < LookupCount; ++i) {
+            if (read(generator)) {
+                found += Contains(map, keys[(oldest + generator() % n) % keys.size()]);
+            } else if (i % 2 == 0) {
+                map.erase(keys[oldest++ % keys.size()]);
+            } else {
+                map.insert({keys[next++ % keys.size()], MakeValue<Value>(i)});
+            }
+            recorder.Tick(i + 1);
+        }
+        DoNotOptimize(found);
+        recorder.Report(name, LookupCount, 0, 0);
+    }
+
+    template<class Map, class Key = typename MapTypes<Map>::Key>
+    void BenchErase(const std::string& name, const std::vector<Key>& keys) {
+        if (!Selected(name)) {
+            return;
+        }
+        Map map;
+        Fill(map, keys);
+        Recorder recorder(keys.size());
+        recorder.Start();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            map.erase(keys[i]);
+            recorder.Tick(i + 1);
+        }
+        recorder.Report(name, keys.size(), 0, 0);
+    }
+
+    template<class Map>
+    void BenchIterate(const std::string& name, const Map& map) {
+        if (!Selected(name)) {
+            return;
+        }
+        Recorder recorder(0);
+        size_t visited = 0;
+        recorder.Start();
+        for (const auto& element : map) {
+            DoNotOptimize(element.second);
+            ++visited;
+        }
+        recorder.Report(name, std::max<size_t>(visited, 1), 0, 0);
+    }
+
+    // Read-only lookups from options.threads threads at the same time, const lookups of all the maps are safe
+    template<class Map, class Key = typename MapTypes<Map>::Key>
+    void BenchParallelFind(const std::string& name, const Map& map, const Keys<Map>& keys) {
+        if (!Selected(name)) {
+            return;
+        }
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < options.threads; ++t) {
+            threads.emplace_back([&, t]() {
+                std::mt19937_64 generator(t);
+                size_t found = 0;
+                for (size_t i = 0; i < LookupCount; ++i) {
+                    size_t index = generator() % keys.present.size();
+                    found += Contains(map, i % 2 == 0 ? keys.present[index] : keys.absent[index]);
+                }
+                DoNotOptimize(found);
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double total = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        Recorder::Print(name, total / (LookupCount * options.threads), 0, 0, 0, 0, 0);
+    }
+
+    // Lookups, inserts and erases from options.threads threads, 90% of the operations are lookups
+    template<class Key, class Value>
+    void BenchConcurrent(const std::string& name, const Keys<std::unordered_map<Key, Value>>& keys) {
+        if (!Selected(name)) {
+            return;
+        }
+        ConcurrentHashMap<Key, Value> map;
+        for (size_t i = 0; i < keys.present.size(); ++i) {
+            map.insert({keys.present[i], MakeValue<Value>(i)});
+        }
+        std::vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t t = 0; t < options.threads; ++t) {
+            threads.emplace_back([&, t]() {
+                std::mt19937_64 generator(t);
+                Value value;
+                size_t found = 0;
+                for (size_t i = 0; i < LookupCount; ++i) {
+                    size_t index = generator() % keys.absent.size();
+                    if (i % 10 != 0) {
+                        found += map.find(keys.present[index], value);
+                    } else if (i % 20 == 0) {
+                        map.insert({keys.absent[index], MakeValue<Value>(i)});
+                    } else {
+                        map.erase(keys.absent[index]);
+                    }
+                }
+                DoNotOptimize(found);
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        double total = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        Recorder::Print(name, total / (LookupCount * options.threads), 0, 0, 0, 0, 0);
+    }
+
+    template<class Map>
+    void RunMap(const std::string& map_name, size_t n) {
+        using Key = typename MapTypes<Map>::Key;
+        using Value = typename MapTypes<Map>::Value;
+        std::string prefix = map_name + " " + TypeName<Key>() + "/" + TypeName<Value>() + " ";
+        std::string suffix = " " + std::to_string(n);
+        for (bool sequential : {false, true}) {
+            std::string order = sequential ? "sequential " : "random ";
+            Keys<Map> keys;
+            for (size_t i = 0; i < n; ++i) {
+                keys.present.push_back(MakeKey<Key>(i, sequential));
+                keys.absent.push_back(MakeKey<Key>(i + n, sequential));
+            }
+            BenchInsert<Map>(prefix + order + "insert" + suffix, keys.present);
+            if (!sequential) {
+                std::vector<Key> all = keys.present;
+                all.insert(all.end(), keys.absent.begin(), keys.absent.end());
+                BenchMixed<Map>(prefix + order + "mixed-90/10" + suffix, all, 0.9);
+                BenchMixed<Map>(prefix + order + "mixed-50/50" + suffix, all, 0.5);
+                BenchErase<Map>(prefix + order + "erase" + suffix, keys.present);
+            }
+            Map map;
+            Fill(map, keys.present);
+            BenchFind(prefix + order + "find-hit" + suffix, map, keys, 1, false);
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+            if constexpr (std::is_same_v<Map, HashMap<Key, Value>>) {
+                BenchFindAsync(prefix + order + "find-async-hit" + suffix, map, keys);
+            }
+#endif
+            BenchFind(prefix + order + "find-miss" + suffix, map, keys, 0, false);
+            if (!sequential) {
+                BenchFind(prefix + order + "find-50%" + suffix, map, keys, 0.5, false);
+                BenchFind(prefix + order + "find-zipfian" + suffix, map, keys, 1, true);
+                BenchIterate(prefix + order + "iterate" + suffix, map);
+                BenchParallelFind(prefix + order + "parallel-find-" + std::to_string(options.threads) + suffix,
+                                  map, keys);
+                if constexpr (std::is_same_v<Map, HashMap<Key, Value>>) {
+                    Keys<std::unordered_map<Key, Value>> plain{keys.present, keys.absent};
+                    BenchConcurrent<Key, Value>("concurrent " + std::string(TypeName<Key>()) + "/" +
+                                                TypeName<Value>() + " random mixed-90/10-" +
+                                                std::to_string(options.threads) + suffix, plain);
+                }
+            }
+        }
+    }
+
+    template<class Key, class Value>
+    void RunTypes(size_t n) {
+        RunMap<HashMap<Key, Value>>("hash_map", n);
+        RunMap<std::unordered_map<Key, Value>>("std", n);
+#ifdef BENCH_ABSL
+        RunMap<absl::flat_hash_map<Key, Value>>("absl", n);
+#endif
+#ifdef BENCH_ROBIN_HOOD
+        RunMap<robin_hood::unordered_flat_map<Key, Value>>("robin_hood", n);
+#endif
+#ifdef BENCH_ANKERL
+        RunMap<ankerl::unordered_dense::map<Key, Value>>("ankerl", n);
+#endif
+    }
+
+    // The heap buffer of a string which is too long for its inline buffer
+    size_t Payload(const std::string& text) {
+        return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+    }
+
+    size_t Payload(uint64_t) {
+        return 0;
+    }
+
+    template<class Key, class Value>
+    void MemoryMap(const std::string& prefix, size_t n, const HashMapOptions& map_options) {
+        std::string name = prefix + "lf-" + std::to_string(map_options.max_load_factor).substr(0, 3) + " subtables-" +
+                           std::to_string(map_options.subtable_count) + " " + std::to_string(n);
+        if (!Selected(name)) {
+            return;
+        }
+        int64_t before = allocated_bytes.load();
+        HashMap<Key, Value> map(map_options);
+        for (size_t i = 0; i < n; ++i) {
+            map.insert({MakeKey<Key>(i, false), MakeValue<Value>(i)});
+        }
+        int64_t counted = allocated_bytes.load() - before;
+        HashMapMemoryUsage usage = map.memory_usage([](const std::pair<const Key, Value>& element) {
+            return Payload(element.first) + Payload(element.second);
+        });
+        std::printf("%-56s %8.3f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name.c_str(), map.load_factor(),
+                    (double)usage.buckets / n, (double)usage.metadata / n, (double)usage.auxiliary / n,
+                    (double)usage.payload / n, usage.bytes_per_element(), (double)(counted + sizeof(map)) / n);
+        std::fflush(stdout);
+    }
+
+    template<class Key, class Value>
+    void MemoryTypes(size_t n) {
+        std::string types = std::string(TypeName<Key>()) + "/" + TypeName<Value>() + " ";
+        for (double load_factor : {0.5, 0.7, 0.9}) {
+            for (size_t subtable_count : {(size_t)1, (size_t)16, SubtableSize}) {
+                HashMapOptions map_options;
+                map_options.max_load_factor = load_factor;
+                map_options.subtable_count = subtable_count;
+                MemoryMap<Key, Value>("hash_map " + types, n, map_options);
+            }
+        }
+        std::string name = "std " + types + std::to_string(n);
+        if (Selected(name)) {
+            int64_t before = allocated_bytes.load();
+            std::unordered_map<Key, Value> map;
+            for (size_t i = 0; i < n; ++i) {
+                map.insert({MakeKey<Key>(i, false), MakeValue<Value>(i)});
+            }
+            int64_t counted = allocated_bytes.load() - before + sizeof(map);
+            std::printf("%-56s %8.3f %10s %10s %10s %10s %10s %10.1f\n", name.c_str(), map.load_factor(), "-", "-",
+                        "-", "-", "-", (double)counted / n);
+            std::fflush(stdout);
+        }
+    }
+
+    /*
+        Bytes per element by part, as memory_usage reports them, their total and the bytes which were allocated
+        for the map (with the map object itself). The two totals differ only by what memory_usage can not see.
+    */
+    void run_memory() {
+        // The powers of two fill the tables just after they have grown, the sizes between them nearly to the limit
+        std::vector<size_t> sizes = {1 << 16, 3 << 15, 1 << 20, 3 << 19};
+        if (options.quick) {
+            sizes = {1 << 10, 3 << 9, 1 << 16};
+        }
+        std::printf("%-56s %8s %10s %10s %10s %10s %10s %10s\n", "memory", "load", "buckets", "metadata", "aux",
+                    "payload", "total", "allocated");
+        for (size_t n : sizes) {
+            MemoryTypes<uint64_t, uint64_t>(n);
+            MemoryTypes<std::string, std::string>(n);
+        }
+    }
+
+    /*
+        From maps which fit into L1 to maps far beyond the last level cache. Strings and large values
+        are stopped earlier, their elements are bigger.
+    */
+    void run_all() {
+        std::vector<size_t> sizes = {1 << 10, 1 << 13, 1 << 16, 1 << 20, 1 << 23};
+        if (options.quick) {
+            sizes = {1 << 10, 1 << 16};
+        }
+        std::printf("%-64s %10s %10s %10s %12s %10s\n", "benchmark", "ns/op", "p50 ns", "p99 ns", "pause ns",
+                    "bytes/elem");
+        for (size_t n : sizes) {
+            RunTypes<int, int>(n);
+            RunTypes<uint64_t, uint64_t>(n);
+            if (n <= (1 << 20)) {
+                RunTypes<std::string, std::string>(n);
+                RunTypes<uint64_t, LargeValue>(n);
+            }
+        }
+    }
+} // namespace benchmarks
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string argument = argv[i];
+        if (argument == "--quick") {
+            benchmarks::options.quick = true;
+        } else if (argument.rfind("--threads=", 0) == 0) {
+            benchmarks::options.threads = std::max(std::stoul(argument.substr(10)), 1ul);
+        } else if (argument.rfind("--filter=", 0) == 0) {
+            benchmarks::options.filter = argument.substr(9);
+        } else if (argument == "--memory") {
+            benchmarks::options.memory = true;
+        } else {
+            std::fprintf(stderr, "usage: %s [--quick] [--threads=N] [--filter=TEXT] [--memory]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (benchmarks::options.memory) {
+        benchmarks::run_memory();
+        return 0;
+    }
+    benchmarks::run_all();
+    return 0;
+}
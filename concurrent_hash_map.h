@@ -0,0 +1,379 @@
+/*
+    ConcurrentHashMap is a thread-safe hash map built from the same SubTables as HashMap.
+
+    Every key belongs to one shard (the high bits of its mixed hash, see HashMix) and every shard is a SubTable
+    with its own lock, so writers to different shards never contend and a growing shard blocks only itself.
+
+    Writers take the shard lock exclusively and make the shard version odd while they modify it.
+    For trivially copyable keys and values find is optimistic: it reads the shard without any lock and retries
+    if the version has changed meanwhile (a seqlock). A reader announces itself in the readers counter of the shard
+    and a writer which is going to reallocate the buckets waits until there are no readers, so an optimistic
+    reader never touches freed memory. For other types, and after too many failed attempts, find takes the shard
+    lock in shared mode.
+
+    An optimistic reader loads meta and bucket bytes with plain loads while a writer may be storing to them.
+    The torn result is never used, but it is still a data race for the language and a thread sanitizer reports it.
+    With MY_OWN_HASH_TABLE_LOCKED_READS defined, which a build under the thread sanitizer does by itself,
+    every find takes the shared lock, so such a build checks the locking of the map without this noise.
+
+    Nothing returns references or iterators into the map, because they would outlive the lock:
+    values are copied out by find and changed in place by update and insert_or_assign.
+*/
+
+#ifndef MY_OWN_HASH_TABLE_CONCURRENT_HASH_MAP_H
+#define MY_OWN_HASH_TABLE_CONCURRENT_HASH_MAP_H
+
+#include "hash_map.h"
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+
+#if defined(__SANITIZE_THREAD__)
+#define MY_OWN_HASH_TABLE_LOCKED_READS
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define MY_OWN_HASH_TABLE_LOCKED_READS
+#endif
+#endif
+
+const size_t ConcurrentShardCount = 1 << 6;
+
+#ifdef MY_OWN_HASH_TABLE_LOCKED_READS
+const bool OptimisticFind = false;
+#else
+const bool OptimisticFind = true;
+#endif
+
+// How many times an optimistic find retries before it falls back to the shared lock
+const size_t OptimisticAttempts = 8;
+
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+         class Probe = DefaultProbe>
+class ConcurrentHashMap {
+public:
+    explicit ConcurrentHashMap(size_t shard_count = ConcurrentShardCount, const Hash& hasher = Hash(),
+                               const KeyEqual& key_equal = KeyEqual());
+
+    ConcurrentHashMap(const ConcurrentHashMap &other) = delete;
+
+    ConcurrentHashMap &operator=(const ConcurrentHashMap &other) = delete;
+
+    size_t size() const;
+
+    bool empty() const;
+
+    Hash hash_function() const;
+
+    size_t shard_count() const;
+
+    bool insert(std::pair<KeyType, ValueType> element);
+
+    bool insert_or_assign(KeyType key, ValueType value);
+
+    template<class Function>
+    bool update(const KeyType& key, Function function);
+
+    bool erase(const KeyType& key);
+
+    template<class Predicate>
+    size_t erase_if(Predicate predicate);
+
+    bool find(const KeyType& key, ValueType& value) const;
+
+    bool contains(const KeyType& key) const;
+
+    template<class Function>
+    void for_each(Function function) const;
+
+    void reserve(size_t count);
+
+    void clear();
+
+private:
+    static constexpr bool OptimisticReads = OptimisticFind && std::is_trivially_copyable<KeyType>::value &&
+                                            std::is_trivially_copyable<ValueType>::value;
+
+    struct alignas(64) Shard_ {
+    public:
+        Shard_(const Hash& hasher, const KeyEqual& key_equal) : table_(hasher, key_equal) {}
+
+        mutable std::shared_mutex mutex_;
+        std::atomic<uint64_t> version_{0};
+        mutable std::atomic<size_t> readers_{0};
+        std::atomic<size_t> size_{0};
+        SubTable<KeyType, ValueType, Hash, KeyEqual, Probe> table_;
+    };
+
+    // Holds the shard lock and keeps the version odd while the shard is being modified
+    class WriteGuard_ {
+    public:
+        WriteGuard_(Shard_& shard, bool reallocates);
+
+        WriteGuard_(const WriteGuard_& other) = delete;
+
+        WriteGuard_& operator=(const WriteGuard_& other) = delete;
+
+        ~WriteGuard_();
+
+    private:
+        Shard_& shard_;
+    };
+
+    Hash hasher_;
+    std::vector<std::unique_ptr<Shard_>> shards_;
+
+    Shard_& ShardOf(const KeyType& key);
+
+    const Shard_& ShardOf(const KeyType& key) const;
+
+    bool FindOptimistic(const Shard_& shard, const KeyType& key, ValueType* value, bool& found) const;
+};
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::ConcurrentHashMap(size_t shard_count, const Hash& hasher,
+                                                                                const KeyEqual& key_equal) :
+                                                                                                    hasher_(hasher) {
+    size_t count = 1;
+    while (count < shard_count) {
+        count *= 2;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        shards_.emplace_back(new Shard_(hasher_, key_equal));
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+size_t ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::size() const {
+    size_t size = 0;
+    for (auto& shard : shards_) {
+        size += shard->size_.load(std::memory_order_relaxed);
+    }
+    return size;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+bool ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::empty() const {
+    return size() == 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+Hash ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::hash_function() const {
+    return hasher_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+size_t ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::shard_count() const {
+    return shards_.size();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+bool ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::insert(std::pair<KeyType, ValueType> element) {
+    Shard_& shard = ShardOf(element.first);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+    WriteGuard_ guard(shard, shard.table_.IsFull());
+    bool inserted = shard.table_.insert(std::move(element));
+    shard.size_.store(shard.table_.size(), std::memory_order_relaxed);
+    return inserted;
+}
+
+// Returns true if the key was inserted and false if the value of an existing key was replaced
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+bool ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::insert_or_assign(KeyType key, ValueType value) {
+    Shard_& shard = ShardOf(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+    WriteGuard_ guard(shard, shard.table_.IsFull());
+    bool inserted = shard.table_.insert_or_assign(std::move(key), std::move(value)).second;
+    shard.size_.store(shard.table_.size(), std::memory_order_relaxed);
+    return inserted;
+}
+
+// Calls function(value) for the value of the key under the shard lock. Returns false if there is no such key
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+template<class Function>
+bool ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::update(const KeyType& key, Function function) {
+    Shard_& shard = ShardOf(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+    auto it = shard.table_.find(key);
+    if (it == shard.table_.end()) {
+        return false;
+    }
+    WriteGuard_ guard(shard, false);
+    function(it->second);
+    return true;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+bool ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::erase(const KeyType& key) {
+    Shard_& shard = ShardOf(key);
+    std::unique_lock<std::shared_mutex> lock(shard.mutex_);
+    if (!shard.table_.IsExist(key)) {
+        return false;
+    }
+    // Shards keep min_load_factor 0, so an erase never shrinks the buckets under an optimistic reader
+    WriteGuard_ guard(shard, false);
+    shard.table_.erase(key);
+    shard.size_.store(shard.table_.size(), std::memory_order_relaxed);
+    return true;
+}
+
+// Erases every element for which predicate(element) is true, shard by shard. Returns the number of erased elements
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+template<class Predicate>
+size_t ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::erase_if(Predicate predicate) {
+    size_t erased = 0;
+    for (auto& shard : shards_) {
+        std::unique_lock<std::shared_mutex> lock(shard->mutex_);
+        std::vector<KeyType> keys;
+        for (auto& element : shard->table_) {
+            if (predicate(static_cast<const std::pair<const KeyType, ValueType>&>(element))) {
+                keys.push_back(element.first);
+            }
+        }
+        if (keys.empty()) {
+            continue;
+        }
+        WriteGuard_ guard(*shard, false);
+        for (auto& key : keys) {
+            shard->table_.erase(key);
+        }
+        shard->size_.store(shard->table_.size(), std::memory_order_relaxed);
+        erased += keys.size();
+    }
+    return erased;
+}
+
+// Copies the value of the key into value. Returns false if there is no such key
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+bool ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::find(const KeyType& key, ValueType& value) const {
+    const Shard_& shard = ShardOf(key);
+    bool found = false;
+    if (FindOptimistic(shard, key, &value, found)) {
+        return found;
+    }
+    std::shared_lock<std::shared_mutex> lock(shard.mutex_);
+    auto it = shard.table_.find(key);
+    if (it == shard.table_.end()) {
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+bool ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::contains(const KeyType& key) const {
+    const Shard_& shard = ShardOf(key);
+    if constexpr (OptimisticReads) {
+        bool found = false;
+        if (FindOptimistic(shard, key, nullptr, found)) {
+            return found;
+        }
+    }
+    std::shared_lock<std::shared_mutex> lock(shard.mutex_);
+    return shard.table_.IsExist(key);
+}
+
+// Calls function(element) for every element, every shard is locked in shared mode while it is visited
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+template<class Function>
+void ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::for_each(Function function) const {
+    for (auto& shard : shards_) {
+        std::shared_lock<std::shared_mutex> lock(shard->mutex_);
+        const auto& table = shard->table_;
+        table.for_each(std::ref(function));
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+void ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::reserve(size_t count) {
+    double expected = (double)count / (double)shards_.size();
+    size_t per_shard = (size_t)std::ceil(expected + 4 * std::sqrt(expected));
+    for (auto& shard : shards_) {
+        std::unique_lock<std::shared_mutex> lock(shard->mutex_);
+        WriteGuard_ guard(*shard, true);
+        shard->table_.reserve(per_shard);
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+void ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::clear() {
+    for (auto& shard : shards_) {
+        std::unique_lock<std::shared_mutex> lock(shard->mutex_);
+        WriteGuard_ guard(*shard, true);
+        shard->table_.clear();
+        shard->size_.store(0, std::memory_order_relaxed);
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+typename ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::Shard_&
+                              ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::ShardOf(const KeyType& key) {
+    return *shards_[(HashMix<Hash>::Mix(hasher_(key)) >> SubtableHashShift) & (shards_.size() - 1)];
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+const typename ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::Shard_&
+                       ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::ShardOf(const KeyType& key) const {
+    return *shards_[(HashMix<Hash>::Mix(hasher_(key)) >> SubtableHashShift) & (shards_.size() - 1)];
+}
+
+/*
+    Lock-free lookup. Returns false if it has not managed to read a consistent state of the shard,
+    otherwise found tells whether the key is in the map and value, unless it is null, holds its copy.
+    Reading the shard while it is being modified is harmless for trivially copyable types on the supported compilers,
+    though formally a data race: the result of such read is thrown away because the version has changed.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+bool ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::FindOptimistic(const Shard_& shard, const KeyType& key,
+                                                                                  ValueType* value, bool& found) const {
+    if constexpr (!OptimisticReads) {
+        return false;
+    }
+    for (size_t attempt = 0; attempt < OptimisticAttempts; ++attempt) {
+        shard.readers_.fetch_add(1);
+        uint64_t version = shard.version_.load();
+        if (version % 2 == 0) {
+            const auto& table = shard.table_;
+            auto it = table.find(key);
+            found = it != table.end();
+            if (found && value != nullptr) {
+                *value = it->second;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            bool consistent = shard.version_.load(std::memory_order_relaxed) == version;
+            shard.readers_.fetch_sub(1);
+            if (consistent) {
+                return true;
+            }
+        } else {
+            shard.readers_.fetch_sub(1);
+        }
+        std::this_thread::yield();
+    }
+    return false;
+}
+
+/*
+    A reader increments the readers counter before it checks the version and a writer makes the version odd
+    before it checks the counter, so a writer which waits for zero readers can free memory safely:
+    any reader which comes after that sees the odd version and does not touch the table.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::WriteGuard_::WriteGuard_(Shard_& shard, bool reallocates) :
+                                                                                                    shard_(shard) {
+    shard_.version_.fetch_add(1);
+    if (reallocates && OptimisticReads) {
+        while (shard_.readers_.load() != 0) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+ConcurrentHashMap<KeyType, ValueType, Hash, KeyEqual, Probe>::WriteGuard_::~WriteGuard_() {
+    shard_.version_.fetch_add(1, std::memory_order_release);
+}
+
+#endif //MY_OWN_HASH_TABLE_CONCURRENT_HASH_MAP_H
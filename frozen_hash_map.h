@@ -0,0 +1,494 @@
+/*
+    FrozenHashMap is a read-only copy of a HashMap laid out for lookups only.
+
+    All elements live in one allocation, sorted by their mixed hash (see HashMix), so there are no empty buckets,
+    no probe sequence lengths and no subtables. A directory indexed by the high bits of the hash gives
+    the first element of every run of equal high bits, and a 32-bit fingerprint of the low bits is kept
+    next to every element, so a lookup reads two directory entries and then compares keys only on a matching
+    fingerprint. The directory has a slot for every element, so runs hold one element on average.
+
+    Nothing changes the map after it is built, so any number of threads may read it at once without locks.
+    A map which is read for a long time can be built once, for example from a HashMap restored by load_mapped,
+    and then the HashMap may be freed.
+*/
+
+#ifndef MY_OWN_HASH_TABLE_FROZEN_HASH_MAP_H
+#define MY_OWN_HASH_TABLE_FROZEN_HASH_MAP_H
+
+#include "hash_map.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+         class Allocator = std::allocator<std::pair<const KeyType, ValueType>>>
+class FrozenHashMap {
+    using Layout_ = ElementLayout<KeyType, ValueType>;
+    using Element_ = typename Layout_::Element;
+    // What the allocation holds, the elements are never moved, so the key stays const
+    using Slot_ = std::remove_const_t<Element_>;
+    using SlotAllocator_ = typename std::allocator_traits<Allocator>::template rebind_alloc<Slot_>;
+
+public:
+    using key_type = KeyType;
+    using mapped_type = ValueType;
+    using value_type = Element_;
+    using size_type = size_t;
+    using hasher = Hash;
+    using key_equal = KeyEqual;
+    using allocator_type = Allocator;
+    using const_iterator = const Element_*;
+    using iterator = const_iterator;
+
+    FrozenHashMap();
+
+    template<class Probe>
+    explicit FrozenHashMap(const HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& map);
+
+    FrozenHashMap(const FrozenHashMap& other);
+
+    FrozenHashMap(FrozenHashMap&& other) noexcept;
+
+    FrozenHashMap& operator=(const FrozenHashMap& other);
+
+    FrozenHashMap& operator=(FrozenHashMap&& other) noexcept(StealsOnMove<Allocator>::value);
+
+    ~FrozenHashMap();
+
+    size_t size() const;
+
+    bool empty() const;
+
+    Hash hash_function() const;
+
+    KeyEqual key_eq() const;
+
+    Allocator get_allocator() const;
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    const_iterator find(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    const_iterator find(const Key& key) const;
+
+    bool contains(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    bool contains(const Key& key) const;
+
+    size_t count(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    size_t count(const Key& key) const;
+
+    const ValueType &at(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    const ValueType &at(const Key& key) const;
+
+    void find_batch(const KeyType* keys, size_t count, const_iterator* result) const;
+
+    void prefetch(const KeyType& key) const;
+
+    void swap(FrozenHashMap& other) noexcept;
+
+private:
+    Hash hasher_;
+    KeyEqual key_equal_;
+    SlotAllocator_ allocator_;
+    // The directory of an empty map without an allocation, two empty runs
+    static inline uint32_t EmptyOffsets_[3] = {};
+    // The allocation: size_ elements, then size_ fingerprints and then the directory of (1 << bits) + 1 offsets
+    Slot_* storage_ = nullptr;
+    size_t slots_ = 0;
+    size_t size_ = 0;
+    uint32_t* fingerprints_ = EmptyOffsets_;
+    uint32_t* offsets_ = EmptyOffsets_;
+    size_t shift_ = std::numeric_limits<size_t>::digits - 1;
+
+    FrozenHashMap(const FrozenHashMap& other, const SlotAllocator_& allocator);
+
+    template<class Key>
+    size_t HashOf(const Key& key) const;
+
+    size_t Run(size_t hash) const;
+
+    static uint32_t Fingerprint(size_t hash);
+
+    template<class Key>
+    const_iterator FindHashed(const Key& key, size_t hash) const;
+
+    template<class Key>
+    const ValueType& At(const Key& key) const;
+
+    void Allocate(size_t size, size_t bits);
+
+    void Deallocate();
+
+    void SwapStorage(FrozenHashMap& other) noexcept;
+};
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::FrozenHashMap() = default;
+
+/*
+    Builds the frozen copy of map. The elements are copied in the order of their hashes, the hasher, the key_equal
+    and the allocator are taken from map. Building hashes every key once and sorts the hashes.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+template<class Probe>
+FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::FrozenHashMap(
+        const HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& map) : hasher_(map.hash_function()),
+                                                                                   key_equal_(map.key_eq()),
+                                                                                   allocator_(map.get_allocator()) {
+    if (map.empty()) {
+        return;
+    }
+    if (map.size() > std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("too many elements for FrozenHashMap");
+    }
+    std::vector<std::pair<size_t, const Element_*>> order;
+    order.reserve(map.size());
+    for (auto& element : map) {
+        order.emplace_back(HashOf(Layout_::Key(element)), &element);
+    }
+    std::sort(order.begin(), order.end(), [](const auto& left, const auto& right) {
+        return left.first < right.first;
+    });
+    size_t bits = 1;
+    while (((size_t)1 << bits) < order.size()) {
+        ++bits;
+    }
+    Allocate(order.size(), bits);
+    try {
+        for (; size_ < order.size(); ++size_) {
+            std::allocator_traits<SlotAllocator_>::construct(allocator_, storage_ + size_, *order[size_].second);
+        }
+    } catch (...) {
+        Deallocate();
+        throw;
+    }
+    size_t runs = (size_t)1 << bits;
+    size_t position = 0;
+    for (size_t run = 0; run <= runs; ++run) {
+        while (position < order.size() && Run(order[position].first) < run) {
+            ++position;
+        }
+        offsets_[run] = (uint32_t)position;
+    }
+    for (size_t i = 0; i < order.size(); ++i) {
+        fingerprints_[i] = Fingerprint(order[i].first);
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::FrozenHashMap(const FrozenHashMap& other) :
+        FrozenHashMap(other, std::allocator_traits<SlotAllocator_>::select_on_container_copy_construction(other.allocator_)) {
+}
+
+// Copies the elements of other one by one into an allocation of allocator
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::FrozenHashMap(const FrozenHashMap& other,
+                                                                            const SlotAllocator_& allocator) :
+        hasher_(other.hasher_),
+        key_equal_(other.key_equal_),
+        allocator_(allocator) {
+    if (other.storage_ == nullptr) {
+        return;
+    }
+    Allocate(other.size_, std::numeric_limits<size_t>::digits - other.shift_);
+    try {
+        for (; size_ < other.size_; ++size_) {
+            std::allocator_traits<SlotAllocator_>::construct(allocator_, storage_ + size_, other.storage_[size_]);
+        }
+    } catch (...) {
+        Deallocate();
+        throw;
+    }
+    std::memcpy(fingerprints_, other.fingerprints_, size_ * sizeof(uint32_t));
+    std::memcpy(offsets_, other.offsets_, (Run(~(size_t)0) + 2) * sizeof(uint32_t));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::FrozenHashMap(FrozenHashMap&& other) noexcept :
+        hasher_(other.hasher_),
+        key_equal_(other.key_equal_),
+        allocator_(other.allocator_) {
+    SwapStorage(other);
+}
+
+// The allocator is replaced only if it propagates on copy assignment, as in the standard containers
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>&
+        FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::operator=(const FrozenHashMap& other) {
+    if (this != &other) {
+        constexpr bool propagate = std::allocator_traits<SlotAllocator_>::propagate_on_container_copy_assignment::value;
+        FrozenHashMap copy(other, propagate ? other.allocator_ : allocator_);
+        // The old allocation is freed by the allocator which made it
+        Deallocate();
+        if constexpr (propagate) {
+            allocator_ = other.allocator_;
+        }
+        hasher_ = other.hasher_;
+        key_equal_ = other.key_equal_;
+        SwapStorage(copy);
+    }
+    return *this;
+}
+
+// With allocators which are not equal and do not propagate the elements of other are copied one by one
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>&
+        FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::operator=(FrozenHashMap&& other)
+        noexcept(StealsOnMove<Allocator>::value) {
+    if (this == &other) {
+        return *this;
+    }
+    if constexpr (!StealsOnMove<Allocator>::value) {
+        if (allocator_ != other.allocator_) {
+            FrozenHashMap copy(other, allocator_);
+            Deallocate();
+            hasher_ = other.hasher_;
+            key_equal_ = other.key_equal_;
+            SwapStorage(copy);
+            other.Deallocate();
+            return *this;
+        }
+    }
+    Deallocate();
+    if constexpr (std::allocator_traits<SlotAllocator_>::propagate_on_container_move_assignment::value) {
+        allocator_ = std::move(other.allocator_);
+    }
+    hasher_ = std::move(other.hasher_);
+    key_equal_ = std::move(other.key_equal_);
+    SwapStorage(other);
+    return *this;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::~FrozenHashMap() {
+    Deallocate();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+size_t FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::size() const {
+    return size_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+bool FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::empty() const {
+    return size_ == 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+Hash FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::hash_function() const {
+    return hasher_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+KeyEqual FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::key_eq() const {
+    return key_equal_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+Allocator FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::get_allocator() const {
+    return Allocator(allocator_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+typename FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::const_iterator
+        FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::begin() const {
+    return storage_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+typename FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::const_iterator
+        FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::end() const {
+    return storage_ + size_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+typename FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::const_iterator
+        FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::find(const KeyType& key) const {
+    return FindHashed(key, HashOf(key));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+template<class Key, class>
+typename FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::const_iterator
+        FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::find(const Key& key) const {
+    return FindHashed(key, HashOf(key));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+bool FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::contains(const KeyType& key) const {
+    return find(key) != end();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+template<class Key, class>
+bool FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::contains(const Key& key) const {
+    return find(key) != end();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+size_t FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::count(const KeyType& key) const {
+    return contains(key) ? 1 : 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+template<class Key, class>
+size_t FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::count(const Key& key) const {
+    return contains(key) ? 1 : 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+const ValueType &FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::at(const KeyType& key) const {
+    return At(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+template<class Key, class>
+const ValueType &FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::at(const Key& key) const {
+    return At(key);
+}
+
+/*
+    Looks up count keys into result, in windows of BatchWindow keys like HashMap::find_batch. The directory
+    entries of the whole window are prefetched first, then the runs they point to, so the misses of
+    the keys overlap instead of following one another.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+void FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::find_batch(const KeyType* keys, size_t count,
+                                                                             const_iterator* result) const {
+    size_t hashes[BatchWindow];
+    for (size_t start = 0; start < count; start += BatchWindow) {
+        size_t window = std::min(BatchWindow, count - start);
+        for (size_t i = 0; i < window; ++i) {
+            hashes[i] = HashOf(keys[start + i]);
+            __builtin_prefetch(offsets_ + Run(hashes[i]));
+        }
+        for (size_t i = 0; i < window; ++i) {
+            uint32_t first = offsets_[Run(hashes[i])];
+            __builtin_prefetch(fingerprints_ + first);
+            __builtin_prefetch(storage_ + first);
+        }
+        for (size_t i = 0; i < window; ++i) {
+            result[start + i] = FindHashed(keys[start + i], hashes[i]);
+        }
+    }
+}
+
+// Asks the CPU to load the directory entry of the key, so a following lookup waits only for its run
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+void FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::prefetch(const KeyType& key) const {
+    __builtin_prefetch(offsets_ + Run(HashOf(key)));
+}
+
+// The allocators are swapped only if they propagate on swap, otherwise they must be equal, as in the standard containers
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+void FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::swap(FrozenHashMap& other) noexcept {
+    using std::swap;
+    swap(hasher_, other.hasher_);
+    swap(key_equal_, other.key_equal_);
+    if constexpr (std::allocator_traits<SlotAllocator_>::propagate_on_container_swap::value) {
+        swap(allocator_, other.allocator_);
+    }
+    SwapStorage(other);
+}
+
+// The allocation moves with the allocator that made it, other gets the empty directory of this map
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+void FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::SwapStorage(FrozenHashMap& other) noexcept {
+    using std::swap;
+    swap(storage_, other.storage_);
+    swap(slots_, other.slots_);
+    swap(size_, other.size_);
+    swap(fingerprints_, other.fingerprints_);
+    swap(offsets_, other.offsets_);
+    swap(shift_, other.shift_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+template<class Key>
+size_t FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::HashOf(const Key& key) const {
+    return HashMix<Hash>::Mix(hasher_(key));
+}
+
+// The high bits of the hash select the run, so the runs are in the order of the sorted hashes
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+size_t FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::Run(size_t hash) const {
+    return hash >> shift_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+uint32_t FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::Fingerprint(size_t hash) {
+    return static_cast<uint32_t>(hash);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+template<class Key>
+typename FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::const_iterator
+        FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::FindHashed(const Key& key, size_t hash) const {
+    size_t run = Run(hash);
+    uint32_t fingerprint = Fingerprint(hash);
+    for (uint32_t i = offsets_[run], last = offsets_[run + 1]; i < last; ++i) {
+        if (fingerprints_[i] == fingerprint && key_equal_(Layout_::Key(storage_[i]), key)) {
+            return storage_ + i;
+        }
+    }
+    return end();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+template<class Key>
+const ValueType& FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::At(const Key& key) const {
+    static_assert(!std::is_same_v<ValueType, NoValue>, "a set has no values");
+    auto element = find(key);
+    if (element == end()) {
+        throw std::out_of_range("no such key in FrozenHashMap");
+    }
+    return element->second;
+}
+
+// One allocation of slots for the elements and the two arrays of uint32_t behind them, no element is constructed
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+void FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::Allocate(size_t size, size_t bits) {
+    size_t runs = (size_t)1 << bits;
+    size_t elements = (size * sizeof(Slot_) + alignof(uint32_t) - 1) / alignof(uint32_t) * alignof(uint32_t);
+    size_t bytes = elements + (size + runs + 1) * sizeof(uint32_t);
+    slots_ = (bytes + sizeof(Slot_) - 1) / sizeof(Slot_);
+    storage_ = std::allocator_traits<SlotAllocator_>::allocate(allocator_, slots_);
+    fingerprints_ = reinterpret_cast<uint32_t*>(reinterpret_cast<char*>(storage_) + elements);
+    offsets_ = fingerprints_ + size;
+    shift_ = std::numeric_limits<size_t>::digits - bits;
+    size_ = 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Allocator>
+void FrozenHashMap<KeyType, ValueType, Hash, KeyEqual, Allocator>::Deallocate() {
+    if (storage_ == nullptr) {
+        return;
+    }
+    for (size_t i = 0; i < size_; ++i) {
+        std::allocator_traits<SlotAllocator_>::destroy(allocator_, storage_ + i);
+    }
+    std::allocator_traits<SlotAllocator_>::deallocate(allocator_, storage_, slots_);
+    storage_ = nullptr;
+    size_ = 0;
+    fingerprints_ = EmptyOffsets_;
+    offsets_ = EmptyOffsets_;
+    shift_ = std::numeric_limits<size_t>::digits - 1;
+}
+
+// The frozen copy of a HashSet
+template<class KeyType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+         class Allocator = std::allocator<KeyType>>
+using FrozenHashSet = FrozenHashMap<KeyType, NoValue, Hash, KeyEqual, Allocator>;
+
+#endif //MY_OWN_HASH_TABLE_FROZEN_HASH_MAP_H
@@ -9,838 +9,5236 @@
     will grow. Other SubTables will have the same size.
 
     And its allow to use SubTable as a stand-alone hash table. It has all methods of a hash table.
+
+    SubTable keeps a one byte metadata array next to the buckets: 0 marks an empty bucket, any other value is PSL + 1.
+    Lookups scan the metadata with a probe policy (ScalarProbe, SseProbe or Avx2Probe) and touch a bucket only
+    when its PSL says the key there has the same home position as the one we are looking for.
 */
 
 #ifndef MY_OWN_HASH_TABLE_HASH_MAP_H
 #define MY_OWN_HASH_TABLE_HASH_MAP_H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <exception>
+#include <functional>
 #include <iterator>
+#include <limits>
 #include <initializer_list>
+#include <istream>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <ostream>
 #include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-const size_t SubtableSize = 1 << 3;
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// find_async is there only if the compiler has C++20 coroutines
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define MY_OWN_HASH_TABLE_COROUTINES
+#endif
+
+const size_t SubtableSize = 1 << 3;
+
+// Metadata value of an empty bucket
+const uint8_t EmptyMeta = 0;
+
+// Metadata value of every bucket with PSL >= SaturatedMeta - 1. Exact PSL of such bucket is computed from its key
+const uint8_t SaturatedMeta = 255;
+
+// Bounds of the max load factor of a SubTable
+const double MinLoadFactor = 0.1;
+const double MaxLoadFactor = 0.95;
+
+// The metadata array has this many extra bytes at the end which mirror its beginning, so a probe group never wraps
+const size_t MetaPadding = 32;
+
+// Batched operations hash and prefetch this many keys before they resolve any of them
+const size_t BatchWindow = 16;
+
+// A subtable is chosen by the hash shifted by this many bits, a bucket of a subtable by the low bits of the hash
+const size_t SubtableHashShift = sizeof(size_t) * 4;
+
+// HugePageAllocator aligns allocations of at least this many bytes to it
+const size_t HugePageSize = 2 << 20;
+
+// NumaAllocator places allocations of at least this many bytes, memory is placed by whole pages
+const size_t NumaPageSize = 1 << 12;
+
+// Version of the snapshot format written by HashMap::save, a snapshot of another version is not loaded
+const uint32_t SnapshotVersion = 2;
+
+// Every array of a snapshot starts at a multiple of it, so a mapped snapshot can be used in place
+const size_t SnapshotAlignment = 64;
+
+/*
+    Probe policies compare a group of Width metadata bytes that starts at meta with the expected
+    values first, first + 1, ..., first + Width - 1 (PSL + 1 of a key that started at the first byte).
+    Bit i of match is set if byte i is equal to the expected value, bit i of stop is set if byte i is less than it,
+    which means that the key can not be at byte i or further. first + Width - 1 must be less than SaturatedMeta.
+*/
+struct ScalarProbe {
+    static constexpr size_t Width = 1;
+
+    static void Match(const uint8_t* meta, uint8_t first, uint32_t& match, uint32_t& stop) {
+        match = *meta == first;
+        stop = *meta < first;
+    }
+};
+
+#ifdef __SSE2__
+struct SseProbe {
+    static constexpr size_t Width = 16;
+
+    static void Match(const uint8_t* meta, uint8_t first, uint32_t& match, uint32_t& stop) {
+        const __m128i offsets = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(meta));
+        __m128i expected = _mm_add_epi8(_mm_set1_epi8(static_cast<char>(first)), offsets);
+        match = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, expected)));
+        uint32_t not_less = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(group, expected),
+                                                                                   group)));
+        stop = ~not_less & 0xFFFF;
+    }
+};
+#endif
+
+#ifdef __AVX2__
+struct Avx2Probe {
+    static constexpr size_t Width = 32;
+
+    static void Match(const uint8_t* meta, uint8_t first, uint32_t& match, uint32_t& stop) {
+        const __m256i offsets = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                                 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+        __m256i group = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(meta));
+        __m256i expected = _mm256_add_epi8(_mm256_set1_epi8(static_cast<char>(first)), offsets);
+        match = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(group, expected)));
+        stop = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(group, expected),
+                                                                             group)));
+    }
+};
+#endif
+
+/*
+    Returns the first occupied bucket in the metadata [meta, end) or end. Empty buckets are skipped 16 bytes
+    (with SSE2) or 8 bytes at a time, so a sparse table is iterated at the speed of its metadata.
+    The last group may run over end into the padding of the metadata array, its bytes there are ignored.
+*/
+inline const uint8_t* NextOccupied(const uint8_t* meta, const uint8_t* end) {
+    while (meta < end) {
+#ifdef __SSE2__
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(meta));
+        uint32_t occupied = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_setzero_si128())))
+                            & 0xFFFF;
+        if (occupied != 0) {
+            return std::min(meta + __builtin_ctz(occupied), end);
+        }
+        meta += 16;
+#else
+        uint64_t group;
+        std::memcpy(&group, meta, sizeof(group));
+        if (group != 0) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            return std::min(meta + (__builtin_clzll(group) >> 3), end);
+#else
+            return std::min(meta + (__builtin_ctzll(group) >> 3), end);
+#endif
+        }
+        meta += sizeof(group);
+#endif
+    }
+    return end;
+}
+
+#if defined(__AVX2__)
+using DefaultProbe = Avx2Probe;
+#elif defined(__SSE2__)
+using DefaultProbe = SseProbe;
+#else
+using DefaultProbe = ScalarProbe;
+#endif
+
+/*
+    Runtime configuration of HashMap.
+
+    subtable_count is rounded up to a power of two. More subtables make every single rehash smaller,
+    because a subtable holds about size() / subtable_count elements.
+
+    candidates is the number of subtables a key may be stored in. With one candidate every key lives in the subtable
+    picked by the low bits of its hash and every subtable grows on its own at load factor 0.5. With two or more
+    candidates HashMap works like DySECT: the candidates come from independent bits of the hash, a new key goes
+    to the least loaded of them, and when all of them are full an element is displaced from one of them into
+    one of its own candidates. Only when displacement fails the most loaded candidate grows. It allows subtables
+    to run at displacement_load_factor instead of max_load_factor, which is much higher.
+*/
+struct HashMapOptions {
+    size_t subtable_count = SubtableSize;
+    double max_load_factor = 0.5;
+    size_t candidates = 1;
+    double displacement_load_factor = 0.9;
+    // How many elements of a full subtable are checked when looking for one that can be displaced
+    size_t displacement_window = 32;
+    // How many buckets every operation moves during a rehash, 0 rehashes a subtable at once (see SubTable)
+    size_t incremental_rehash = 0;
+    // A subtable is halved when an erase leaves it loaded less than that, 0 never shrinks (see SubTable)
+    double min_load_factor = 0;
+    // The map keeps at most that many elements and evicts the old ones to insert new ones, 0 is no limit (see SubTable)
+    size_t size_limit = 0;
+    // The subtables are split into that many equal blocks, one for every NUMA node, 0 does not place them (see HashMap)
+    size_t numa_nodes = 0;
+    // A subtable grows early or is reseeded when an insert probes further than that, 0 turns it off (see SubTable)
+    size_t max_psl = 0;
+};
+
+/*
+    Lookups by a type Key other than the key type of the map are enabled if both Hash and KeyEqual are transparent
+    (declare is_transparent) and so accept Key as it is. Key only delays the check until such lookup is used.
+*/
+template<class Hash, class KeyEqual, class Key, class = void>
+struct IsTransparent : std::false_type {};
+
+template<class Hash, class KeyEqual, class Key>
+struct IsTransparent<Hash, KeyEqual, Key, std::void_t<typename Hash::is_transparent,
+                                                      typename KeyEqual::is_transparent>> : std::true_type {};
+
+/*
+    HashMix is applied to every hash before it is used. Buckets are taken from the low bits of the mixed hash and
+    subtables from its high bits, so a weak hash (std::hash of an integer is the identity) is mixed with
+    a multiply-shift finalizer which makes all bits of the result depend on all bits of the key.
+    A hash which is already strong opts out by declaring is_avalanching. HashMix may be specialized for a Hash too.
+*/
+template<class Hash, class = void>
+struct HashMix {
+    static size_t Mix(size_t hash) {
+#ifdef __SIZEOF_INT128__
+        unsigned __int128 product = static_cast<unsigned __int128>(hash) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(product) ^ static_cast<size_t>(product >> 64);
+#else
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDull;
+        return hash ^ (hash >> 33);
+#endif
+    }
+};
+
+template<class Hash>
+struct HashMix<Hash, std::void_t<typename Hash::is_avalanching>> {
+    static size_t Mix(size_t hash) {
+        return hash;
+    }
+};
+
+/*
+    The tables of a Hash which declares stores_hash keep the mixed hash of every element in its bucket.
+    Rehashes, displacement and eviction take it from there instead of hashing the key again, and lookups compare it
+    before the keys, which pays off for keys that are expensive to hash or to compare (long strings).
+    It costs a size_t per bucket. StoresHash may be specialized for a Hash too, such as std::hash<std::string>.
+*/
+template<class Hash, class = void>
+struct StoresHash : std::false_type {};
+
+template<class Hash>
+struct StoresHash<Hash, std::void_t<typename Hash::stores_hash>> : std::true_type {};
+
+// Move assignment may take the memory of the other table only if the allocators can not differ or are moved too
+template<class Allocator>
+struct StealsOnMove : std::bool_constant<std::allocator_traits<Allocator>::is_always_equal::value ||
+                                      std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value> {};
+
+/*
+    The tables take all their memory from Allocator, so they work with std::pmr::polymorphic_allocator
+    (a std::pmr::monotonic_buffer_resource for short-lived maps which is freed at once) and with any other allocator.
+
+    HugePageAllocator is an allocator for large tables. Allocations of HugePageSize or more (big bucket arrays)
+    are aligned to 2MB and on Linux are advised to be backed by transparent huge pages, so lookups in a large table
+    miss the TLB much less. Smaller allocations go to operator new as usual.
+*/
+template<class T>
+struct HugePageAllocator {
+    using value_type = T;
+
+    HugePageAllocator() = default;
+
+    template<class U>
+    HugePageAllocator(const HugePageAllocator<U>&) {}
+
+    T* allocate(size_t count) {
+        if (count > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        size_t bytes = count * sizeof(T);
+        if (bytes < HugePageSize) {
+            return static_cast<T*>(::operator new(bytes));
+        }
+        void* memory = ::operator new(Rounded(bytes), std::align_val_t(HugePageSize));
+#ifdef MADV_HUGEPAGE
+        madvise(memory, Rounded(bytes), MADV_HUGEPAGE);
+#endif
+        return static_cast<T*>(memory);
+    }
+
+    void deallocate(T* pointer, size_t count) {
+        size_t bytes = count * sizeof(T);
+        if (bytes < HugePageSize) {
+            ::operator delete(pointer);
+        } else {
+            ::operator delete(pointer, std::align_val_t(HugePageSize));
+        }
+    }
+
+    // Whole huge pages are allocated, so madvise never touches memory of another allocation
+    static size_t Rounded(size_t bytes) {
+        return (bytes + HugePageSize - 1) / HugePageSize * HugePageSize;
+    }
+
+    template<class U>
+    bool operator==(const HugePageAllocator<U>&) const {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const HugePageAllocator<U>&) const {
+        return false;
+    }
+};
+
+/*
+    True for allocators which construct and destroy elements with nothing but placement new and the destructor.
+    Tables of trivially copyable elements with such an allocator move whole runs of buckets with memmove.
+*/
+template<class Allocator>
+struct PlainConstruct : std::false_type {};
+
+template<class T>
+struct PlainConstruct<std::allocator<T>> : std::true_type {};
+
+template<class T>
+struct PlainConstruct<HugePageAllocator<T>> : std::true_type {};
+
+/*
+    NumaAllocator asks the kernel to place its allocations of NumaPageSize or more on its NUMA node. The node is
+    only preferred (MPOL_PREFERRED), so the memory comes from another node when that one is full, and without
+    Linux or with no node (-1) it is a plain operator new. Allocators of different nodes are not equal.
+    HashMap gives every subtable an allocator of its node through on_node (see HashMapOptions::numa_nodes).
+*/
+template<class T>
+struct NumaAllocator {
+    using value_type = T;
+
+    NumaAllocator() = default;
+
+    explicit NumaAllocator(int node) : node_(node) {}
+
+    template<class U>
+    NumaAllocator(const NumaAllocator<U>& other) : node_(other.node_) {}
+
+    T* allocate(size_t count) {
+        if (count > std::numeric_limits<size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        size_t bytes = count * sizeof(T);
+        if (!Placed(bytes)) {
+            return static_cast<T*>(::operator new(bytes));
+        }
+        void* memory = ::operator new(Rounded(bytes), std::align_val_t(NumaPageSize));
+#ifdef SYS_mbind
+        if (node_ < 64) {
+            unsigned long nodes = 1ul << node_;
+            // MPOL_PREFERRED, the pages are not touched yet, so they are placed when they are first written.
+            // The kernel reads maxnode - 1 bits of the mask, so all 64 bits need maxnode 65
+            syscall(SYS_mbind, memory, Rounded(bytes), 1, &nodes, sizeof(nodes) * 8 + 1, 0);
+        }
+#endif
+        return static_cast<T*>(memory);
+    }
+
+    void deallocate(T* pointer, size_t count) {
+        if (!Placed(count * sizeof(T))) {
+            ::operator delete(pointer);
+        } else {
+            ::operator delete(pointer, std::align_val_t(NumaPageSize));
+        }
+    }
+
+    NumaAllocator on_node(int node) const {
+        return NumaAllocator(node);
+    }
+
+    int node() const {
+        return node_;
+    }
+
+    // Whole pages are allocated, so the placement never moves memory of another allocation
+    static size_t Rounded(size_t bytes) {
+        return (bytes + NumaPageSize - 1) / NumaPageSize * NumaPageSize;
+    }
+
+    bool Placed(size_t bytes) const {
+        return node_ >= 0 && bytes >= NumaPageSize;
+    }
+
+    template<class U>
+    bool operator==(const NumaAllocator<U>& other) const {
+        return node_ == other.node_;
+    }
+
+    template<class U>
+    bool operator!=(const NumaAllocator<U>& other) const {
+        return node_ != other.node_;
+    }
+
+    int node_ = -1;
+};
+
+template<class T>
+struct PlainConstruct<NumaAllocator<T>> : std::true_type {};
+
+// An allocator with on_node(node) returns a copy of itself which places the memory on that NUMA node
+template<class Allocator, class = void>
+struct PlacesOnNode : std::false_type {};
+
+template<class Allocator>
+struct PlacesOnNode<Allocator, std::void_t<decltype(std::declval<const Allocator&>().on_node(0))>> : std::true_type {};
+
+/*
+    Executors run the tasks of the parallel operations of HashMap: executor(count, task) calls task(i) for every
+    i in [0, count), possibly at the same time, and returns when all of them are finished, rethrowing an exception
+    of one of them. Any callable of this form works, for example one that runs std::for_each(std::execution::par)
+    over the indices or one that submits them to a thread pool. ThreadExecutor starts up to threads std::thread.
+*/
+struct ThreadExecutor {
+    size_t threads = std::thread::hardware_concurrency();
+
+    template<class Task>
+    void operator()(size_t count, const Task& task) const {
+        std::atomic<size_t> next{0};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto worker = [&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                try {
+                    task(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> workers;
+        try {
+            for (size_t i = 1; i < std::min(count, std::max<size_t>(threads, 1)); ++i) {
+                workers.emplace_back(worker);
+            }
+        } catch (...) {
+            next = count;
+            for (auto& thread : workers) {
+                thread.join();
+            }
+            throw;
+        }
+        worker();
+        for (auto& thread : workers) {
+            thread.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+// Runs the tasks one after another in the calling thread, the operations which take an executor are sequential with it
+struct SequentialExecutor {
+    template<class Task>
+    void operator()(size_t count, const Task& task) const {
+        for (size_t i = 0; i < count; ++i) {
+            task(i);
+        }
+    }
+};
+
+#ifdef MY_OWN_HASH_TABLE_STATS
+/*
+    Statistics are collected only if MY_OWN_HASH_TABLE_STATS is defined, otherwise they are compiled out.
+    The probes of a lookup are the buckets it checks in one subtable: the PSL of the found element or of the place
+    where the lookup has stopped plus one. A lookup in a HashMap counts once in every candidate subtable it checks.
+*/
+struct ProbeStats {
+    uint64_t hits = 0;
+    uint64_t hit_probes = 0;
+    uint64_t misses = 0;
+    uint64_t miss_probes = 0;
+
+    ProbeStats& operator+=(const ProbeStats& other) {
+        hits += other.hits;
+        hit_probes += other.hit_probes;
+        misses += other.misses;
+        miss_probes += other.miss_probes;
+        return *this;
+    }
+};
+
+struct SubTableStats {
+    size_t size = 0;
+    size_t capacity = 0;
+    double load = 0;
+    size_t max_psl = 0;
+    double mean_psl = 0;
+    // psl_histogram[i] is the number of elements with PSL i
+    std::vector<size_t> psl_histogram;
+    uint64_t rehash_count = 0;
+    double rehash_seconds = 0;
+    uint64_t evictions = 0;
+    uint64_t reseeds = 0;
+    ProbeStats find;
+    ProbeStats insert;
+    ProbeStats erase;
+};
+
+// imbalance is the size of the largest subtable divided by the mean size of the subtables, 1 is a perfect balance
+struct HashMapStats {
+    size_t size = 0;
+    size_t capacity = 0;
+    double load = 0;
+    size_t min_subtable_size = 0;
+    size_t max_subtable_size = 0;
+    double imbalance = 0;
+    size_t max_psl = 0;
+    double mean_psl = 0;
+    uint64_t rehash_count = 0;
+    double rehash_seconds = 0;
+    uint64_t evictions = 0;
+    uint64_t reseeds = 0;
+    ProbeStats find;
+    ProbeStats insert;
+    ProbeStats erase;
+    std::vector<SubTableStats> subtables;
+};
+#endif
+
+/*
+    The bytes a table takes, counted from its layout. The elements live in the buckets, so the bucket arrays
+    and the metadata hold all of them; payload is what the elements own outside of their buckets (the heap
+    buffer of a long string, say), it is counted only by memory_usage(payload). Whatever the allocator adds
+    to the sizes it is asked for is not counted. The arrays of a mapped snapshot are counted, they are in the mapping.
+*/
+struct MemoryUsage {
+    size_t elements = 0;
+    // Both arrays during an incremental rehash
+    size_t buckets = 0;
+    // The metadata bytes with their padding
+    size_t metadata = 0;
+    // The table objects and the CLOCK marks, and for a HashMap its vector of subtables and their control blocks
+    size_t auxiliary = 0;
+    size_t payload = 0;
+
+    size_t total() const {
+        return buckets + metadata + auxiliary + payload;
+    }
+
+    double bytes_per_element() const {
+        return elements == 0 ? 0 : (double)total() / elements;
+    }
+
+    MemoryUsage& operator+=(const MemoryUsage& other) {
+        elements += other.elements;
+        buckets += other.buckets;
+        metadata += other.metadata;
+        auxiliary += other.auxiliary;
+        payload += other.payload;
+        return *this;
+    }
+};
+
+// The usage of every subtable is in subtables. A subtable shared with a snapshot of the map is counted by both maps
+struct HashMapMemoryUsage : MemoryUsage {
+    std::vector<MemoryUsage> subtables;
+};
+
+// The value type of the tables of HashSet, they store only the keys
+struct NoValue {};
+
+/*
+    The elements of a table: Element is what the iterators point to, Stored is what a bucket holds (the element
+    without the const, so it can be moved when the table is rehashed) and Key returns the key of either of them.
+    A table with NoValue values is a set, its elements are the keys themselves.
+*/
+template<class KeyType, class ValueType>
+struct ElementLayout {
+    using Element = std::pair<const KeyType, ValueType>;
+    using Stored = std::pair<KeyType, ValueType>;
+
+    static const KeyType& Key(const Element& element) {
+        return element.first;
+    }
+
+    static const KeyType& Key(const Stored& element) {
+        return element.first;
+    }
+};
+
+template<class KeyType>
+struct ElementLayout<KeyType, NoValue> {
+    using Element = const KeyType;
+    using Stored = KeyType;
+
+    static const KeyType& Key(const KeyType& key) {
+        return key;
+    }
+};
+
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+         class Probe = DefaultProbe, class Allocator = std::allocator<std::pair<const KeyType, ValueType>>>
+class HashMap;
+
+/*
+    HashSet is a HashMap without values: a bucket holds only a key, the iterators point to const keys and
+    insert takes a key. The parts of the map interface which need a value (operator[], at, try_emplace) are
+    not usable with it.
+*/
+template<class KeyType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+         class Probe = DefaultProbe, class Allocator = std::allocator<KeyType>>
+using HashSet = HashMap<KeyType, NoValue, Hash, KeyEqual, Probe, Allocator>;
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe>
+class ConcurrentHashMap;
+
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+/*
+    What find_async returns. co_await prefetches the home buckets of the key and suspends the coroutine, which is
+    given to promise.schedule(handle) to be resumed later: while other coroutines issue their own prefetches
+    the cache lines arrive, and the lookup after the resume finds them in the cache. The promise of the awaiting
+    coroutine must have schedule (see LookupTask in lookup_scheduler.h). The key is not copied, so it must
+    live until the co_await is over.
+*/
+template<class Table, class Key, class Iterator>
+class FindAwaitable {
+public:
+    FindAwaitable(Table& table, const Key& key) : table_(table), key_(key), hash_(table.HashOf(key)) {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    template<class Promise>
+    void await_suspend(std::coroutine_handle<Promise> handle) const {
+        table_.Prefetch(hash_);
+        handle.promise().schedule(handle);
+    }
+
+    Iterator await_resume() const {
+        return table_.FindHashed(key_, hash_);
+    }
+
+private:
+    Table& table_;
+    const Key& key_;
+    size_t hash_;
+};
+#endif
+
+
+template<class KeyType, class ValueType, class Hash = std::hash<KeyType>, class KeyEqual = std::equal_to<KeyType>,
+         class Probe = DefaultProbe, class Allocator = std::allocator<std::pair<const KeyType, ValueType>>>
+class SubTable {
+    using Layout_ = ElementLayout<KeyType, ValueType>;
+    using Element_ = typename Layout_::Element;
+    using Stored_ = typename Layout_::Stored;
+
+public:
+    class iterator;
+
+    class const_iterator;
+
+    explicit SubTable(const Hash& hasher = Hash(), const KeyEqual& key_equal = KeyEqual(),
+                      const Allocator& allocator = Allocator());
+
+    explicit SubTable(const Allocator& allocator);
+
+    template<class InputIterator>
+    SubTable(InputIterator begin, InputIterator end, Hash hasher = Hash(), const KeyEqual& key_equal = KeyEqual(),
+             const Allocator& allocator = Allocator());
+
+    SubTable(std::initializer_list<Stored_> list, const Hash& hasher = Hash(),
+             const KeyEqual& key_equal = KeyEqual(), const Allocator& allocator = Allocator());
+
+    SubTable(const SubTable &other);
+
+    SubTable(const SubTable &other, const Allocator& allocator);
+
+    SubTable(SubTable &&other) noexcept;
+
+    SubTable(SubTable &&other, const Allocator& allocator);
+
+    SubTable &operator=(const SubTable &other);
+
+    SubTable &operator=(SubTable &&other) noexcept(StealsOnMove<Allocator>::value);
+
+    ~SubTable();
+
+    size_t size() const;
+
+    bool empty() const;
+
+    Hash hash_function() const;
+
+    KeyEqual key_eq() const;
+
+    Allocator get_allocator() const;
+
+    bool insert(const Stored_& element);
+
+    bool insert(Stored_&& element);
+
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const KeyType& key, Args&&... args);
+
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(KeyType&& key, Args&&... args);
+
+    template<class MappedType>
+    std::pair<iterator, bool> insert_or_assign(const KeyType& key, MappedType&& value);
+
+    template<class MappedType>
+    std::pair<iterator, bool> insert_or_assign(KeyType&& key, MappedType&& value);
+
+    bool erase(const KeyType& key);
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    bool erase(const Key& key);
+
+    iterator erase(iterator position);
+
+    iterator erase(const_iterator position);
+
+    iterator find(const KeyType& key);
+
+    const_iterator find(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    iterator find(const Key& key);
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    const_iterator find(const Key& key) const;
+
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+    FindAwaitable<SubTable, KeyType, iterator> find_async(const KeyType& key);
+
+    FindAwaitable<const SubTable, KeyType, const_iterator> find_async(const KeyType& key) const;
+#endif
+
+    bool contains(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    bool contains(const Key& key) const;
+
+    size_t count(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    size_t count(const Key& key) const;
+
+    ValueType &operator[](const KeyType& key);
+
+    ValueType &operator[](KeyType&& key);
+
+    const ValueType &at(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    const ValueType &at(const Key& key) const;
+
+    iterator begin();
+
+    iterator end();
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    void clear();
+
+    size_t bucket_count() const;
+
+    float load_factor() const;
+
+    float max_load_factor() const;
+
+    void max_load_factor(float load_factor);
+
+    float min_load_factor() const;
+
+    void min_load_factor(float load_factor);
+
+    size_t max_psl() const;
+
+    void max_psl(size_t psl);
+
+    size_t size_limit() const;
+
+    void size_limit(size_t count);
+
+    void rehash(size_t count);
+
+    void reserve(size_t count);
+
+    void shrink_to_fit();
+
+    size_t incremental_rehash() const;
+
+    void incremental_rehash(size_t buckets);
+
+    template<class Function>
+    void for_each(Function function);
+
+    template<class Function>
+    void for_each(Function function) const;
+
+    template<class Predicate>
+    size_t erase_if(Predicate predicate);
+
+    MemoryUsage memory_usage() const;
+
+    // payload(element) is the number of bytes the element owns outside of its bucket
+    template<class Function>
+    MemoryUsage memory_usage(Function payload) const;
+
+#ifdef MY_OWN_HASH_TABLE_STATS
+    SubTableStats stats() const;
+
+    void reset_stats();
+#endif
+
+private:
+    // Elements are constructed through the allocator, so a std::pmr allocator is passed on to them
+    using ElementAllocator_ = typename std::allocator_traits<Allocator>::template rebind_alloc<Stored_>;
+    using ElementTraits_ = std::allocator_traits<ElementAllocator_>;
+
+    static constexpr bool StoresHash_ = StoresHash<Hash>::value;
+
+    struct HashSlot_ {
+        size_t hash_;
+    };
+
+    struct NoHashSlot_ {};
+
+    /*
+        Bucket_ is an inline slot of the table: the element is stored right inside the bucket and is
+        constructed in place only when the bucket becomes occupied, so empty buckets cost no allocation.
+        Whether the bucket is occupied is known only from its metadata byte.
+        The element is kept with a mutable key, so rehashing and Robin Hood shifts move keys instead of copying them,
+        but outside the table the key is only ever seen as const. If the Hash stores hashes, the hash is kept
+        next to the element (see StoresHash).
+    */
+    struct Bucket_ : std::conditional_t<StoresHash_, HashSlot_, NoHashSlot_> {
+    public:
+        Element_& Value() {
+            return reinterpret_cast<Element_&>(Slot());
+        }
+
+        const Element_& Value() const {
+            return reinterpret_cast<const Element_&>(
+                    *std::launder(reinterpret_cast<const Stored_*>(&storage_)));
+        }
+
+        Stored_& Slot() {
+            return *std::launder(reinterpret_cast<Stored_*>(&storage_));
+        }
+
+        template<class... Args>
+        void Construct(ElementAllocator_& allocator, Args&&... args) {
+            ElementTraits_::construct(allocator, reinterpret_cast<Stored_*>(&storage_),
+                                      std::forward<Args>(args)...);
+        }
+
+        void Destroy(ElementAllocator_& allocator) {
+            ElementTraits_::destroy(allocator, &Slot());
+        }
+
+        // Moves the element of other into this empty bucket and destroys it in other
+        void MoveFrom(ElementAllocator_& allocator, Bucket_& other) {
+            Construct(allocator, std::move(other.Slot()));
+            CopyHash(other);
+            other.Destroy(allocator);
+        }
+
+        void CopyHash(const Bucket_& other) {
+            if constexpr (StoresHash_) {
+                this->hash_ = other.hash_;
+            }
+        }
+
+        alignas(Stored_) unsigned char storage_[sizeof(Stored_)];
+    };
+
+    using BucketAllocator_ = typename std::allocator_traits<Allocator>::template rebind_alloc<Bucket_>;
+
+    // Buckets of such tables are copied as bytes and are never destroyed one by one
+    static constexpr bool Relocatable_ = std::is_trivially_copyable_v<Stored_> && PlainConstruct<ElementAllocator_>::value;
+    using MetaAllocator_ = typename std::allocator_traits<Allocator>::template rebind_alloc<uint8_t>;
+
+    /*
+        Array_ is the buckets of the table together with their metadata.
+        Normally the table has one of them, during an incremental rehash there are the old one and the new one.
+        Both are taken from the allocator the array was created with and are given back to it, an array keeps
+        a copy of the allocator because allocators like std::pmr::polymorphic_allocator can not be assigned.
+    */
+    struct Array_ {
+    public:
+        Array_() = default;
+
+        // Buckets are left uninitialized, only the metadata is zeroed
+        Array_(size_t capacity, const ElementAllocator_& allocator) : capacity_(capacity), allocator_(allocator) {
+            BucketAllocator_ buckets(*allocator_);
+            buckets_ = std::allocator_traits<BucketAllocator_>::allocate(buckets, capacity_);
+            try {
+                MetaAllocator_ meta(*allocator_);
+                meta_ = std::allocator_traits<MetaAllocator_>::allocate(meta, capacity_ + MetaPadding);
+            } catch (...) {
+                std::allocator_traits<BucketAllocator_>::deallocate(buckets, buckets_, capacity_);
+                throw;
+            }
+            std::fill(meta_, meta_ + capacity_ + MetaPadding, EmptyMeta);
+        }
+
+        // The array uses memory it does not own (a mapped snapshot), it is never freed by the array
+        Array_(size_t capacity, uint8_t* meta, Bucket_* buckets) : capacity_(capacity), meta_(meta),
+                                                                  buckets_(buckets) {}
+
+        // A moved-from array has no buckets
+        Array_(Array_&& other) noexcept : capacity_(other.capacity_), meta_(other.meta_), buckets_(other.buckets_),
+                                          allocator_(std::move(other.allocator_)), seed_(other.seed_) {
+            other.capacity_ = 0;
+            other.meta_ = nullptr;
+            other.buckets_ = nullptr;
+        }
+
+        Array_& operator=(Array_&& other) noexcept {
+            if (this != &other) {
+                Release();
+                capacity_ = other.capacity_;
+                meta_ = other.meta_;
+                buckets_ = other.buckets_;
+                seed_ = other.seed_;
+                if (other.allocator_) {
+                    allocator_.emplace(*other.allocator_);
+                } else {
+                    allocator_.reset();
+                }
+                other.capacity_ = 0;
+                other.meta_ = nullptr;
+                other.buckets_ = nullptr;
+            }
+            return *this;
+        }
+
+        ~Array_() {
+            Release();
+        }
+
+        // Frees the memory only, the elements must be destroyed before
+        void Release() {
+            if (meta_ == nullptr || !allocator_) {
+                meta_ = nullptr;
+                buckets_ = nullptr;
+                return;
+            }
+            MetaAllocator_ meta(*allocator_);
+            std::allocator_traits<MetaAllocator_>::deallocate(meta, meta_, capacity_ + MetaPadding);
+            BucketAllocator_ buckets(*allocator_);
+            std::allocator_traits<BucketAllocator_>::deallocate(buckets, buckets_, capacity_);
+            meta_ = nullptr;
+            buckets_ = nullptr;
+        }
+
+        // The capacity is always a power of two, so the home bucket of a hash is its low bits
+        size_t Home(size_t hash) const {
+            if (seed_ != 0) {
+                hash = HashMix<void>::Mix(hash ^ seed_);
+            }
+            return hash & (capacity_ - 1);
+        }
+
+        size_t NextPos(size_t position) const {
+            ++position;
+            if (position == capacity_) {
+                position = 0;
+            }
+            return position;
+        }
+
+        size_t PrevPos(size_t position) const {
+            if (position == 0) {
+                position = capacity_;
+            }
+            --position;
+            return position;
+        }
+
+        void SetMeta(size_t position, uint8_t value) {
+            for (size_t i = position; i < capacity_ + MetaPadding; i += capacity_) {
+                meta_[i] = value;
+            }
+        }
+
+        size_t capacity_ = 0;
+        uint8_t* meta_ = nullptr;
+        Bucket_* buckets_ = nullptr;
+        std::optional<ElementAllocator_> allocator_;
+        // A reseeded array mixes it into the hashes before it takes their home buckets, 0 takes them as they are
+        size_t seed_ = 0;
+    };
+
+    Hash hasher_;
+    KeyEqual key_equal_;
+    ElementAllocator_ allocator_;
+    size_t size_;
+    Array_ table_;
+    double load_factor_ = 0.5;
+    double min_load_factor_ = 0;
+
+    // The array which is being moved into table_ by the incremental rehash, it is empty when there is no rehash
+    Array_ old_table_;
+    // How many buckets of old_table_ every operation moves, 0 means that the table is rehashed at once
+    size_t rehash_step_ = 0;
+    size_t migrate_position_ = 0;
+    size_t migrate_left_ = 0;
+    // Keeps the mapped snapshot alive while the arrays may point into it
+    std::shared_ptr<void> mapping_;
+    // The table evicts an element before an insert would make it larger than that, 0 means no limit
+    size_t size_limit_ = 0;
+    // The referenced marks of CLOCK, one for every slice of the hashes (see size_limit)
+    std::vector<uint8_t, MetaAllocator_> clock_;
+    size_t clock_hand_ = 0;
+    // An insert which probes further than that grows the table early or reseeds it, 0 turns it off (see max_psl)
+    size_t psl_limit_ = 0;
+    // The size at the last reseed, the next one waits until the table has doubled
+    size_t reseed_size_ = 0;
+
+    enum Operation_ { FindOperation_, InsertOperation_, EraseOperation_ };
+
+#ifdef MY_OWN_HASH_TABLE_STATS
+    // Relaxed atomics, so lookups which run at the same time (see ConcurrentHashMap) can count
+    struct Counter_ {
+        std::atomic<uint64_t> value{0};
+
+        Counter_() = default;
+
+        Counter_(const Counter_& other) : value(other.Get()) {}
+
+        Counter_& operator=(const Counter_& other) {
+            value.store(other.Get(), std::memory_order_relaxed);
+            return *this;
+        }
+
+        void Add(uint64_t count) {
+            value.fetch_add(count, std::memory_order_relaxed);
+        }
+
+        uint64_t Get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    struct Counters_ {
+        // hits, hit probes, misses and miss probes of every operation
+        Counter_ probes[3][4];
+        Counter_ rehashes;
+        Counter_ rehash_nanoseconds;
+        Counter_ evictions;
+        Counter_ reseeds;
+    };
+
+    mutable Counters_ counters_;
+#endif
+
+    // Adds the time of its life to the rehash time of the statistics
+    struct RehashTimer_ {
+#ifdef MY_OWN_HASH_TABLE_STATS
+        explicit RehashTimer_(SubTable& table) : table_(table), start_(std::chrono::steady_clock::now()) {}
+
+        ~RehashTimer_() {
+            auto time = std::chrono::steady_clock::now() - start_;
+            table_.counters_.rehash_nanoseconds.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count());
+        }
+
+        SubTable& table_;
+        std::chrono::steady_clock::time_point start_;
+#else
+        explicit RehashTimer_(SubTable&) {}
+#endif
+    };
+
+    void CountProbes(Operation_ operation, bool hit, size_t probes) const;
+
+    void CountRehash();
+
+    void CountEviction();
+
+    void CountReseed();
+
+    bool AtLimit() const;
+
+    bool AdaptToProbes();
+
+    size_t NewSeed() const;
+
+    void Touch(size_t hash);
+
+    void Evict();
+
+    void Grow();
+
+    void ShrinkIfSparse();
+
+    size_t FittedCapacity() const;
+
+    void ReHash();
+
+    void ReHash(size_t capacity);
+
+    void ReHash(size_t capacity, size_t seed);
+
+    void StartMigration(size_t capacity);
+
+    void StartMigration(size_t capacity, size_t seed);
+
+    void Migrate(size_t buckets);
+
+    void FinishMigration();
+
+    bool IsFull() const;
+
+    size_t Threshold(size_t capacity) const;
+
+    template<class... Args>
+    std::pair<iterator, bool> EmplaceHashed(const KeyType& key, size_t hash, Args&&... args);
+
+    iterator Place(Stored_&& element, size_t hash);
+
+    size_t InsertElement(Stored_&& element, size_t hash);
+
+    template<class... Args>
+    size_t InsertAt(size_t position, size_t psl, size_t hash, Args&&... args);
+
+    size_t HashAt(const Array_& array, size_t position) const;
+
+    template<class Key>
+    bool IsKeyAt(const Array_& array, size_t position, const Key& key, size_t hash) const;
+
+    void ErasePosition(Array_& array, size_t position);
+
+    template<class Iterator>
+    iterator EraseAt(Iterator position);
+
+    template<class Iterator>
+    iterator Rebase(const Iterator& it);
+
+    static size_t ClusterStart(const Array_& array);
+
+    template<class Key>
+    bool EraseKey(const Key& key);
+
+    template<class Key>
+    bool IsExist(const Key& key) const;
+
+    template<class Key>
+    bool IsExist(const Key& key, size_t hash) const;
+
+    template<class Key>
+    iterator FindHashed(const Key& key, size_t hash);
+
+    template<class Key>
+    const_iterator FindHashed(const Key& key, size_t hash) const;
+
+    template<class Key>
+    size_t HashOf(const Key& key) const;
+
+    void Prefetch(size_t hash) const;
+
+    template<class Key>
+    bool Locate(const Array_& array, const Key& key, size_t hash, size_t& position, size_t& psl) const;
+
+    template<class Key>
+    size_t FindPosition(const Array_& array, const Key& key, size_t hash) const;
+
+    template<class Key>
+    size_t FindPosition(const Array_& array, const Key& key, size_t hash, size_t& probes) const;
+
+    void DestroyElements(Array_& array);
+
+    template<class Array, class Function>
+    static void ForEachIn(Array& array, Function& function);
+
+    // predicate(bucket) of every occupied bucket
+    template<class Predicate>
+    size_t EraseIf(Array_& array, Predicate& predicate);
+
+    template<class Function>
+    size_t TakeIf(Function take);
+
+    template<class Iterator>
+    Stored_ ExtractAt(Iterator position);
+
+    template<class Source>
+    void CloneArray(Source& from, Array_& to);
+
+    void Steal(SubTable& other);
+
+    size_t Psl(const Array_& array, size_t position) const;
+
+    void SetPsl(Array_& array, size_t position, size_t psl);
+
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Element_;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Element_*;
+        using reference = Element_&;
+
+        iterator() = default;
+
+        iterator(SubTable* owner, Array_& array, size_t position);
+
+        iterator& operator++();
+
+        iterator operator++(int);
+
+        Element_& operator*();
+
+        Element_* operator->();
+
+        bool operator==(const iterator& other) const;
+
+        bool operator!=(const iterator& other) const;
+
+    private:
+        SubTable* owner_;
+        Array_* array_;
+        Bucket_* bucket_;
+        const uint8_t* meta_;
+        // The bucket the pass over array_ starts at, nullptr until it is needed
+        const uint8_t* start_ = nullptr;
+
+        void Begin(Array_& array);
+
+        void FindStart();
+
+        void SkipEmpty();
+
+        void Scan(bool first_part);
+
+        friend SubTable;
+    };
+
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Element_;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Element_*;
+        using reference = const Element_&;
+
+        const_iterator() = default;
+
+        const_iterator(const SubTable* owner, const Array_& array, size_t position);
+
+        const_iterator& operator++();
+
+        const_iterator operator++(int);
+
+        const Element_& operator*();
+
+        const Element_* operator->();
+
+        bool operator==(const const_iterator& other) const;
+
+        bool operator!=(const const_iterator& other) const;
+
+    private:
+        const SubTable* owner_;
+        const Array_* array_;
+        const Bucket_* bucket_;
+        const uint8_t* meta_;
+        // The bucket the pass over array_ starts at, nullptr until it is needed
+        const uint8_t* start_ = nullptr;
+
+        void Begin(const Array_& array);
+
+        void FindStart();
+
+        void SkipEmpty();
+
+        void Scan(bool first_part);
+
+        friend SubTable;
+    };
+
+    friend HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>;
+
+    template<class, class, class, class, class>
+    friend class ConcurrentHashMap;
+
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+    template<class, class, class>
+    friend class FindAwaitable;
+#endif
+};
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class InputIterator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubTable(InputIterator begin, InputIterator end, Hash hasher,
+                                                     const KeyEqual& key_equal, const Allocator& allocator) :
+                                                        hasher_(hasher), key_equal_(key_equal), allocator_(allocator),
+                                                        size_(0), table_(8, allocator_), clock_(MetaAllocator_(allocator_)) {
+    while (begin != end) {
+        insert(*begin);
+        begin++;
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubTable(const SubTable &other) :
+                                SubTable(other, ElementTraits_::select_on_container_copy_construction(other.allocator_)) {}
+
+// The copy takes its memory from allocator, HashMap uses it to clone a shared subtable
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubTable(const SubTable &other, const Allocator& allocator) : hasher_(other.hasher_),
+                                                                      key_equal_(other.key_equal_),
+                                                                      allocator_(allocator),
+                                                                      size_(other.size_),
+                                                                      load_factor_(other.load_factor_),
+                                                                      min_load_factor_(other.min_load_factor_),
+                                                                      rehash_step_(other.rehash_step_),
+                                                                      migrate_position_(other.migrate_position_),
+                                                                      migrate_left_(other.migrate_left_),
+                                                                      size_limit_(other.size_limit_),
+                                                                      clock_(other.clock_, MetaAllocator_(allocator_)),
+                                                                      clock_hand_(other.clock_hand_),
+                                                                      psl_limit_(other.psl_limit_),
+                                                                      reseed_size_(other.reseed_size_) {
+    CloneArray(other.table_, table_);
+    try {
+        CloneArray(other.old_table_, old_table_);
+    } catch (...) {
+        DestroyElements(table_);
+        throw;
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubTable(std::initializer_list<Stored_> list,
+                                                     const Hash& hasher, const KeyEqual& key_equal,
+                                                     const Allocator& allocator) :
+                                                        hasher_(hasher), key_equal_(key_equal), allocator_(allocator),
+                                                        size_(0), table_(8, allocator_), clock_(MetaAllocator_(allocator_)) {
+    for (auto &element : list) {
+        insert(element);
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubTable(const Hash& hasher, const KeyEqual& key_equal,
+                                                                const Allocator& allocator) :
+                                                                hasher_(hasher), key_equal_(key_equal),
+                                                                allocator_(allocator), size_(0), table_(8, allocator_),
+                                                                clock_(MetaAllocator_(allocator_)) {}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubTable(const Allocator& allocator) : SubTable(Hash(), KeyEqual(), allocator) {}
+
+// The moved-from table is empty and has no buckets, it allocates them again on the first insert
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubTable(SubTable &&other) noexcept : hasher_(std::move(other.hasher_)),
+                                                                          key_equal_(std::move(other.key_equal_)),
+                                                                          allocator_(std::move(other.allocator_)),
+                                                                          size_(other.size_),
+                                                                          table_(std::move(other.table_)),
+                                                                          load_factor_(other.load_factor_),
+                                                                          min_load_factor_(other.min_load_factor_),
+                                                                          old_table_(std::move(other.old_table_)),
+                                                                          rehash_step_(other.rehash_step_),
+                                                                          migrate_position_(other.migrate_position_),
+                                                                          migrate_left_(other.migrate_left_),
+                                                                          mapping_(std::move(other.mapping_)),
+                                                                          size_limit_(other.size_limit_),
+                                                                          clock_(std::move(other.clock_)),
+                                                                          clock_hand_(other.clock_hand_),
+                                                                          psl_limit_(other.psl_limit_),
+                                                                          reseed_size_(other.reseed_size_) {
+    other.size_ = 0;
+    other.migrate_left_ = 0;
+}
+
+// Takes the arrays of other if they come from an equal allocator, otherwise moves the elements one by one
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubTable(SubTable &&other, const Allocator& allocator) : hasher_(other.hasher_),
+                                                                      key_equal_(other.key_equal_),
+                                                                      allocator_(allocator),
+                                                                      size_(other.size_),
+                                                                      load_factor_(other.load_factor_),
+                                                                      min_load_factor_(other.min_load_factor_),
+                                                                      rehash_step_(other.rehash_step_),
+                                                                      migrate_position_(other.migrate_position_),
+                                                                      migrate_left_(other.migrate_left_),
+                                                                      size_limit_(other.size_limit_),
+                                                                      clock_(other.clock_, MetaAllocator_(allocator_)),
+                                                                      clock_hand_(other.clock_hand_),
+                                                                      psl_limit_(other.psl_limit_),
+                                                                      reseed_size_(other.reseed_size_) {
+    if (allocator_ == other.allocator_) {
+        table_ = std::move(other.table_);
+        old_table_ = std::move(other.old_table_);
+        mapping_ = std::move(other.mapping_);
+        other.size_ = 0;
+        other.migrate_left_ = 0;
+        return;
+    }
+    CloneArray(other.table_, table_);
+    try {
+        CloneArray(other.old_table_, old_table_);
+    } catch (...) {
+        DestroyElements(table_);
+        throw;
+    }
+}
+
+// The allocator is replaced only if it propagates on copy assignment, as in the standard containers
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::operator=(const SubTable &other) {
+    if (this != &other) {
+        constexpr bool propagate = ElementTraits_::propagate_on_container_copy_assignment::value;
+        SubTable copy(other, propagate ? other.allocator_ : allocator_);
+        if constexpr (propagate) {
+            allocator_ = other.allocator_;
+        }
+        Steal(copy);
+    }
+    return *this;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::operator=(SubTable &&other) noexcept(StealsOnMove<Allocator>::value) {
+    if (this == &other) {
+        return *this;
+    }
+    if constexpr (!StealsOnMove<Allocator>::value) {
+        if (allocator_ != other.allocator_) {
+            SubTable moved(std::move(other), allocator_);
+            Steal(moved);
+            return *this;
+        }
+    }
+    if constexpr (ElementTraits_::propagate_on_container_move_assignment::value) {
+        allocator_ = std::move(other.allocator_);
+    }
+    Steal(other);
+    return *this;
+}
+
+// Destroys the elements of this table and takes the arrays and the state of other, which is left empty
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Steal(SubTable& other) {
+    DestroyElements(table_);
+    DestroyElements(old_table_);
+    hasher_ = std::move(other.hasher_);
+    key_equal_ = std::move(other.key_equal_);
+    size_ = other.size_;
+    table_ = std::move(other.table_);
+    load_factor_ = other.load_factor_;
+    min_load_factor_ = other.min_load_factor_;
+    old_table_ = std::move(other.old_table_);
+    rehash_step_ = other.rehash_step_;
+    migrate_position_ = other.migrate_position_;
+    migrate_left_ = other.migrate_left_;
+    mapping_ = std::move(other.mapping_);
+    size_limit_ = other.size_limit_;
+    clock_ = std::move(other.clock_);
+    clock_hand_ = other.clock_hand_;
+    psl_limit_ = other.psl_limit_;
+    reseed_size_ = other.reseed_size_;
+    other.size_ = 0;
+    other.migrate_left_ = 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::~SubTable() {
+    DestroyElements(table_);
+    DestroyElements(old_table_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::size() const {
+    return size_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::empty() const {
+    return size_ == 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+Hash SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::hash_function() const {
+    return hasher_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+Allocator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::get_allocator() const {
+    return Allocator(allocator_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+KeyEqual SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::key_eq() const {
+    return key_equal_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert(const Stored_& element) {
+    return EmplaceHashed(Layout_::Key(element), HashOf(Layout_::Key(element)), element).second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert(Stored_&& element) {
+    size_t hash = HashOf(Layout_::Key(element));
+    const KeyType& key = Layout_::Key(element);
+    return EmplaceHashed(key, hash, std::move(element)).second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+std::pair<typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+                                          SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::emplace(Args&&... args) {
+    Stored_ element(std::forward<Args>(args)...);
+    size_t hash = HashOf(Layout_::Key(element));
+    const KeyType& key = Layout_::Key(element);
+    return EmplaceHashed(key, hash, std::move(element));
+}
+
+// Unlike emplace, the element is constructed only if the key is not in the table
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+std::pair<typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+                  SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::try_emplace(const KeyType& key, Args&&... args) {
+    return EmplaceHashed(key, HashOf(key), std::piecewise_construct, std::forward_as_tuple(key),
+                         std::forward_as_tuple(std::forward<Args>(args)...));
+}
+
+// The key is moved from only if it is inserted
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+std::pair<typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+                       SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::try_emplace(KeyType&& key, Args&&... args) {
+    return EmplaceHashed(key, HashOf(key), std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                         std::forward_as_tuple(std::forward<Args>(args)...));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class MappedType>
+std::pair<typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+         SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert_or_assign(const KeyType& key, MappedType&& value) {
+    auto result = try_emplace(key, std::forward<MappedType>(value));
+    if (!result.second) {
+        result.first->second = std::forward<MappedType>(value);
+    }
+    return result;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class MappedType>
+std::pair<typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+              SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert_or_assign(KeyType&& key, MappedType&& value) {
+    auto result = try_emplace(std::move(key), std::forward<MappedType>(value));
+    if (!result.second) {
+        result.first->second = std::forward<MappedType>(value);
+    }
+    return result;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase(const KeyType& key) {
+    return EraseKey(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase(const Key& key) {
+    return EraseKey(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::EraseKey(const Key& key) {
+    Migrate(rehash_step_);
+    size_t hash = HashOf(key);
+    size_t probes = 0;
+    size_t position = FindPosition(table_, key, hash, probes);
+    if (position != table_.capacity_) {
+        CountProbes(EraseOperation_, true, probes);
+        ErasePosition(table_, position);
+        ShrinkIfSparse();
+        return true;
+    }
+    position = FindPosition(old_table_, key, hash, probes);
+    if (position != old_table_.capacity_) {
+        CountProbes(EraseOperation_, true, probes);
+        ErasePosition(old_table_, position);
+        return true;
+    }
+    CountProbes(EraseOperation_, false, probes);
+    return false;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ErasePosition(Array_& array, size_t position) {
+    array.buckets_[position].Destroy(allocator_);
+    array.SetMeta(position, EmptyMeta);
+    size_--;
+    if constexpr (Relocatable_) {
+        // The run which is shifted back is moved at once unless it goes around the end of the array
+        size_t end = position + 1;
+        while (end < array.capacity_ && array.meta_[end] > 1) {
+            ++end;
+        }
+        if (end != array.capacity_ || array.meta_[0] <= 1) {
+            std::memmove(static_cast<void*>(&array.buckets_[position]), &array.buckets_[position + 1],
+                         (end - position - 1) * sizeof(Bucket_));
+            for (size_t i = position; i + 1 < end; ++i) {
+                uint8_t meta = array.meta_[i + 1];
+                array.SetMeta(i, meta == SaturatedMeta ? SaturatedMeta : meta - 1);
+                if (meta == SaturatedMeta) {
+                    SetPsl(array, i, Psl(array, i));
+                }
+            }
+            array.SetMeta(end - 1, EmptyMeta);
+            return;
+        }
+    }
+    size_t next_position = array.NextPos(position);
+    while (array.meta_[next_position] > 1) {
+        SetPsl(array, position, Psl(array, next_position) - 1);
+        array.buckets_[position].MoveFrom(allocator_, array.buckets_[next_position]);
+        array.SetMeta(next_position, EmptyMeta);
+        position = next_position;
+        next_position = array.NextPos(position);
+    }
+}
+
+// Erases the element without a lookup and returns the next one, the table is never rehashed by it
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase(iterator position) {
+    return EraseAt(position);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase(const_iterator position) {
+    return EraseAt(position);
+}
+
+/*
+    The backward shift brings only the elements which the pass has not reached yet into the erased bucket,
+    so the returned iterator goes on with them. The start of the pass is found before the shift moves anything.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Iterator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::EraseAt(Iterator position) {
+    position.FindStart();
+    iterator it = Rebase(position);
+    ErasePosition(*it.array_, it.meta_ - it.array_->meta_);
+    it.SkipEmpty();
+    return it;
+}
+
+// The same bucket in this table, it may be an iterator of a table which this one was cloned from with the same layout
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Iterator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Rebase(const Iterator& it) {
+    const Array_& from = *it.array_;
+    Array_& array = &from == &it.owner_->old_table_ ? old_table_ : table_;
+    iterator result(this, array, it.meta_ - from.meta_);
+    result.start_ = it.start_ == nullptr ? nullptr : array.meta_ + (it.start_ - from.meta_);
+    return result;
+}
+
+// The first bucket which does not continue a cluster from the end of the array, the passes over the array start there
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ClusterStart(const Array_& array) {
+    size_t position = 0;
+    while (position < array.capacity_ && array.meta_[position] > 1) {
+        ++position;
+    }
+    return position;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator
+                                              SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find(const KeyType& key) {
+    return FindHashed(key, HashOf(key));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator
+                                      SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find(const KeyType& key) const {
+    return FindHashed(key, HashOf(key));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find(const Key& key) {
+    return FindHashed(key, HashOf(key));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find(const Key& key) const {
+    return FindHashed(key, HashOf(key));
+}
+
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+/*
+    co_await find_async(key) is find(key) which prefetches the home bucket and lets other coroutines run
+    before it looks, see FindAwaitable. Nothing may change the table while the lookup is suspended.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+FindAwaitable<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>, KeyType, typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator>
+        SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find_async(const KeyType& key) {
+    return {*this, key};
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+FindAwaitable<const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>, KeyType, typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator>
+        SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find_async(const KeyType& key) const {
+    return {*this, key};
+}
+#endif
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::contains(const KeyType& key) const {
+    return IsExist(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::contains(const Key& key) const {
+    return IsExist(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::count(const KeyType& key) const {
+    return IsExist(key) ? 1 : 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::count(const Key& key) const {
+    return IsExist(key) ? 1 : 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+ValueType &SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::operator[](const KeyType& key) {
+    return try_emplace(key).first->second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+ValueType &SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::operator[](KeyType&& key) {
+    return try_emplace(std::move(key)).first->second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+const ValueType &SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::at(const KeyType& key) const {
+    auto it = find(key);
+    if (it == end()) {
+        throw std::out_of_range("Key not found");
+    }
+    return it->second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+const ValueType &SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::at(const Key& key) const {
+    auto it = find(key);
+    if (it == end()) {
+        throw std::out_of_range("Key not found");
+    }
+    return it->second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::begin() {
+    iterator it;
+    it.owner_ = this;
+    it.Begin(old_table_.capacity_ != 0 ? old_table_ : table_);
+    return it;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::end() {
+    return iterator(this, table_, table_.capacity_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::begin() const {
+    const_iterator it;
+    it.owner_ = this;
+    it.Begin(old_table_.capacity_ != 0 ? old_table_ : table_);
+    return it;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::end() const {
+    return const_iterator(this, table_, table_.capacity_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::clear() {
+    DestroyElements(table_);
+    DestroyElements(old_table_);
+    size_ = 0;
+    table_ = Array_(8, allocator_);
+    old_table_ = Array_();
+    migrate_left_ = 0;
+    reseed_size_ = 0;
+    std::fill(clock_.begin(), clock_.end(), 0);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::bucket_count() const {
+    return table_.capacity_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+float SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::load_factor() const {
+    return (float)size_ / (float)table_.capacity_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+float SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::max_load_factor() const {
+    return (float)load_factor_;
+}
+
+/*
+    Robin Hood table needs at least one empty bucket, so the load factor is clamped to [MinLoadFactor, MaxLoadFactor].
+    If the table is already loaded more than the new load factor allows it is rehashed right away.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::max_load_factor(float load_factor) {
+    load_factor_ = std::min(std::max((double)load_factor, MinLoadFactor), MaxLoadFactor);
+    if (size_ >= Threshold(table_.capacity_)) {
+        rehash(0);
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+float SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::min_load_factor() const {
+    return (float)min_load_factor_;
+}
+
+/*
+    After an erase leaves the table loaded less than load_factor, it is halved (incrementally if incremental_rehash
+    is set), so the memory follows the live elements. 0 turns it off. The halved table is loaded less than
+    a half of max_load_factor: the minimum is at most a quarter of it, so the table does not grow and shrink
+    over and over near the boundary.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::min_load_factor(float load_factor) {
+    min_load_factor_ = std::max((double)load_factor, 0.0);
+    ShrinkIfSparse();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::max_psl() const {
+    return psl_limit_;
+}
+
+/*
+    With psl > 0 the growth follows the probe lengths: an insert which would put its element further than psl
+    from its home bucket grows the table before max_load_factor is reached. So max_load_factor may be set high
+    (0.9 say), and the table gets that full only while the keys are well spread. Long probes in a table loaded
+    less than a half of max_load_factor do not come from the load but from hashes which agree in their low bits
+    (a weak Hash or keys chosen against it), the table is rehashed with a new random seed mixed into the homes then.
+    A reseed waits until the table has doubled since the last one, so keys with equal hashes, which no seed
+    separates, cost an amortized constant. It works on inserts into one subtable, displacement does not check it.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::max_psl(size_t psl) {
+    psl_limit_ = psl;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::size_limit() const {
+    return size_limit_;
+}
+
+/*
+    With count > 0 the table is a cache of at most count elements: an insert of a new key into a full table
+    first evicts an element chosen by CLOCK. Inserts, non-const find and find_batch and operator[] mark the key
+    as referenced, the clock hand goes around the buckets clearing the marks it passes and evicts the first element
+    which is not marked. A mark is a byte for a slice of the low bits of the hash rather than for a bucket, so Robin Hood
+    shifts do not move the marks, and the keys of one slice share a mark. There are about count marks,
+    the table needs no other memory for the cache. The elements over the new limit are evicted right away.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::size_limit(size_t count) {
+    size_limit_ = count;
+    size_t marks = 0;
+    if (count != 0) {
+        marks = 8;
+        while (marks < count) {
+            marks *= 2;
+        }
+    }
+    clock_.assign(marks, 0);
+    while (size_limit_ != 0 && size_ > size_limit_) {
+        Evict();
+    }
+}
+
+// Sets the number of buckets to the smallest power of two which is at least count and fits size() elements
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::rehash(size_t count) {
+    size_t capacity = FittedCapacity();
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    if (capacity != table_.capacity_) {
+        ReHash(capacity);
+    }
+}
+
+// Makes room for count elements, so inserting them does not cause any rehash
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::reserve(size_t count) {
+    size_t capacity = 8;
+    while (count >= Threshold(capacity)) {
+        capacity *= 2;
+    }
+    if (capacity > table_.capacity_) {
+        ReHash(capacity);
+    }
+}
+
+// Rehashes the table into the fewest buckets which fit size() elements
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::shrink_to_fit() {
+    rehash(0);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::incremental_rehash() const {
+    return rehash_step_;
+}
+
+/*
+    With buckets > 0 the table grows incrementally: the old and the new bucket arrays live together and
+    every insert, erase and non-const find moves at least buckets buckets of the old array into the new one
+    (the move always stops at the end of a cluster, so the rest of the old array stays a valid Robin Hood table).
+    Lookups check both arrays until the move is finished. With 0 the table is rehashed at once.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::incremental_rehash(size_t buckets) {
+    rehash_step_ = buckets;
+    if (rehash_step_ == 0) {
+        FinishMigration();
+    }
+}
+
+/*
+    Calls function(element) for every element. It is faster than the iterators: the metadata is scanned
+    group by group in one loop and there is no iterator state to keep. function must not change the table.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::for_each(Function function) {
+    ForEachIn(old_table_, function);
+    ForEachIn(table_, function);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::for_each(Function function) const {
+    ForEachIn(old_table_, function);
+    ForEachIn(table_, function);
+}
+
+// Erases every element for which predicate(element) is true in one pass over the buckets. Returns their number
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Predicate>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase_if(Predicate predicate) {
+    auto erase = [&predicate](Bucket_& bucket) {
+        return predicate(static_cast<const Element_&>(bucket.Value()));
+    };
+    size_t erased = EraseIf(old_table_, erase) + EraseIf(table_, erase);
+    ShrinkIfSparse();
+    return erased;
+}
+
+/*
+    Calls take(element) for every element with the element as it is stored, so it can be moved from. Erases the ones
+    for which take returns true, take must move them away then. Returns their number.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::TakeIf(Function take) {
+    auto erase = [&take](Bucket_& bucket) {
+        return take(bucket.Slot());
+    };
+    size_t taken = EraseIf(old_table_, erase) + EraseIf(table_, erase);
+    ShrinkIfSparse();
+    return taken;
+}
+
+// Moves the element out of its bucket and erases it, the table is not shrunk
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Iterator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Stored_ SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ExtractAt(Iterator position) {
+    iterator it = Rebase(position);
+    Stored_ element(std::move(it.bucket_->Slot()));
+    ErasePosition(*it.array_, it.meta_ - it.array_->meta_);
+    return element;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+MemoryUsage SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::memory_usage() const {
+    MemoryUsage usage;
+    usage.elements = size_;
+    for (const Array_* array : {&old_table_, &table_}) {
+        if (array->meta_ != nullptr) {
+            usage.buckets += array->capacity_ * sizeof(Bucket_);
+            usage.metadata += array->capacity_ + MetaPadding;
+        }
+    }
+    usage.auxiliary = sizeof(*this) + clock_.capacity();
+    return usage;
+}
+
+// A pass over the elements, the rest is known from the layout
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+MemoryUsage SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::memory_usage(Function payload) const {
+    MemoryUsage usage = memory_usage();
+    for_each([&](const Element_& element) {
+        usage.payload += payload(element);
+    });
+    return usage;
+}
+
+#ifdef MY_OWN_HASH_TABLE_STATS
+// The PSL figures are computed by a pass over the buckets, the rest is counted as the table is used
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTableStats SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::stats() const {
+    SubTableStats stats;
+    stats.size = size_;
+    stats.capacity = table_.capacity_ + old_table_.capacity_;
+    stats.load = stats.capacity == 0 ? 0 : (double)size_ / stats.capacity;
+    size_t total_psl = 0;
+    for (const Array_* array : {&old_table_, &table_}) {
+        const uint8_t* end = array->meta_ + array->capacity_;
+        for (const uint8_t* meta = NextOccupied(array->meta_, end); meta != end; meta = NextOccupied(meta + 1, end)) {
+            size_t psl = Psl(*array, meta - array->meta_);
+            if (psl >= stats.psl_histogram.size()) {
+                stats.psl_histogram.resize(psl + 1);
+            }
+            ++stats.psl_histogram[psl];
+            stats.max_psl = std::max(stats.max_psl, psl);
+            total_psl += psl;
+        }
+    }
+    stats.mean_psl = size_ == 0 ? 0 : (double)total_psl / size_;
+    stats.rehash_count = counters_.rehashes.Get();
+    stats.rehash_seconds = counters_.rehash_nanoseconds.Get() * 1e-9;
+    stats.evictions = counters_.evictions.Get();
+    stats.reseeds = counters_.reseeds.Get();
+    ProbeStats* probes[] = {&stats.find, &stats.insert, &stats.erase};
+    for (size_t i = 0; i < 3; ++i) {
+        *probes[i] = {counters_.probes[i][0].Get(), counters_.probes[i][1].Get(), counters_.probes[i][2].Get(),
+                      counters_.probes[i][3].Get()};
+    }
+    return stats;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::reset_stats() {
+    counters_ = Counters_();
+}
+#endif
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CountProbes(Operation_ operation, bool hit, size_t probes) const {
+#ifdef MY_OWN_HASH_TABLE_STATS
+    counters_.probes[operation][hit ? 0 : 2].Add(1);
+    counters_.probes[operation][hit ? 1 : 3].Add(probes);
+#else
+    (void)operation;
+    (void)hit;
+    (void)probes;
+#endif
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CountRehash() {
+#ifdef MY_OWN_HASH_TABLE_STATS
+    counters_.rehashes.Add(1);
+#endif
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CountEviction() {
+#ifdef MY_OWN_HASH_TABLE_STATS
+    counters_.evictions.Add(1);
+#endif
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CountReseed() {
+#ifdef MY_OWN_HASH_TABLE_STATS
+    counters_.reseeds.Add(1);
+#endif
+}
+
+// An insert probes further than max_psl: a loaded table grows early, a sparse one is reseeded. True if it was rebuilt
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::AdaptToProbes() {
+    if ((double)size_ >= (double)table_.capacity_ * load_factor_ / 2) {
+        Grow();
+        return true;
+    }
+    if (size_ < 2 * reseed_size_) {
+        return false;
+    }
+    reseed_size_ = std::max<size_t>(size_, 1);
+    CountReseed();
+    FinishMigration();
+    if (rehash_step_ == 0) {
+        ReHash(table_.capacity_, NewSeed());
+    } else {
+        StartMigration(table_.capacity_, NewSeed());
+    }
+    return true;
+}
+
+// A seed which can not be guessed from outside: the clock, the address of the table and a counter, mixed
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::NewSeed() const {
+    static std::atomic<size_t> counter{0};
+    size_t seed = (size_t)std::chrono::steady_clock::now().time_since_epoch().count() ^
+                  reinterpret_cast<uintptr_t>(this) ^ counter.fetch_add(1, std::memory_order_relaxed) * 0x9E3779B97F4A7C15ull;
+    return HashMix<void>::Mix(seed) | 1;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::AtLimit() const {
+    return size_limit_ != 0 && size_ >= size_limit_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Touch(size_t hash) {
+    if (!clock_.empty()) {
+        clock_[hash & (clock_.size() - 1)] = 1;
+    }
+}
+
+// One sweep clears every mark, so the hand stops within two turns around the buckets
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Evict() {
+    FinishMigration();
+    while (true) {
+        clock_hand_ &= table_.capacity_ - 1;
+        if (table_.meta_[clock_hand_] != EmptyMeta) {
+            uint8_t& mark = clock_[HashAt(table_, clock_hand_) & (clock_.size() - 1)];
+            if (mark == 0) {
+                ErasePosition(table_, clock_hand_);
+                CountEviction();
+                return;
+            }
+            mark = 0;
+        }
+        ++clock_hand_;
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Grow() {
+    if (rehash_step_ == 0) {
+        ReHash();
+        return;
+    }
+    FinishMigration();
+    if (table_.capacity_ == 0) {
+        ReHash();
+        return;
+    }
+    StartMigration(table_.capacity_ * 2);
+}
+
+// The fewest buckets which fit size() elements
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FittedCapacity() const {
+    size_t capacity = 8;
+    while (size_ >= Threshold(capacity)) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// A table in the middle of a rehash is left as it is, it is checked again on the next erase
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ShrinkIfSparse() {
+    double minimum = std::min(min_load_factor_, load_factor_ / 4);
+    if (minimum == 0 || old_table_.capacity_ != 0 || table_.capacity_ <= 8 ||
+        (double)size_ >= (double)table_.capacity_ * minimum) {
+        return;
+    }
+    size_t capacity = table_.capacity_ / 2;
+    while (capacity > 8 && (double)size_ < (double)capacity * minimum) {
+        capacity /= 2;
+    }
+    if (rehash_step_ == 0) {
+        ReHash(capacity);
+    } else {
+        StartMigration(capacity);
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ReHash() {
+    ReHash(std::max<size_t>(table_.capacity_ * 2, 8));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ReHash(size_t capacity) {
+    ReHash(capacity, table_.seed_);
+}
+
+// The new array gets the seed, a table keeps its seed as it grows and shrinks
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ReHash(size_t capacity, size_t seed) {
+    FinishMigration();
+    CountRehash();
+    RehashTimer_ timer(*this);
+    Array_ old_table(capacity, allocator_);
+    old_table.seed_ = seed;
+    std::swap(old_table, table_);
+    for (size_t i = 0; i < old_table.capacity_; ++i) {
+        if (old_table.meta_[i] != EmptyMeta) {
+            InsertElement(std::move(old_table.buckets_[i].Slot()), HashAt(old_table, i));
+            old_table.buckets_[i].Destroy(allocator_);
+        }
+    }
+}
+
+// Migration goes around the old array starting right after an empty bucket, so it starts at a cluster
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::StartMigration(size_t capacity) {
+    StartMigration(capacity, table_.seed_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::StartMigration(size_t capacity, size_t seed) {
+    CountRehash();
+    RehashTimer_ timer(*this);
+    old_table_ = Array_(capacity, allocator_);
+    old_table_.seed_ = seed;
+    std::swap(old_table_, table_);
+    size_t position = 0;
+    while (old_table_.meta_[position] != EmptyMeta) {
+        ++position;
+    }
+    migrate_position_ = old_table_.NextPos(position);
+    migrate_left_ = old_table_.capacity_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Migrate(size_t buckets) {
+    if (old_table_.capacity_ == 0) {
+        return;
+    }
+    RehashTimer_ timer(*this);
+    for (size_t moved = 0; migrate_left_ > 0; ++moved) {
+        uint8_t meta = old_table_.meta_[migrate_position_];
+        if (moved >= buckets && meta <= 1) {
+            break;
+        }
+        if (meta != EmptyMeta) {
+            InsertElement(std::move(old_table_.buckets_[migrate_position_].Slot()), HashAt(old_table_, migrate_position_));
+            old_table_.buckets_[migrate_position_].Destroy(allocator_);
+            old_table_.SetMeta(migrate_position_, EmptyMeta);
+        }
+        migrate_position_ = old_table_.NextPos(migrate_position_);
+        --migrate_left_;
+    }
+    if (migrate_left_ == 0) {
+        old_table_ = Array_();
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FinishMigration() {
+    Migrate(old_table_.capacity_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::IsFull() const {
+    return size_ + 1 >= Threshold(table_.capacity_);
+}
+
+// The table grows when it has that many elements, one bucket is always left empty whatever the load factor is
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Threshold(size_t capacity) const {
+    return std::min((size_t)std::ceil((double)capacity * load_factor_), capacity - 1);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::IsExist(const Key& key) const {
+    return IsExist(key, HashOf(key));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::IsExist(const Key& key, size_t hash) const {
+    size_t probes = 0;
+    bool found = FindPosition(table_, key, hash, probes) != table_.capacity_ ||
+                 FindPosition(old_table_, key, hash, probes) != old_table_.capacity_;
+    CountProbes(FindOperation_, found, probes);
+    return found;
+}
+
+// find for a key whose hash is already known
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator
+                              SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindHashed(const Key& key, size_t hash) {
+    Migrate(rehash_step_);
+    size_t probes = 0;
+    size_t position = FindPosition(table_, key, hash, probes);
+    if (position != table_.capacity_) {
+        CountProbes(FindOperation_, true, probes);
+        Touch(hash);
+        return iterator(this, table_, position);
+    }
+    position = FindPosition(old_table_, key, hash, probes);
+    if (position != old_table_.capacity_) {
+        CountProbes(FindOperation_, true, probes);
+        Touch(hash);
+        return iterator(this, old_table_, position);
+    }
+    CountProbes(FindOperation_, false, probes);
+    return end();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator
+                              SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindHashed(const Key& key, size_t hash) const {
+    size_t probes = 0;
+    size_t position = FindPosition(table_, key, hash, probes);
+    if (position != table_.capacity_) {
+        CountProbes(FindOperation_, true, probes);
+        return const_iterator(this, table_, position);
+    }
+    position = FindPosition(old_table_, key, hash, probes);
+    if (position != old_table_.capacity_) {
+        CountProbes(FindOperation_, true, probes);
+        return const_iterator(this, old_table_, position);
+    }
+    CountProbes(FindOperation_, false, probes);
+    return end();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashOf(const Key& key) const {
+    return HashMix<Hash>::Mix(hasher_(key));
+}
+
+// Asks the CPU to load the home metadata byte and bucket of the hash, so a following lookup does not wait for memory
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Prefetch(size_t hash) const {
+    if (table_.capacity_ == 0) {
+        return;
+    }
+    size_t position = table_.Home(hash);
+    __builtin_prefetch(table_.meta_ + position);
+    __builtin_prefetch(&table_.buckets_[position]);
+}
+
+/*
+    Looks for the key and for the place of the key in one pass over its probe sequence: the element is constructed
+    from args only if the key is in neither of the arrays, right at the bucket where the lookup has stopped.
+    If the table has to grow first, the position is looked up again in the grown array.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+std::pair<typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+   SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::EmplaceHashed(const KeyType& key, size_t hash, Args&&... args) {
+    Migrate(rehash_step_);
+    size_t position = 0;
+    size_t psl = 0;
+    Touch(hash);
+    if (table_.capacity_ != 0 && Locate(table_, key, hash, position, psl)) {
+        CountProbes(InsertOperation_, true, psl + 1);
+        return {iterator(this, table_, position), false};
+    }
+    size_t probes = table_.capacity_ != 0 ? psl + 1 : 0;
+    size_t old_position = FindPosition(old_table_, key, hash, probes);
+    if (old_position != old_table_.capacity_) {
+        CountProbes(InsertOperation_, true, probes);
+        return {iterator(this, old_table_, old_position), false};
+    }
+    CountProbes(InsertOperation_, false, probes);
+    if (AtLimit()) {
+        while (AtLimit()) {
+            Evict();
+        }
+        Locate(table_, key, hash, position, psl);
+    }
+    if (IsFull()) {
+        Grow();
+        Locate(table_, key, hash, position, psl);
+    } else if (psl_limit_ != 0 && psl > psl_limit_ && AdaptToProbes()) {
+        Locate(table_, key, hash, position, psl);
+    }
+    position = InsertAt(position, psl, hash, std::forward<Args>(args)...);
+    size_++;
+    return {iterator(this, table_, position), true};
+}
+
+// Inserts the element which is not in the table without growing the table
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator
+                   SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Place(Stored_&& element, size_t hash) {
+    Migrate(rehash_step_);
+    while (AtLimit()) {
+        Evict();
+    }
+    Touch(hash);
+    size_t position = InsertElement(std::move(element), hash);
+    size_++;
+    return iterator(this, table_, position);
+}
+
+// Inserts the element which is not in the array and returns its position
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::InsertElement(Stored_&& element, size_t hash) {
+    size_t start_position = table_.Home(hash);
+    size_t psl = 0;
+    while (table_.meta_[start_position] != EmptyMeta && psl <= Psl(table_, start_position)) {
+        start_position = table_.NextPos(start_position);
+        psl++;
+    }
+    return InsertAt(start_position, psl, hash, std::move(element));
+}
+
+// Shifts the cluster which starts at position one bucket forward and constructs the element with that PSL there
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::InsertAt(size_t position, size_t psl, size_t hash,
+                                                                              Args&&... args) {
+    size_t empty_position = position;
+    while (table_.meta_[empty_position] != EmptyMeta) {
+        empty_position = table_.NextPos(empty_position);
+    }
+    bool moved = false;
+    if constexpr (Relocatable_) {
+        if (empty_position > position) {
+            std::memmove(static_cast<void*>(&table_.buckets_[position + 1]), &table_.buckets_[position],
+                         (empty_position - position) * sizeof(Bucket_));
+            moved = true;
+        }
+    }
+    while (empty_position != position) {
+        size_t prev_position = table_.PrevPos(empty_position);
+        uint8_t meta = table_.meta_[prev_position];
+        table_.SetMeta(empty_position, meta == SaturatedMeta ? SaturatedMeta : meta + 1);
+        if (!moved) {
+            table_.buckets_[empty_position].MoveFrom(allocator_, table_.buckets_[prev_position]);
+        }
+        empty_position = prev_position;
+    }
+    table_.buckets_[position].Construct(allocator_, std::forward<Args>(args)...);
+    if constexpr (StoresHash_) {
+        table_.buckets_[position].hash_ = hash;
+    } else {
+        (void)hash;
+    }
+    SetPsl(table_, position, psl);
+    return position;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashAt(const Array_& array, size_t position) const {
+    if constexpr (StoresHash_) {
+        return array.buckets_[position].hash_;
+    } else {
+        return HashOf(Layout_::Key(array.buckets_[position].Value()));
+    }
+}
+
+// With stored hashes the keys are compared only if their hashes are equal
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::IsKeyAt(const Array_& array, size_t position, const Key& key, size_t hash) const {
+    if constexpr (StoresHash_) {
+        if (array.buckets_[position].hash_ != hash) {
+            return false;
+        }
+    } else {
+        (void)hash;
+    }
+    return key_equal_(Layout_::Key(array.buckets_[position].Value()), key);
+}
+
+/*
+    Returns true and the position of the key together with its PSL if the key is in the array. Otherwise returns
+    false and the bucket where the key would be inserted together with its PSL there: the first bucket which is empty or holds a key
+    closer to its home, that is where the lookup stops.
+    Groups of Probe::Width metadata bytes are matched at once while the expected PSL fits into a metadata byte,
+    after that the rest of the (very long) probe sequence is checked one bucket at a time.
+    The array must not be empty.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Locate(const Array_& array, const Key& key, size_t hash,
+                                                                            size_t& position, size_t& psl) const {
+    position = array.Home(hash);
+    psl = 0;
+    while (psl + Probe::Width < SaturatedMeta) {
+        uint32_t match;
+        uint32_t stop;
+        Probe::Match(array.meta_ + position, static_cast<uint8_t>(psl + 1), match, stop);
+        if (stop != 0) {
+            match &= (stop & (~stop + 1)) - 1;
+        }
+        while (match != 0) {
+            size_t candidate = (position + __builtin_ctz(match)) & (array.capacity_ - 1);
+            if (IsKeyAt(array, candidate, key, hash)) {
+                position = candidate;
+                psl += __builtin_ctz(match);
+                return true;
+            }
+            match &= match - 1;
+        }
+        if (stop != 0) {
+            size_t offset = __builtin_ctz(stop);
+            position = (position + offset) & (array.capacity_ - 1);
+            psl += offset;
+            return false;
+        }
+        position = (position + Probe::Width) & (array.capacity_ - 1);
+        psl += Probe::Width;
+    }
+    while (array.meta_[position] != EmptyMeta && Psl(array, position) >= psl) {
+        if (Psl(array, position) == psl && IsKeyAt(array, position, key, hash)) {
+            return true;
+        }
+        position = array.NextPos(position);
+        ++psl;
+    }
+    return false;
+}
+
+// Returns position of the key in the array or array.capacity_ if there is no such key
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindPosition(const Array_& array, const Key& key,
+                                                                                    size_t hash) const {
+    if (array.capacity_ == 0) {
+        return 0;
+    }
+    size_t probes = 0;
+    return FindPosition(array, key, hash, probes);
+}
+
+// Also adds the number of buckets checked in the array to probes
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindPosition(const Array_& array, const Key& key,
+                                                                                    size_t hash, size_t& probes) const {
+    if (array.capacity_ == 0) {
+        return 0;
+    }
+    size_t position;
+    size_t psl;
+    bool found = Locate(array, key, hash, position, psl);
+    probes += psl + 1;
+    return found ? position : array.capacity_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Array, class Function>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ForEachIn(Array& array, Function& function) {
+    const uint8_t* end = array.meta_ + array.capacity_;
+    using Bucket = std::conditional_t<std::is_const_v<Array>, const Bucket_, Bucket_>;
+    for (const uint8_t* meta = NextOccupied(array.meta_, end); meta != end; meta = NextOccupied(meta + 1, end)) {
+        Bucket& bucket = array.buckets_[meta - array.meta_];
+        function(bucket.Value());
+    }
+}
+
+/*
+    The pass starts right after an empty bucket, so backward shifts of ErasePosition only bring elements
+    which are not checked yet into the checked position, and it is checked again.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Predicate>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::EraseIf(Array_& array, Predicate& predicate) {
+    if (array.capacity_ == 0) {
+        return 0;
+    }
+    size_t position = 0;
+    while (array.meta_[position] != EmptyMeta) {
+        ++position;
+    }
+    size_t erased = 0;
+    for (size_t left = array.capacity_; left > 0; --left) {
+        position = array.NextPos(position);
+        while (array.meta_[position] != EmptyMeta &&
+               predicate(array.buckets_[position])) {
+            ErasePosition(array, position);
+            ++erased;
+        }
+    }
+    return erased;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::DestroyElements(Array_& array) {
+    if constexpr (Relocatable_) {
+        return;
+    }
+    for (size_t i = 0; i < array.capacity_; ++i) {
+        if (array.meta_[i] != EmptyMeta) {
+            array.buckets_[i].Destroy(allocator_);
+        }
+    }
+}
+
+/*
+    Copies the elements of from into to at the same positions, so the copy needs no hashing and no probing.
+    The elements are moved if from is not const. to gets its memory from the allocator of this table.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Source>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CloneArray(Source& from, Array_& to) {
+    if (from.capacity_ == 0) {
+        to = Array_();
+        return;
+    }
+    to = Array_(from.capacity_, allocator_);
+    to.seed_ = from.seed_;
+    if constexpr (Relocatable_) {
+        std::memcpy(static_cast<void*>(to.buckets_), from.buckets_, from.capacity_ * sizeof(Bucket_));
+        std::copy(from.meta_, from.meta_ + from.capacity_ + MetaPadding, to.meta_);
+        return;
+    }
+    try {
+        for (size_t i = 0; i < from.capacity_; ++i) {
+            if (from.meta_[i] != EmptyMeta) {
+                if constexpr (std::is_const_v<Source>) {
+                    to.buckets_[i].Construct(allocator_, from.buckets_[i].Value());
+                } else {
+                    to.buckets_[i].Construct(allocator_, std::move(from.buckets_[i].Slot()));
+                }
+                to.buckets_[i].CopyHash(from.buckets_[i]);
+                to.meta_[i] = from.meta_[i];
+            }
+        }
+    } catch (...) {
+        DestroyElements(to);
+        to = Array_();
+        throw;
+    }
+    std::copy(from.meta_, from.meta_ + from.capacity_ + MetaPadding, to.meta_);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Psl(const Array_& array, size_t position) const {
+    if (array.meta_[position] != SaturatedMeta) {
+        return array.meta_[position] - 1;
+    }
+    size_t home = array.Home(HashAt(array, position));
+    return (position - home) & (array.capacity_ - 1);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SetPsl(Array_& array, size_t position, size_t psl) {
+    array.SetMeta(position, psl + 1 < SaturatedMeta ? static_cast<uint8_t>(psl + 1) : SaturatedMeta);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::iterator(SubTable* owner, Array_& array, size_t position) :
+                                                                owner_(owner),
+                                                                array_(&array),
+                                                                bucket_(array.buckets_ + position),
+                                                                meta_(array.meta_ + position) {}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::Begin(Array_& array) {
+    array_ = &array;
+    size_t start = ClusterStart(array);
+    bucket_ = array.buckets_ + start;
+    meta_ = array.meta_ + start;
+    start_ = meta_;
+    Scan(true);
+}
+
+// An iterator which find has returned learns the start of its pass only when it moves
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::FindStart() {
+    if (start_ == nullptr) {
+        start_ = array_->meta_ + ClusterStart(*array_);
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::SkipEmpty() {
+    FindStart();
+    Scan(meta_ >= start_);
+}
+
+/*
+    Goes to the first element at meta_ or after it. The pass over an array goes from start_ to the end of the array
+    and then from its beginning to start_, the old array is passed first and then the new one.
+    The part of the pass meta_ is in is given, because meta_ == start_ both begins the first part and ends the second.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::Scan(bool first_part) {
+    while (true) {
+        const uint8_t* end = first_part ? array_->meta_ + array_->capacity_ : start_;
+        const uint8_t* next = NextOccupied(meta_, end);
+        bucket_ += next - meta_;
+        meta_ = next;
+        if (meta_ != end) {
+            return;
+        }
+        if (first_part && start_ != array_->meta_) {
+            bucket_ = array_->buckets_;
+            meta_ = array_->meta_;
+            first_part = false;
+        } else if (array_ == &owner_->old_table_) {
+            Begin(owner_->table_);
+            return;
+        } else {
+            // The iterator becomes end()
+            bucket_ = array_->buckets_ + array_->capacity_;
+            meta_ = array_->meta_ + array_->capacity_;
+            return;
+        }
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator& SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator++() {
+    FindStart();
+    bool first_part = meta_ >= start_;
+    ++bucket_;
+    ++meta_;
+    Scan(first_part);
+    return *this;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator++(int) {
+    iterator tmp = *this;
+    ++(*this);
+    return tmp;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename ElementLayout<KeyType, ValueType>::Element& SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator*() {
+    return bucket_->Value();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename ElementLayout<KeyType, ValueType>::Element* SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator->() {
+    return &bucket_->Value();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator==(const iterator& other) const {
+    return bucket_ == other.bucket_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator!=(const iterator& other) const {
+    return !(*this == other);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::const_iterator(const SubTable* owner, const Array_& array, size_t position) :
+                                                                owner_(owner),
+                                                                array_(&array),
+                                                                bucket_(array.buckets_ + position),
+                                                                meta_(array.meta_ + position) {}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::Begin(const Array_& array) {
+    array_ = &array;
+    size_t start = ClusterStart(array);
+    bucket_ = array.buckets_ + start;
+    meta_ = array.meta_ + start;
+    start_ = meta_;
+    Scan(true);
+}
+
+// An iterator which find has returned learns the start of its pass only when it moves
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::FindStart() {
+    if (start_ == nullptr) {
+        start_ = array_->meta_ + ClusterStart(*array_);
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::SkipEmpty() {
+    FindStart();
+    Scan(meta_ >= start_);
+}
+
+/*
+    Goes to the first element at meta_ or after it. The pass over an array goes from start_ to the end of the array
+    and then from its beginning to start_, the old array is passed first and then the new one.
+    The part of the pass meta_ is in is given, because meta_ == start_ both begins the first part and ends the second.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::Scan(bool first_part) {
+    while (true) {
+        const uint8_t* end = first_part ? array_->meta_ + array_->capacity_ : start_;
+        const uint8_t* next = NextOccupied(meta_, end);
+        bucket_ += next - meta_;
+        meta_ = next;
+        if (meta_ != end) {
+            return;
+        }
+        if (first_part && start_ != array_->meta_) {
+            bucket_ = array_->buckets_;
+            meta_ = array_->meta_;
+            first_part = false;
+        } else if (array_ == &owner_->old_table_) {
+            Begin(owner_->table_);
+            return;
+        } else {
+            // The iterator becomes end()
+            bucket_ = array_->buckets_ + array_->capacity_;
+            meta_ = array_->meta_ + array_->capacity_;
+            return;
+        }
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator& SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator++() {
+    FindStart();
+    bool first_part = meta_ >= start_;
+    ++bucket_;
+    ++meta_;
+    Scan(first_part);
+    return *this;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator
+                                      SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator++(int) {
+    const_iterator tmp = *this;
+    ++(*this);
+    return tmp;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+const typename ElementLayout<KeyType, ValueType>::Element& SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator*() {
+    return bucket_->Value();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+const typename ElementLayout<KeyType, ValueType>::Element* SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator->() {
+    return &bucket_->Value();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator==(const const_iterator& other) const {
+    return bucket_ == other.bucket_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator!=(const const_iterator& other) const {
+    return !(*this == other);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+class HashMap {
+    using Layout_ = ElementLayout<KeyType, ValueType>;
+    using Element_ = typename Layout_::Element;
+    using Stored_ = typename Layout_::Stored;
+    using SubtableAllocator_ = typename std::allocator_traits<Allocator>::template rebind_alloc<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>>;
+    using Subtables_ = std::vector<std::shared_ptr<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>>,
+            typename std::allocator_traits<Allocator>::template rebind_alloc<std::shared_ptr<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>>>>;
+    using SnapshotArray_ = typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Array_;
+    using SnapshotBucket_ = typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Bucket_;
+
+public:
+    /*
+        Iterators go through the subtables in turn and through every array of a subtable starting at the first
+        bucket which does not continue a cluster from the end of the array. So the backward shift of erase(iterator)
+        brings only elements which are not passed yet into the erased bucket, and a sweep which erases while it
+        iterates is one pass which sees every element once.
+        erase(iterator) invalidates the iterators to the erased element and to the elements after it in its subtable.
+        Inserts, rehashes, erase(key) (which may shrink the subtable) and, with incremental_rehash, non-const lookups
+        move elements and invalidate all iterators of the subtable. A snapshot shares the subtables of the map, so
+        taking one invalidates all iterators and references into the map (see snapshot).
+    */
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Element_;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Element_*;
+        using reference = Element_&;
+
+        iterator() = default;
+
+        iterator(Subtables_* subtables,
+                 size_t pos, typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator it);
+
+        iterator& operator++();
+
+        iterator operator++(int);
+
+        Element_& operator*();
+
+        Element_* operator->();
+
+        bool operator==(const iterator& other) const;
+
+        bool operator!=(const iterator& other) const;
+
+    private:
+        Subtables_* subtables_;
+        size_t pos_;
+        typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator it_;
+
+        void NextSubtable();
+
+        friend HashMap;
+    };
+
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Element_;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Element_*;
+        using reference = const Element_&;
+
+        const_iterator() = default;
+
+        const_iterator(const Subtables_* subtables,
+                       size_t pos, typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator it);
+
+        const_iterator& operator++();
+
+        const_iterator operator++(int);
+
+        const Element_& operator*();
+
+        const Element_* operator->();
+
+        bool operator==(const const_iterator& other) const;
+
+        bool operator!=(const const_iterator& other) const;
+
+    private:
+        const Subtables_* subtables_;
+        size_t pos_;
+        typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator it_;
+
+        void NextSubtable();
+
+        friend HashMap;
+    };
+
+    /*
+        A node handle owns an element taken out of a map by extract, insert(node_type&&) moves it into a map again.
+        Unlike the node handles of the standard maps it holds the element itself, so moving a handle moves
+        the element. The key may be changed while the element is out of the map. An empty handle owns nothing.
+    */
+    class node_type {
+    public:
+        using key_type = KeyType;
+        using mapped_type = ValueType;
+
+        node_type() = default;
+
+        bool empty() const {
+            return !element_.has_value();
+        }
+
+        explicit operator bool() const {
+            return element_.has_value();
+        }
+
+        KeyType& key() {
+            if constexpr (std::is_same_v<ValueType, NoValue>) {
+                return *element_;
+            } else {
+                return element_->first;
+            }
+        }
+
+        ValueType& mapped() {
+            static_assert(!std::is_same_v<ValueType, NoValue>, "a set has no values");
+            return element_->second;
+        }
+
+    private:
+        std::optional<Stored_> element_;
+
+        friend HashMap;
+    };
+
+    struct insert_return_type {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
+
+    explicit HashMap(const Hash& hasher = Hash(), const KeyEqual& key_equal = KeyEqual(),
+                     const Allocator& allocator = Allocator());
+
+    explicit HashMap(const Allocator& allocator);
+
+    explicit HashMap(const HashMapOptions& options, const Hash& hasher = Hash(), const KeyEqual& key_equal = KeyEqual(),
+                     const Allocator& allocator = Allocator());
+
+    explicit HashMap(size_t subtable_count, const Hash& hasher = Hash(), const KeyEqual& key_equal = KeyEqual(),
+                     const Allocator& allocator = Allocator());
+
+    template<class InputIterator>
+    HashMap(InputIterator begin, InputIterator end, Hash hasher = Hash(), const KeyEqual& key_equal = KeyEqual(),
+            const Allocator& allocator = Allocator());
+
+    HashMap(std::initializer_list<Stored_> list, const Hash& hasher = Hash(),
+            const KeyEqual& key_equal = KeyEqual(), const Allocator& allocator = Allocator());
+
+    HashMap(const HashMap &other);
+
+    HashMap(HashMap &&other) noexcept;
+
+    HashMap &operator=(const HashMap &other);
+
+    HashMap &operator=(HashMap &&other) noexcept(StealsOnMove<Allocator>::value);
+
+    HashMap snapshot() const;
+
+    size_t size() const;
+
+    bool empty() const;
+
+    Hash hash_function() const;
+
+    KeyEqual key_eq() const;
+
+    Allocator get_allocator() const;
+
+    void insert(const Stored_& element);
+
+    void insert(Stored_&& element);
+
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const KeyType& key, Args&&... args);
+
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(KeyType&& key, Args&&... args);
+
+    template<class MappedType>
+    std::pair<iterator, bool> insert_or_assign(const KeyType& key, MappedType&& value);
+
+    template<class MappedType>
+    std::pair<iterator, bool> insert_or_assign(KeyType&& key, MappedType&& value);
+
+    void erase(const KeyType& key);
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    void erase(const Key& key);
+
+    iterator erase(iterator position);
+
+    iterator erase(const_iterator position);
+
+    node_type extract(const_iterator position);
+
+    node_type extract(iterator position);
+
+    node_type extract(const KeyType& key);
+
+    insert_return_type insert(node_type&& node);
+
+    template<class Predicate>
+    size_t erase_if(Predicate predicate);
+
+    template<class Executor = SequentialExecutor>
+    void merge(HashMap& source, Executor executor = Executor());
+
+    template<class Executor = SequentialExecutor>
+    void merge(HashMap&& source, Executor executor = Executor());
+
+    template<class Executor = SequentialExecutor>
+    size_t intersect(const HashMap& other, Executor executor = Executor());
+
+    template<class Executor = SequentialExecutor>
+    size_t subtract(const HashMap& other, Executor executor = Executor());
+
+    iterator find(const KeyType& key);
+
+    const_iterator find(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    iterator find(const Key& key);
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    const_iterator find(const Key& key) const;
+
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+    FindAwaitable<HashMap, KeyType, iterator> find_async(const KeyType& key);
+
+    FindAwaitable<const HashMap, KeyType, const_iterator> find_async(const KeyType& key) const;
+#endif
+
+    bool contains(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    bool contains(const Key& key) const;
+
+    size_t count(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    size_t count(const Key& key) const;
+
+    void insert_batch(const Stored_* elements, size_t count);
+
+    void find_batch(const KeyType* keys, size_t count, iterator* result);
+
+    void find_batch(const KeyType* keys, size_t count, const_iterator* result) const;
+
+    void contains_batch(const KeyType* keys, size_t count, bool* result) const;
+
+    ValueType &operator[](const KeyType& key);
+
+    ValueType &operator[](KeyType&& key);
+
+    const ValueType &at(const KeyType& key) const;
+
+    template<class Key, class = std::enable_if_t<IsTransparent<Hash, KeyEqual, Key>::value>>
+    const ValueType &at(const Key& key) const;
+
+    iterator begin();
+
+    iterator end();
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    void clear();
+
+    size_t subtable_count() const;
+
+    size_t bucket_count() const;
+
+    float load_factor() const;
+
+    float max_load_factor() const;
+
+    void max_load_factor(float load_factor);
 
-template<class KeyType, class ValueType, class Hash = std::hash<KeyType> >
-class HashMap;
+    float min_load_factor() const;
 
-template<class KeyType, class ValueType, class Hash = std::hash<KeyType> >
-class SubTable {
-public:
-    class iterator;
+    void min_load_factor(float load_factor);
 
-    class const_iterator;
+    size_t max_psl() const;
 
-    explicit SubTable(const Hash& hasher = Hash());
+    void max_psl(size_t psl);
 
-    template<class InputIterator>
-    SubTable(InputIterator begin, InputIterator end, Hash hasher = Hash());
+    size_t size_limit() const;
 
-    SubTable(std::initializer_list<std::pair<KeyType, ValueType>> list, const Hash& hasher = Hash());
+    void size_limit(size_t count);
 
-    SubTable(const SubTable &other);
+    void rehash(size_t count);
 
-    SubTable &operator=(const SubTable &other);
+    void reserve(size_t count);
 
-    size_t size() const;
+    void shrink_to_fit();
 
-    bool empty() const;
+    template<class Function>
+    void for_each(Function function);
 
-    Hash hash_function() const;
+    template<class Function>
+    void for_each(Function function) const;
 
-    bool insert(std::pair<KeyType, ValueType> element);
+    template<class Function>
+    void for_each_subtable(Function function) const;
 
-    bool erase(KeyType key);
+    size_t subtable_index(const KeyType& key) const;
 
-    iterator find(KeyType key);
+    int subtable_node(size_t subtable) const;
 
-    const_iterator find(KeyType key) const;
+    template<class Function>
+    decltype(auto) with_subtable(size_t subtable, Function function);
 
-    ValueType &operator[](KeyType key);
+    template<class Function>
+    decltype(auto) with_subtable(size_t subtable, Function function) const;
 
-    const ValueType &at(KeyType key) const;
+    template<class InputIterator, class Executor = ThreadExecutor>
+    void parallel_insert(InputIterator begin, InputIterator end, Executor executor = Executor());
 
-    iterator begin();
+    template<class Function, class Executor = ThreadExecutor>
+    void parallel_for_each(Function function, Executor executor = Executor());
 
-    iterator end();
+    template<class Function, class Executor = ThreadExecutor>
+    void parallel_for_each(Function function, Executor executor = Executor()) const;
 
-    const_iterator begin() const;
+    template<class Predicate, class Executor = ThreadExecutor>
+    size_t parallel_erase_if(Predicate predicate, Executor executor = Executor());
 
-    const_iterator end() const;
+    void save(std::ostream& out) const;
 
-    void clear();
+    void load(std::istream& in);
 
-private:
-    struct Bucket_ {
-    public:
-        std::pair<const KeyType, ValueType> value_;
-        bool is_deleted_ = true;
-        size_t psl_ = 0;
-    };
+    template<class Writer>
+    void save(std::ostream& out, Writer writer) const;
+
+    template<class Reader>
+    void load(std::istream& in, Reader reader);
+
+#if defined(__unix__) || defined(__APPLE__)
+    void load_mapped(const std::string& path);
+#endif
+
+    /*
+        The total and the usage of every subtable. The control block of a subtable is taken as two pointers
+        (the counts of the shared_ptr and the pointer to its functions) and the allocator, unless it is empty,
+        as it is in the common standard libraries.
+    */
+    HashMapMemoryUsage memory_usage() const;
+
+    // payload(element) is the number of bytes the element owns outside of its bucket
+    template<class Function>
+    HashMapMemoryUsage memory_usage(Function payload) const;
 
+#ifdef MY_OWN_HASH_TABLE_STATS
+    HashMapStats stats() const;
+
+    void reset_stats();
+#endif
+
+private:
     Hash hasher_;
+    KeyEqual key_equal_;
     size_t size_;
-    size_t capacity_;
-    std::vector<std::shared_ptr<Bucket_>> table_;
-    double load_factor_ = 0.5;
+    HashMapOptions options_;
+    Allocator allocator_;
+    Subtables_ subtables_;
+
+    /*
+        A snapshot is SnapshotHeader_, a SnapshotSubtable_ for every subtable and then the arrays of the subtables:
+        the metadata (with its padding) and the buckets of each, every one at a multiple of SnapshotAlignment.
+        A streamed snapshot is the same header and descriptors followed by the elements written by a Writer.
+    */
+    struct SnapshotHeader_ {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint64_t streamed;
+        uint64_t key_size;
+        uint64_t value_size;
+        uint64_t bucket_size;
+        uint64_t size;
+        uint64_t subtable_count;
+        uint64_t candidates;
+        uint64_t displacement_window;
+        uint64_t incremental_rehash;
+        double max_load_factor;
+        double displacement_load_factor;
+    };
 
-    void ReHash();
+    struct SnapshotSubtable_ {
+        uint64_t capacity;
+        uint64_t size;
+        uint64_t offset;
+        double load_factor;
+        // The seed of the array (see SubTable::max_psl), the home buckets depend on it
+        uint64_t seed;
+    };
+
+    void InitializeSubtables();
 
-    void InsertElement(std::pair<KeyType, ValueType> element);
+    void ReviveSubtables();
 
-    bool IsExist(KeyType key) const;
+    std::shared_ptr<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>> NewSubtable(size_t index) const;
 
-    void InitializedElements();
+    template<class Usage>
+    HashMapMemoryUsage SumUsage(Usage usage) const;
 
-    size_t NextPos(size_t position) const;
+    Allocator SubtableAllocator(size_t index) const;
 
-    size_t PrevPos(size_t position) const;
+    static std::shared_ptr<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>> CloneSubtable(const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& subtable,
+                                                                                          const Allocator& allocator);
 
-public:
-    class iterator {
-    public:
-        iterator() = default;
+    struct Share_ {};
 
-        iterator(typename std::vector<std::shared_ptr<Bucket_>>::iterator,
-                 typename std::vector<std::shared_ptr<Bucket_>>::iterator end);
+    HashMap(const HashMap& other, Share_);
 
-        iterator& operator++();
+    void AssignSubtables(const HashMap& other, bool share);
 
-        iterator operator++(int);
+    static Allocator CopyAllocator(const Allocator& allocator);
 
-        std::pair<const KeyType, ValueType>& operator*();
+    static SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& Mutable(
+            std::shared_ptr<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>>& subtable);
 
-        std::pair<const KeyType, ValueType>* operator->();
+    bool IsShared(size_t subtable) const;
 
-        bool operator==(const iterator& other) const;
+    void CountSize();
 
-        bool operator!=(const iterator& other) const;
+    SnapshotHeader_ MakeHeader(bool streamed) const;
 
-    private:
-        typename std::vector<std::shared_ptr<Bucket_>>::iterator it_;
-        typename std::vector<std::shared_ptr<Bucket_>>::iterator end_;
+    void ReadHeader(std::istream& in, SnapshotHeader_& header, std::vector<SnapshotSubtable_>& descriptors,
+                    bool streamed);
 
-        friend HashMap<KeyType, ValueType, Hash>;
-    };
+    void CheckHeader(const SnapshotHeader_& header, bool streamed) const;
 
-    class const_iterator {
-    public:
-        const_iterator() = default;
+    void RestoreSubtables(const SnapshotHeader_& header, const std::vector<SnapshotSubtable_>& descriptors);
 
-        const_iterator(typename std::vector<std::shared_ptr<Bucket_>>::const_iterator it,
-                       typename std::vector<std::shared_ptr<Bucket_>>::const_iterator end);
+    void CheckHashes() const;
 
-        const_iterator& operator++();
+    static size_t AlignSnapshot(size_t offset);
 
-        const_iterator operator++(int);
+    static size_t SnapshotLayout(std::vector<SnapshotSubtable_>& descriptors);
 
-        const std::pair<const KeyType, ValueType>& operator*();
+    double MaxLoadFactorInUse() const;
 
-        const std::pair<const KeyType, ValueType>* operator->();
+    size_t SubtableLimit() const;
 
-        bool operator==(const const_iterator& other) const;
+    size_t Candidate(size_t hash, size_t index) const;
 
-        bool operator!=(const const_iterator& other) const;
+    template<class Key>
+    size_t HashOf(const Key& key) const;
 
-    private:
-        typename std::vector<std::shared_ptr<Bucket_>>::const_iterator it_;
-        typename std::vector<std::shared_ptr<Bucket_>>::const_iterator end_;
+    template<class Key>
+    size_t FindSubtable(const Key& key, size_t hash) const;
 
-    };
+    template<class Key>
+    iterator FindKey(const Key& key);
+
+    template<class Key>
+    const_iterator FindKey(const Key& key) const;
+
+    template<class Key>
+    iterator FindHashed(const Key& key, size_t hash);
+
+    template<class Key>
+    const_iterator FindHashed(const Key& key, size_t hash) const;
+
+    void Prefetch(size_t hash) const;
 
+    template<class Key>
+    void EraseKey(const Key& key);
+
+    template<class Iterator>
+    iterator EraseAt(const Iterator& position);
+
+    void PrefetchBatch(const KeyType* keys, size_t count, size_t* hashes) const;
+
+    double Load(size_t subtable) const;
+
+    template<class... Args>
+    std::pair<iterator, bool> EmplaceHashed(const KeyType& key, size_t hash, Args&&... args);
+
+    iterator InsertDisplacing(Stored_ element, size_t hash);
+
+    size_t Displace(size_t hash);
+
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+    template<class, class, class>
+    friend class FindAwaitable;
+#endif
 };
 
-template<class KeyType, class ValueType, class Hash>
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(const Hash& hasher, const KeyEqual& key_equal,
+                                                              const Allocator& allocator) :
+                                                              hasher_(hasher), key_equal_(key_equal), size_(0),
+                                                              allocator_(allocator), subtables_(allocator_) {
+    InitializeSubtables();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(const Allocator& allocator) : HashMap(Hash(), KeyEqual(), allocator) {}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(const HashMapOptions& options, const Hash& hasher,
+                                                   const KeyEqual& key_equal, const Allocator& allocator) :
+                                            hasher_(hasher), key_equal_(key_equal), size_(0), options_(options),
+                                            allocator_(allocator), subtables_(allocator_) {
+    InitializeSubtables();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(size_t subtable_count, const Hash& hasher, const KeyEqual& key_equal,
+                                                              const Allocator& allocator) :
+                                                                    hasher_(hasher), key_equal_(key_equal), size_(0),
+                                                                    allocator_(allocator), subtables_(allocator_) {
+    options_.subtable_count = subtable_count;
+    InitializeSubtables();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
 template<class InputIterator>
-SubTable<KeyType, ValueType, Hash>::SubTable(InputIterator begin, InputIterator end, Hash hasher) :
-                                                                        hasher_(hasher), size_(0), capacity_(8),
-                                                                        table_(8) {
-    InitializedElements();
-    while (begin != end) {
-        insert(*begin);
-        begin++;
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(InputIterator begin, InputIterator end, Hash hasher,
+                                                   const KeyEqual& key_equal, const Allocator& allocator) :
+                                                                    hasher_(hasher), key_equal_(key_equal), size_(0),
+                                                                    allocator_(allocator), subtables_(allocator_) {
+    InitializeSubtables();
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag,
+                                    typename std::iterator_traits<InputIterator>::iterator_category>) {
+        reserve(std::distance(begin, end));
+    }
+    for (auto it = begin; it != end; ++it) {
+        insert(*it);
     }
 }
 
-template<class KeyType, class ValueType, class Hash>
-SubTable<KeyType, ValueType, Hash>::SubTable(const SubTable &other) : hasher_(other.hasher_),
-                                                                      size_(0), capacity_(other.capacity_),
-                                                                      table_(other.capacity_)  {
-    InitializedElements();
-    hasher_ = other.hasher_;
-    for (auto& element : other) {
-        insert(element);
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(std::initializer_list<Stored_> list,
+                                                   const Hash& hasher, const KeyEqual& key_equal,
+                                                   const Allocator& allocator) :
+                                                                    hasher_(hasher), key_equal_(key_equal), size_(0),
+                                                                    allocator_(allocator), subtables_(allocator_) {
+    InitializeSubtables();
+    for (auto it = list.begin(); it != list.end(); ++it) {
+        insert(*it);
     }
 }
 
-template<class KeyType, class ValueType, class Hash>
-SubTable<KeyType, ValueType, Hash>::SubTable(std::initializer_list<std::pair<KeyType, ValueType>> list,
-                                             const Hash& hasher) : hasher_(hasher), size_(0), capacity_(8),
-                                                                   table_(8) {
-    InitializedElements();
-    for (auto &element : list) {
-        insert(element);
-    }
+// Every subtable is cloned with its layout, the subtables which other shares with its snapshots are cloned too
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(const HashMap &other) : hasher_(other.hasher_),
+                                                                           key_equal_(other.key_equal_),
+                                                                           size_(other.size_),
+                                                                           options_(other.options_),
+                                                                           allocator_(CopyAllocator(other.allocator_)),
+                                                                           subtables_(allocator_) {
+    AssignSubtables(other, false);
 }
 
-template<class KeyType, class ValueType, class Hash>
-SubTable<KeyType, ValueType, Hash>::SubTable(const Hash& hasher) : hasher_(hasher),
-                                                                   size_(0), capacity_(8), table_(8) {
-    InitializedElements();
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(const HashMap &other, Share_) : hasher_(other.hasher_),
+                                                                           key_equal_(other.key_equal_),
+                                                                           size_(other.size_),
+                                                                           options_(other.options_),
+                                                                           allocator_(other.allocator_),
+                                                                           subtables_(allocator_) {
+    AssignSubtables(other, true);
 }
 
-template<class KeyType, class ValueType, class Hash>
-SubTable<KeyType, ValueType, Hash>& SubTable<KeyType, ValueType, Hash>::operator=(const SubTable &other) {
-    if (this == &other) {
-        return *this;
+/*
+    A copy which shares the subtables with this map, it costs O(subtable_count()) whatever the size is.
+    A subtable is cloned when the map or the snapshot first changes it (see Mutable), so a write pays for one
+    subtable. Taking a snapshot invalidates the iterators and the references into this map, as a rehash does:
+    a write through one taken before would be seen by the snapshot too.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator> HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::snapshot() const {
+    return HashMap(*this, Share_());
+}
+
+// The moved-from map is empty and has no subtables: it is a valid empty map, which creates them again when it is changed
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashMap(HashMap &&other) noexcept : hasher_(std::move(other.hasher_)),
+                                                                           key_equal_(std::move(other.key_equal_)),
+                                                                           size_(other.size_),
+                                                                           options_(other.options_),
+                                                                           allocator_(std::move(other.allocator_)),
+                                                                           subtables_(std::move(other.subtables_)) {
+    other.size_ = 0;
+    other.subtables_.clear();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator> &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::operator=(const HashMap &other) {
+    if (this != &other) {
+        if constexpr (std::allocator_traits<Allocator>::propagate_on_container_copy_assignment::value) {
+            allocator_ = other.allocator_;
+        }
+        // The options first, the subtable allocators are placed by them
+        options_ = other.options_;
+        AssignSubtables(other, false);
+        hasher_ = other.hasher_;
+        key_equal_ = other.key_equal_;
+        size_ = other.size_;
     }
-    clear();
-    hasher_ = other.hasher_;
-    for (auto& element : other) {
-        insert(element);
+    return *this;
+}
+
+// With allocators which are not equal and do not propagate the subtables of other are moved one by one
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator> &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::operator=(HashMap &&other) noexcept(StealsOnMove<Allocator>::value) {
+    if constexpr (!StealsOnMove<Allocator>::value) {
+        if (allocator_ != other.allocator_) {
+            options_ = other.options_;
+            Subtables_ subtables(allocator_);
+            for (size_t i = 0; i < other.subtables_.size(); ++i) {
+                auto& subtable = other.subtables_[i];
+                Allocator allocator = SubtableAllocator(i);
+                if (subtable.use_count() > 1) {
+                    subtables.push_back(CloneSubtable(*subtable, allocator));
+                } else {
+                    subtables.push_back(std::allocate_shared<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>>(
+                            SubtableAllocator_(allocator), std::move(*subtable), allocator));
+                }
+            }
+            subtables_ = std::move(subtables);
+            hasher_ = other.hasher_;
+            key_equal_ = other.key_equal_;
+            size_ = other.size_;
+            other.size_ = 0;
+            other.subtables_.clear();
+            return *this;
+        }
+    }
+    if (this != &other) {
+        if constexpr (std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value) {
+            allocator_ = std::move(other.allocator_);
+        }
+        hasher_ = std::move(other.hasher_);
+        key_equal_ = std::move(other.key_equal_);
+        size_ = other.size_;
+        options_ = other.options_;
+        subtables_ = std::move(other.subtables_);
+        other.size_ = 0;
+        other.subtables_.clear();
     }
     return *this;
 }
 
-template<class KeyType, class ValueType, class Hash>
-size_t SubTable<KeyType, ValueType, Hash>::size() const {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::size() const {
     return size_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool SubTable<KeyType, ValueType, Hash>::empty() const {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::empty() const {
     return size_ == 0;
 }
 
-template<class KeyType, class ValueType, class Hash>
-Hash SubTable<KeyType, ValueType, Hash>::hash_function() const {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+Hash HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::hash_function() const {
     return hasher_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool SubTable<KeyType, ValueType, Hash>::insert(std::pair<KeyType, ValueType> element) {
-    if (!IsExist(element.first)) {
-        InsertElement(element);
-        size_++;
-        if ((double)capacity_ * load_factor_ <= (double)size_) {
-            ReHash();
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+Allocator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::get_allocator() const {
+    return allocator_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+KeyEqual HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::key_eq() const {
+    return key_equal_;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert(const Stored_& element) {
+    EmplaceHashed(Layout_::Key(element), HashOf(Layout_::Key(element)), element);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert(Stored_&& element) {
+    size_t hash = HashOf(Layout_::Key(element));
+    const KeyType& key = Layout_::Key(element);
+    EmplaceHashed(key, hash, std::move(element));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+std::pair<typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+                                           HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::emplace(Args&&... args) {
+    Stored_ element(std::forward<Args>(args)...);
+    size_t hash = HashOf(Layout_::Key(element));
+    const KeyType& key = Layout_::Key(element);
+    return EmplaceHashed(key, hash, std::move(element));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+std::pair<typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+                   HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::try_emplace(const KeyType& key, Args&&... args) {
+    return EmplaceHashed(key, HashOf(key), std::piecewise_construct, std::forward_as_tuple(key),
+                         std::forward_as_tuple(std::forward<Args>(args)...));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+std::pair<typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+                        HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::try_emplace(KeyType&& key, Args&&... args) {
+    return EmplaceHashed(key, HashOf(key), std::piecewise_construct, std::forward_as_tuple(std::move(key)),
+                         std::forward_as_tuple(std::forward<Args>(args)...));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class MappedType>
+std::pair<typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+          HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert_or_assign(const KeyType& key, MappedType&& value) {
+    auto result = try_emplace(key, std::forward<MappedType>(value));
+    if (!result.second) {
+        result.first->second = std::forward<MappedType>(value);
+    }
+    return result;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class MappedType>
+std::pair<typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+               HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert_or_assign(KeyType&& key, MappedType&& value) {
+    auto result = try_emplace(std::move(key), std::forward<MappedType>(value));
+    if (!result.second) {
+        result.first->second = std::forward<MappedType>(value);
+    }
+    return result;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase(const KeyType& key) {
+    EraseKey(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase(const Key& key) {
+    EraseKey(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::EraseKey(const Key& key) {
+    if (subtables_.empty()) {
+        return;
+    }
+    size_t hash = HashOf(key);
+    for (size_t i = 0; i < options_.candidates; ++i) {
+        size_t subtable = Candidate(hash, i);
+        if (IsShared(subtable) && !subtables_[subtable]->IsExist(key, hash)) {
+            continue;
+        }
+        if (Mutable(subtables_[subtable]).EraseKey(key)) {
+            --size_;
+            return;
         }
-        return true;
     }
-    return false;
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool SubTable<KeyType, ValueType, Hash>::erase(KeyType key) {
-    size_t psl = 0;
-    size_t position = hasher_(key) % capacity_;
-    while (!table_[position].get()->is_deleted_ && table_[position].get()->psl_ >= psl) {
-        if (table_[position].get()->value_.first == key) {
-            break;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase(iterator position) {
+    return EraseAt(position);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase(const_iterator position) {
+    return EraseAt(position);
+}
+
+// The subtable is cloned if it is shared, the clone has the same layout, so the position is found in it as it is
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Iterator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::EraseAt(const Iterator& position) {
+    iterator it(&subtables_, position.pos_, Mutable(subtables_[position.pos_]).erase(position.it_));
+    --size_;
+    it.NextSubtable();
+    return it;
+}
+
+// Takes the element out of the map into a node handle, like erase it invalidates the iterators of the map
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::node_type HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::extract(const_iterator position) {
+    node_type node;
+    node.element_.emplace(Mutable(subtables_[position.pos_]).ExtractAt(position.it_));
+    --size_;
+    return node;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::node_type HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::extract(iterator position) {
+    node_type node;
+    node.element_.emplace(Mutable(subtables_[position.pos_]).ExtractAt(position.it_));
+    --size_;
+    return node;
+}
+
+// An empty node handle if there is no such key
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::node_type HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::extract(const KeyType& key) {
+    auto it = find(key);
+    if (it == end()) {
+        return node_type();
+    }
+    return extract(it);
+}
+
+// Moves the element of node into the map. If the key is already there, node keeps the element and is returned back
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert_return_type HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert(node_type&& node) {
+    if (node.empty()) {
+        return {end(), false, node_type()};
+    }
+    const KeyType& key = Layout_::Key(*node.element_);
+    auto result = EmplaceHashed(key, HashOf(key), std::move(*node.element_));
+    if (!result.second) {
+        return {result.first, false, std::move(node)};
+    }
+    node.element_.reset();
+    return {result.first, true, node_type()};
+}
+
+// Erases every element for which predicate(element) is true. Returns their number
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Predicate>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::erase_if(Predicate predicate) {
+    return parallel_erase_if(std::ref(predicate), SequentialExecutor());
+}
+
+/*
+    Moves the elements of source whose keys are not in this map into it, the others stay in source. With one candidate
+    and the same number of subtables in both maps a key of subtable i of source belongs to subtable i of this map
+    (if the hashers agree), so each pair of subtables is merged by its own task of executor: the subtable is reserved
+    once for the elements of the other one and the elements are moved over without a lookup in other subtables.
+    The elements which go elsewhere, and all of them in other configurations, are moved one by one afterwards.
+    Both maps must not be used by anything else meanwhile, the allocator must be safe to use from several threads.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Executor>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::merge(HashMap& source, Executor executor) {
+    if (&source == this || source.empty()) {
+        return;
+    }
+    bool pairwise = options_.candidates == 1 && source.subtables_.size() == subtables_.size();
+    std::atomic<bool> left{!pairwise};
+    if (pairwise) {
+        for (size_t i = 0; i < subtables_.size(); ++i) {
+            if (!source.subtables_[i]->empty()) {
+                Mutable(subtables_[i]);
+                Mutable(source.subtables_[i]);
+            }
         }
-        ++psl;
-        position = NextPos(position);
+        try {
+            executor(subtables_.size(), [&](size_t subtable) {
+                auto& from = *source.subtables_[subtable];
+                if (from.empty()) {
+                    return;
+                }
+                auto& table = *subtables_[subtable];
+                size_t wanted = table.size() + from.size();
+                table.reserve(options_.size_limit == 0 ? wanted : std::min(wanted, SubtableLimit()));
+                from.TakeIf([&](Stored_& element) {
+                    const KeyType& key = Layout_::Key(element);
+                    size_t hash = HashOf(key);
+                    if (Candidate(hash, 0) != subtable) {
+                        left = true;
+                        return false;
+                    }
+                    return table.EmplaceHashed(key, hash, std::move(element)).second;
+                });
+            });
+        } catch (...) {
+            CountSize();
+            source.CountSize();
+            throw;
+        }
+        CountSize();
+        source.CountSize();
     }
-    if (table_[position].get()->is_deleted_ || table_[position].get()->psl_ < psl) {
-        return false;
+    if (!left) {
+        return;
     }
-    table_[position].get()->is_deleted_ = true;
-    size_--;
-    position = NextPos(position);
-    while (!table_[position].get()->is_deleted_ && table_[position].get()->psl_ > 0) {
-        size_t prev_position = PrevPos(position);
-        swap(table_[position], table_[prev_position]);
-        table_[prev_position].get()->psl_--;
-        position = NextPos(position);
+    for (auto& subtable : source.subtables_) {
+        if (subtable->empty()) {
+            continue;
+        }
+        size_t before = subtable->size();
+        try {
+            Mutable(subtable).TakeIf([&](Stored_& element) {
+                const KeyType& key = Layout_::Key(element);
+                return EmplaceHashed(key, HashOf(key), std::move(element)).second;
+            });
+        } catch (...) {
+            source.size_ -= before - subtable->size();
+            throw;
+        }
+        source.size_ -= before - subtable->size();
     }
-    return true;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::iterator SubTable<KeyType, ValueType, Hash>::find(KeyType key) {
-    size_t psl = 0;
-    for (size_t position = hasher_(key) % capacity_; !table_[position].get()->is_deleted_ &&
-                                    table_[position].get()->psl_ >= psl; ++psl, position = NextPos(position)) {
-        if (table_[position].get()->value_.first == key) {
-            return iterator(table_.begin() + position, table_.end());
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Executor>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::merge(HashMap&& source, Executor executor) {
+    merge(source, executor);
+}
+
+// Erases the elements whose keys are not in other, subtable by subtable with executor. Returns their number
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Executor>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::intersect(const HashMap& other, Executor executor) {
+    if (&other == this) {
+        return 0;
+    }
+    return parallel_erase_if([&other](const Element_& element) {
+        return !other.contains(Layout_::Key(element));
+    }, executor);
+}
+
+// Erases the elements whose keys are in other, subtable by subtable with executor. Returns their number
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Executor>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::subtract(const HashMap& other, Executor executor) {
+    if (&other == this) {
+        size_t size = size_;
+        clear();
+        return size;
+    }
+    return parallel_erase_if([&other](const Element_& element) {
+        return other.contains(Layout_::Key(element));
+    }, executor);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator
+                                              HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find(const KeyType& key) {
+    return FindKey(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator
+                                      HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find(const KeyType& key) const {
+    return FindKey(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find(const Key& key) {
+    return FindKey(key);
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find(const Key& key) const {
+    return FindKey(key);
+}
+
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+// co_await find_async(key) is find(key) which suspends after the prefetch of all candidate subtables
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+FindAwaitable<HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>, KeyType, typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator>
+        HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find_async(const KeyType& key) {
+    return {*this, key};
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+FindAwaitable<const HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>, KeyType, typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator>
+        HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find_async(const KeyType& key) const {
+    return {*this, key};
+}
+#endif
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::contains(const KeyType& key) const {
+    return FindSubtable(key, HashOf(key)) != subtables_.size();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+bool HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::contains(const Key& key) const {
+    return FindSubtable(key, HashOf(key)) != subtables_.size();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::count(const KeyType& key) const {
+    return contains(key) ? 1 : 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::count(const Key& key) const {
+    return contains(key) ? 1 : 0;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator
+                                           HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindKey(const Key& key) {
+    return FindHashed(key, HashOf(key));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator
+                                      HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindKey(const Key& key) const {
+    return FindHashed(key, HashOf(key));
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator
+                                           HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindHashed(const Key& key, size_t hash) {
+    if (subtables_.empty()) {
+        return end();
+    }
+    for (size_t i = 0; i < options_.candidates; ++i) {
+        size_t subtable = Candidate(hash, i);
+        if (IsShared(subtable) && !subtables_[subtable]->IsExist(key, hash)) {
+            continue;
+        }
+        auto it = Mutable(subtables_[subtable]).FindHashed(key, hash);
+        if (it != subtables_[subtable]->end()) {
+            return iterator(&subtables_, subtable, it);
         }
     }
     return end();
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::const_iterator SubTable<KeyType, ValueType, Hash>::find(KeyType key) const {
-    size_t psl = 0;
-    for (size_t position = hasher_(key) % capacity_; !table_[position].get()->is_deleted_ &&
-                                    table_[position].get()->psl_ >= psl; ++psl, position = NextPos(position)) {
-        if (table_[position].get()->value_.first == key) {
-            return const_iterator(table_.begin() + position, table_.end());
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator
+                                      HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindHashed(const Key& key, size_t hash) const {
+    if (subtables_.empty()) {
+        return end();
+    }
+    for (size_t i = 0; i < options_.candidates; ++i) {
+        size_t subtable = Candidate(hash, i);
+        const auto& table = *subtables_[subtable];
+        auto it = table.FindHashed(key, hash);
+        if (it != table.end()) {
+            return const_iterator(&subtables_, subtable, it);
+        }
+    }
+    return end();
+}
+
+/*
+    Batched operations work in windows of BatchWindow keys: all keys of a window are hashed and their home buckets
+    are prefetched first, so the cache misses of independent keys overlap instead of being paid one after another.
+    Results are written in the order of the keys.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::insert_batch(const Stored_* elements,
+                                                                                 size_t count) {
+    ReviveSubtables();
+    size_t hashes[BatchWindow];
+    for (size_t start = 0; start < count; start += BatchWindow) {
+        size_t window = std::min(BatchWindow, count - start);
+        for (size_t i = 0; i < window; ++i) {
+            hashes[i] = HashOf(Layout_::Key(elements[start + i]));
+            subtables_[Candidate(hashes[i], 0)]->Prefetch(hashes[i]);
+        }
+        for (size_t i = 0; i < window; ++i) {
+            EmplaceHashed(Layout_::Key(elements[start + i]), hashes[i], elements[start + i]);
+        }
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find_batch(const KeyType* keys, size_t count, iterator* result) {
+    size_t hashes[BatchWindow];
+    for (size_t start = 0; start < count; start += BatchWindow) {
+        size_t window = std::min(BatchWindow, count - start);
+        PrefetchBatch(keys + start, window, hashes);
+        for (size_t i = 0; i < window; ++i) {
+            result[start + i] = end();
+            for (size_t j = 0; j < options_.candidates && !subtables_.empty(); ++j) {
+                size_t subtable = Candidate(hashes[i], j);
+                if (IsShared(subtable) && !subtables_[subtable]->IsExist(keys[start + i], hashes[i])) {
+                    continue;
+                }
+                // The const lookup does not migrate buckets, so it keeps the results found before valid
+                auto& table = Mutable(subtables_[subtable]);
+                auto it = std::as_const(table).FindHashed(keys[start + i], hashes[i]);
+                if (it != std::as_const(table).end()) {
+                    table.Touch(hashes[i]);
+                    result[start + i] = iterator(&subtables_, subtable, table.Rebase(it));
+                    break;
+                }
+            }
+        }
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::find_batch(const KeyType* keys, size_t count,
+                                                                               const_iterator* result) const {
+    size_t hashes[BatchWindow];
+    for (size_t start = 0; start < count; start += BatchWindow) {
+        size_t window = std::min(BatchWindow, count - start);
+        PrefetchBatch(keys + start, window, hashes);
+        for (size_t i = 0; i < window; ++i) {
+            result[start + i] = end();
+            for (size_t j = 0; j < options_.candidates && !subtables_.empty(); ++j) {
+                size_t subtable = Candidate(hashes[i], j);
+                const auto& table = *subtables_[subtable];
+                auto it = table.FindHashed(keys[start + i], hashes[i]);
+                if (it != table.end()) {
+                    result[start + i] = const_iterator(&subtables_, subtable, it);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::contains_batch(const KeyType* keys, size_t count, bool* result) const {
+    size_t hashes[BatchWindow];
+    for (size_t start = 0; start < count; start += BatchWindow) {
+        size_t window = std::min(BatchWindow, count - start);
+        PrefetchBatch(keys + start, window, hashes);
+        for (size_t i = 0; i < window; ++i) {
+            result[start + i] = false;
+            for (size_t j = 0; j < options_.candidates && !result[start + i] && !subtables_.empty(); ++j) {
+                result[start + i] = subtables_[Candidate(hashes[i], j)]->IsExist(keys[start + i], hashes[i]);
+            }
+        }
+    }
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+ValueType &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::operator[](const KeyType& key) {
+    return try_emplace(key).first->second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+ValueType &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::operator[](KeyType&& key) {
+    return try_emplace(std::move(key)).first->second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+const ValueType &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::at(const KeyType& key) const {
+    auto it = FindKey(key);
+    if (it == end()) {
+        throw std::out_of_range("Key not found");
+    }
+    return it->second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key, class>
+const ValueType &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::at(const Key& key) const {
+    auto it = FindKey(key);
+    if (it == end()) {
+        throw std::out_of_range("Key not found");
+    }
+    return it->second;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::begin() {
+    for (size_t i = 0; i < subtables_.size(); ++i) {
+        if (!subtables_[i]->empty()) {
+            return iterator(&subtables_, i, Mutable(subtables_[i]).begin());
+        }
+    }
+    return end();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::end() {
+    return iterator(&subtables_, subtables_.size(), typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator());
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::begin() const {
+    for (size_t i = 0; i < subtables_.size(); ++i) {
+        if (!subtables_[i]->empty()) {
+            const auto& table = *subtables_[i];
+            return const_iterator(&subtables_, i, table.begin());
+        }
+    }
+    return end();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::end() const {
+    return const_iterator(&subtables_, subtables_.size(),
+                          typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator());
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::clear() {
+    ReviveSubtables();
+    for (size_t i = 0; i < subtables_.size(); ++i) {
+        if (IsShared(i)) {
+            subtables_[i] = NewSubtable(i);
+        } else {
+            subtables_[i]->clear();
         }
     }
-    return end();
+    size_ = 0;
 }
 
-template<class KeyType, class ValueType, class Hash>
-ValueType &SubTable<KeyType, ValueType, Hash>::operator[](KeyType key) {
-    insert({key, ValueType()});
-    return find(key)->second;
+// A moved-from map tells the number of subtables it creates again
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::subtable_count() const {
+    return options_.subtable_count;
 }
 
-template<class KeyType, class ValueType, class Hash>
-const ValueType &SubTable<KeyType, ValueType, Hash>::at(KeyType key) const {
-    if (IsExist(key)) {
-        return find(key)->second;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::bucket_count() const {
+    size_t count = 0;
+    for (auto& subtable : subtables_) {
+        count += subtable->bucket_count();
     }
-    throw std::out_of_range("Key not found");
+    return count;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::iterator SubTable<KeyType, ValueType, Hash>::begin() {
-    for (size_t i = 0; i < capacity_; i++) {
-        if (!table_[i].get()->is_deleted_) {
-            return iterator(table_.begin() + i, table_.end());
-        }
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+float HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::load_factor() const {
+    return (float)size_ / (float)bucket_count();
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+float HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::max_load_factor() const {
+    return (float)MaxLoadFactorInUse();
+}
+
+// In the displacement mode it sets displacement_load_factor, otherwise max_load_factor of every subtable
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::max_load_factor(float load_factor) {
+    for (auto& subtable : subtables_) {
+        Mutable(subtable).max_load_factor(load_factor);
+    }
+    if (options_.candidates > 1) {
+        options_.displacement_load_factor = subtables_[0]->load_factor_;
+    } else {
+        options_.max_load_factor = subtables_[0]->load_factor_;
     }
-    return iterator(table_.end(), table_.end());
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::iterator SubTable<KeyType, ValueType, Hash>::end() {
-    return iterator(table_.end(), table_.end());
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+float HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::min_load_factor() const {
+    return (float)options_.min_load_factor;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::const_iterator SubTable<KeyType, ValueType, Hash>::begin() const {
-    for (size_t i = 0; i < capacity_; i++) {
-        if (!table_[i].get()->is_deleted_) {
-            return const_iterator(table_.begin() + i, table_.end());
-        }
+// Every subtable shrinks on its own, see SubTable::min_load_factor
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::min_load_factor(float load_factor) {
+    for (auto& subtable : subtables_) {
+        Mutable(subtable).min_load_factor(load_factor);
     }
-    return const_iterator(table_.end(), table_.end());
+    options_.min_load_factor = subtables_[0]->min_load_factor_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::const_iterator SubTable<KeyType, ValueType, Hash>::end() const {
-    return const_iterator(table_.end(), table_.end());
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::max_psl() const {
+    return options_.max_psl;
 }
 
-template<class KeyType, class ValueType, class Hash>
-void SubTable<KeyType, ValueType, Hash>::clear() {
-    size_ = 0;
-    capacity_ = 8;
-    table_.clear();
-    table_.resize(8);
-    InitializedElements();
+// Every subtable adapts on its own, see SubTable::max_psl
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::max_psl(size_t psl) {
+    for (auto& subtable : subtables_) {
+        Mutable(subtable).max_psl(psl);
+    }
+    options_.max_psl = psl;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::size_limit() const {
+    return options_.size_limit;
 }
 
-template<class KeyType, class ValueType, class Hash>
-void SubTable<KeyType, ValueType, Hash>::ReHash() {
-    auto old_table = table_;
-    capacity_ *= 2;
-    table_.clear();
-    table_.resize(capacity_);
-    InitializedElements();
-    for (auto &element : old_table) {
-        if (!element.get()->is_deleted_) {
-            InsertElement(element.get()->value_);
+// Every subtable gets an equal share of the limit (at least one element) and evicts on its own
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::size_limit(size_t count) {
+    options_.size_limit = count;
+    for (auto& subtable : subtables_) {
+        if (subtable->size_limit() != SubtableLimit()) {
+            Mutable(subtable).size_limit(SubtableLimit());
         }
     }
+    CountSize();
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool SubTable<KeyType, ValueType, Hash>::IsExist(KeyType key) const {
-    if (find(key) == end()) {
-        return false;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::rehash(size_t count) {
+    ReviveSubtables();
+    for (auto& subtable : subtables_) {
+        Mutable(subtable).rehash((count + subtables_.size() - 1) / subtables_.size());
     }
-    return true;
 }
 
-template<class KeyType, class ValueType, class Hash>
-void SubTable<KeyType, ValueType, Hash>::InsertElement(std::pair<KeyType, ValueType> element) {
-    size_t start_position = hasher_(element.first) % capacity_;
-    size_t psl = 0;
-    while(psl <= table_[start_position].get()->psl_ && !table_[start_position].get()->is_deleted_) {
-        start_position = NextPos(start_position);
-        psl++;
-    }
-    size_t current_position = start_position;
-    while (!table_[start_position].get()->is_deleted_) {
-        current_position = NextPos(current_position);
-        std::swap(table_[current_position], table_[start_position]);
-        table_[current_position].get()->psl_++;
+/*
+    Keys are spread over subtables by the hash, so a subtable gets count / subtable_count() elements
+    only on average. Every subtable reserves a few standard deviations more than that.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::reserve(size_t count) {
+    ReviveSubtables();
+    double expected = (double)count / (double)subtables_.size();
+    size_t per_subtable = (size_t)std::ceil(expected + 4 * std::sqrt(expected));
+    for (auto& subtable : subtables_) {
+        Mutable(subtable).reserve(per_subtable);
     }
-    table_[start_position].reset(new Bucket_({element, false, psl}));
 }
 
-template<class KeyType, class ValueType, class Hash>
-void SubTable<KeyType, ValueType, Hash>::InitializedElements() {
-    for (size_t i = 0; i < capacity_; ++i) {
-        table_[i].reset(new Bucket_({{}, true, 0}));
+// Shrinks every subtable to its own size, subtables which already fit are not copied even if they are shared
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::shrink_to_fit() {
+    for (auto& subtable : subtables_) {
+        if (subtable->FittedCapacity() != subtable->table_.capacity_ || subtable->old_table_.capacity_ != 0) {
+            Mutable(subtable).shrink_to_fit();
+        }
     }
 }
 
-template<class KeyType, class ValueType, class Hash>
-size_t SubTable<KeyType, ValueType, Hash>::NextPos(size_t position) const {
-    ++position;
-    if (position == capacity_) {
-        position = 0;
+// Calls function(element) for every element, subtable by subtable, see SubTable::for_each
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::for_each(Function function) {
+    for (auto& subtable : subtables_) {
+        if (!subtable->empty()) {
+            Mutable(subtable).for_each(std::ref(function));
+        }
     }
-    return position;
 }
 
-template<class KeyType, class ValueType, class Hash>
-size_t SubTable<KeyType, ValueType, Hash>::PrevPos(size_t position) const {
-    if (position == 0) {
-        position = capacity_;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::for_each(Function function) const {
+    for (auto& subtable : subtables_) {
+        const auto& table = *subtable;
+        table.for_each(std::ref(function));
     }
-    --position;
-    return position;
 }
 
-template<class KeyType, class ValueType, class Hash>
-SubTable<KeyType, ValueType, Hash>::iterator::iterator(
-        typename std::vector<std::shared_ptr<Bucket_>>::iterator it,
-        typename std::vector<std::shared_ptr<Bucket_>>::iterator end) : it_(it), end_(end) {}
-
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::iterator& SubTable<KeyType, ValueType, Hash>::iterator::operator++() {
-    ++it_;
-    while (it_ != end_ && (*it_).get()->is_deleted_) {
-        ++it_;
+// Calls function(subtable) for every subtable, so they can be processed independently, for example in parallel
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::for_each_subtable(Function function) const {
+    for (auto& subtable : subtables_) {
+        function(static_cast<const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>&>(*subtable));
     }
-    return *this;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::iterator SubTable<KeyType, ValueType, Hash>::iterator::operator++(int) {
-    iterator tmp = *this;
-    ++(*this);
-    return tmp;
+// The subtable which holds the key, or its first candidate where it is inserted if it is not in the map
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::subtable_index(const KeyType& key) const {
+    size_t hash = HashOf(key);
+    if (subtables_.empty()) {
+        return (hash >> SubtableHashShift) & (options_.subtable_count - 1);
+    }
+    if (options_.candidates > 1) {
+        size_t subtable = FindSubtable(key, hash);
+        if (subtable != subtables_.size()) {
+            return subtable;
+        }
+    }
+    return Candidate(hash, 0);
 }
 
-template<class KeyType, class ValueType, class Hash>
-std::pair<const KeyType, ValueType>& SubTable<KeyType, ValueType, Hash>::iterator::operator*() {
-    return (*it_).get()->value_;
+/*
+    The NUMA node the memory of the subtable is placed on or -1. Subtables of node n are a block of indices,
+    so a scheduler can give every worker the subtables of its own node, find them by subtable_index
+    and work on them through with_subtable.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+int HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::subtable_node(size_t subtable) const {
+    if (!PlacesOnNode<Allocator>::value || options_.numa_nodes == 0) {
+        return -1;
+    }
+    return (int)(subtable * options_.numa_nodes / options_.subtable_count);
 }
 
-template<class KeyType, class ValueType, class Hash>
-std::pair<const KeyType, ValueType>* SubTable<KeyType, ValueType, Hash>::iterator::operator->() {
-    return &((*it_).get()->value_);
+/*
+    Returns function(subtable) for the subtable with that index. The function may look up, change and erase
+    the elements of the subtable, and insert keys whose subtable_index is that subtable. Different subtables
+    may be worked on from different threads at the same time, as long as nothing else uses the map meanwhile;
+    the size of the map is changed by an atomic add, so size() is exact once all of them have returned.
+    A moved-from map creates its subtables again on the first call, which must not run at the same time as others.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+decltype(auto) HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::with_subtable(size_t subtable, Function function) {
+    ReviveSubtables();
+    auto& table = Mutable(subtables_[subtable]);
+    // The size of the map follows the size of the subtable after function returns or throws, a shrunk subtable
+    // adds the difference modulo 2^64, which subtracts it
+    struct Recount {
+        size_t& size;
+        const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& table;
+        size_t old_size;
+
+        ~Recount() {
+            __atomic_fetch_add(&size, table.size() - old_size, __ATOMIC_RELAXED);
+        }
+    } recount{size_, table, table.size()};
+    return function(table);
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool SubTable<KeyType, ValueType, Hash>::iterator::operator==(const iterator& other) const {
-    return it_ == other.it_;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+decltype(auto) HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::with_subtable(size_t subtable, Function function) const {
+    if (subtables_.empty()) {
+        // The subtables of a moved-from map are all empty, an empty table allocates nothing
+        const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator> empty(hasher_, key_equal_,
+                                                                                  SubtableAllocator(subtable));
+        return function(empty);
+    }
+    return function(static_cast<const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>&>(*subtables_[subtable]));
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool SubTable<KeyType, ValueType, Hash>::iterator::operator!=(const iterator& other) const {
-    return !(*this == other);
+/*
+    Inserts the elements of [begin, end) using executor (see ThreadExecutor). Keys go to their first candidate
+    subtable, so the elements are hashed and partitioned by it in parallel, then every subtable is reserved
+    and filled by its own task. The number of subtables limits the parallelism of the second step.
+    With several candidates the keys which are already in the map are filtered out first, the new elements
+    are not spread over the candidates. The allocator must be safe to use from several threads.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class InputIterator, class Executor>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::parallel_insert(InputIterator begin, InputIterator end, Executor executor) {
+    if constexpr (!std::is_base_of_v<std::random_access_iterator_tag,
+                                     typename std::iterator_traits<InputIterator>::iterator_category>) {
+        std::vector<Stored_> elements(begin, end);
+        parallel_insert(std::make_move_iterator(elements.begin()), std::make_move_iterator(elements.end()), executor);
+    } else {
+        size_t count = end - begin;
+        if (count == 0) {
+            return;
+        }
+        size_t subtables = subtables_.size();
+        size_t chunks = std::min(count, subtables);
+        bool check_candidates = options_.candidates > 1 && size_ > 0;
+        std::vector<size_t> hashes(count);
+        std::vector<uint8_t> skip(check_candidates ? count : 0);
+        std::vector<size_t> offsets(chunks * subtables);
+        executor(chunks, [&](size_t chunk) {
+            for (size_t i = count * chunk / chunks; i < count * (chunk + 1) / chunks; ++i) {
+                hashes[i] = HashOf(Layout_::Key(begin[i]));
+                if (check_candidates && FindSubtable(Layout_::Key(begin[i]), hashes[i]) != subtables) {
+                    skip[i] = 1;
+                    continue;
+                }
+                ++offsets[chunk * subtables + Candidate(hashes[i], 0)];
+            }
+        });
+        // offsets[chunk * subtables + subtable] becomes the place of the first element of the chunk in the subtable
+        std::vector<size_t> starts(subtables + 1);
+        size_t total = 0;
+        for (size_t subtable = 0; subtable < subtables; ++subtable) {
+            starts[subtable] = total;
+            for (size_t chunk = 0; chunk < chunks; ++chunk) {
+                size_t elements = offsets[chunk * subtables + subtable];
+                offsets[chunk * subtables + subtable] = total;
+                total += elements;
+            }
+        }
+        starts[subtables] = total;
+        std::vector<size_t> order(total);
+        executor(chunks, [&](size_t chunk) {
+            for (size_t i = count * chunk / chunks; i < count * (chunk + 1) / chunks; ++i) {
+                if (check_candidates && skip[i]) {
+                    continue;
+                }
+                order[offsets[chunk * subtables + Candidate(hashes[i], 0)]++] = i;
+            }
+        });
+        for (size_t subtable = 0; subtable < subtables; ++subtable) {
+            if (starts[subtable] != starts[subtable + 1]) {
+                Mutable(subtables_[subtable]);
+            }
+        }
+        try {
+            executor(subtables, [&](size_t subtable) {
+                if (starts[subtable] == starts[subtable + 1]) {
+                    return;
+                }
+                auto& table = *subtables_[subtable];
+                table.reserve(table.size() + starts[subtable + 1] - starts[subtable]);
+                for (size_t i = starts[subtable]; i < starts[subtable + 1]; ++i) {
+                    auto&& element = begin[order[i]];
+                    const KeyType& key = Layout_::Key(element);
+                    table.EmplaceHashed(key, hashes[order[i]], std::forward<decltype(element)>(element));
+                }
+            });
+        } catch (...) {
+            CountSize();
+            throw;
+        }
+        CountSize();
+    }
 }
 
-template<class KeyType, class ValueType, class Hash>
-SubTable<KeyType, ValueType, Hash>::const_iterator::const_iterator(
-        typename std::vector<std::shared_ptr<Bucket_>>::const_iterator it,
-        typename std::vector<std::shared_ptr<Bucket_>>::const_iterator end) : it_(it), end_(end) {}
-
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::const_iterator&
-                                                SubTable<KeyType, ValueType, Hash>::const_iterator::operator++() {
-    ++it_;
-    while (it_ != end_ && (*it_).get()->is_deleted_) {
-        ++it_;
+// Calls function(element) for every element, the subtables are visited at the same time by executor's tasks
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function, class Executor>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::parallel_for_each(Function function, Executor executor) {
+    for (auto& subtable : subtables_) {
+        if (!subtable->empty()) {
+            Mutable(subtable);
+        }
     }
-    return *this;
+    executor(subtables_.size(), [&](size_t subtable) {
+        subtables_[subtable]->for_each(std::ref(function));
+    });
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename SubTable<KeyType, ValueType, Hash>::const_iterator
-                                                SubTable<KeyType, ValueType, Hash>::const_iterator::operator++(int) {
-    const_iterator tmp = *this;
-    ++(*this);
-    return tmp;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function, class Executor>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::parallel_for_each(Function function, Executor executor) const {
+    executor(subtables_.size(), [&](size_t subtable) {
+        const auto& table = *subtables_[subtable];
+        table.for_each(std::ref(function));
+    });
 }
 
-template<class KeyType, class ValueType, class Hash>
-const std::pair<const KeyType, ValueType>& SubTable<KeyType, ValueType, Hash>::const_iterator::operator*() {
-    return (*it_).get()->value_;
+// Erases every element for which predicate(element) is true, subtable by subtable in parallel. Returns their number
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Predicate, class Executor>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::parallel_erase_if(Predicate predicate, Executor executor) {
+    for (auto& subtable : subtables_) {
+        if (!subtable->empty()) {
+            Mutable(subtable);
+        }
+    }
+    size_t size = size_;
+    try {
+        executor(subtables_.size(), [&](size_t subtable) {
+            subtables_[subtable]->erase_if(std::ref(predicate));
+        });
+    } catch (...) {
+        CountSize();
+        throw;
+    }
+    CountSize();
+    return size - size_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-const std::pair<const KeyType, ValueType>* SubTable<KeyType, ValueType, Hash>::const_iterator::operator->() {
-    return &((*it_).get()->value_);
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMapMemoryUsage HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::memory_usage() const {
+    return SumUsage([](const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& subtable) {
+        return subtable.memory_usage();
+    });
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool SubTable<KeyType, ValueType, Hash>::const_iterator::operator==(const const_iterator& other) const {
-    return it_ == other.it_;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Function>
+HashMapMemoryUsage HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::memory_usage(Function payload) const {
+    return SumUsage([&payload](const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& subtable) {
+        return subtable.memory_usage(std::ref(payload));
+    });
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool SubTable<KeyType, ValueType, Hash>::const_iterator::operator!=(const const_iterator& other) const {
-    return !(*this == other);
+// usage(subtable) is the usage of one subtable, the control blocks and the map itself are added to it
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Usage>
+HashMapMemoryUsage HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SumUsage(Usage usage) const {
+    HashMapMemoryUsage total;
+    for (auto& subtable : subtables_) {
+        total.subtables.push_back(usage(*subtable));
+        total.subtables.back().auxiliary += 2 * sizeof(void*) +
+                                            (std::is_empty_v<SubtableAllocator_> ? 0 : sizeof(SubtableAllocator_));
+        total += total.subtables.back();
+    }
+    total.auxiliary += sizeof(*this) + subtables_.capacity() * sizeof(typename Subtables_::value_type);
+    return total;
 }
 
-template<class KeyType, class ValueType, class Hash>
-class HashMap {
-public:
-    class iterator {
-    public:
-        iterator() = default;
-
-        iterator(std::array<std::shared_ptr<SubTable<KeyType, ValueType, Hash>>, SubtableSize>* subtables,
-                 size_t pos, typename SubTable<KeyType, ValueType, Hash>::iterator it);
-
-        iterator& operator++();
-
-        iterator operator++(int);
-
-        std::pair<const KeyType, ValueType>& operator*();
-
-        std::pair<const KeyType, ValueType>* operator->();
-
-        bool operator==(const iterator& other) const;
+#ifdef MY_OWN_HASH_TABLE_STATS
+// Sums up the statistics of the subtables, they are kept in subtables too
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMapStats HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::stats() const {
+    HashMapStats stats;
+    stats.size = size_;
+    stats.min_subtable_size = std::numeric_limits<size_t>::max();
+    double total_psl = 0;
+    for (auto& subtable : subtables_) {
+        stats.subtables.push_back(subtable->stats());
+        const SubTableStats& part = stats.subtables.back();
+        stats.capacity += part.capacity;
+        stats.min_subtable_size = std::min(stats.min_subtable_size, part.size);
+        stats.max_subtable_size = std::max(stats.max_subtable_size, part.size);
+        stats.max_psl = std::max(stats.max_psl, part.max_psl);
+        total_psl += part.mean_psl * part.size;
+        stats.rehash_count += part.rehash_count;
+        stats.rehash_seconds += part.rehash_seconds;
+        stats.evictions += part.evictions;
+        stats.reseeds += part.reseeds;
+        stats.find += part.find;
+        stats.insert += part.insert;
+        stats.erase += part.erase;
+    }
+    stats.load = stats.capacity == 0 ? 0 : (double)size_ / stats.capacity;
+    stats.mean_psl = size_ == 0 ? 0 : total_psl / size_;
+    stats.imbalance = size_ == 0 ? 1 : (double)stats.max_subtable_size * subtables_.size() / size_;
+    return stats;
+}
 
-        bool operator!=(const iterator& other) const;
+// Shared subtables are not copied for it, their counters are reset for every snapshot of the map which shares them
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::reset_stats() {
+    for (auto& subtable : subtables_) {
+        subtable->reset_stats();
+    }
+}
+#endif
 
-    private:
-        std::array<std::shared_ptr<SubTable<KeyType, ValueType, Hash>>, SubtableSize>* subtables_;
-        size_t pos_;
-        typename SubTable<KeyType, ValueType, Hash>::iterator it_;
+/*
+    Writes the exact layout of the map: the options, and the metadata and the buckets of every subtable,
+    so load and load_mapped restore it without rehashing. Only for trivially copyable keys and values,
+    the other ones are saved with a Writer. A subtable in the middle of an incremental rehash is saved rehashed.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::save(std::ostream& out) const {
+    static_assert(std::is_trivially_copyable_v<KeyType> && std::is_trivially_copyable_v<ValueType>,
+                  "save(out) needs trivially copyable types, use save(out, writer)");
+    if (subtables_.empty()) {
+        // A moved-from map is saved as the empty map it stands for
+        HashMap(options_, hasher_, key_equal_, allocator_).save(out);
+        return;
+    }
+    std::vector<const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>*> tables;
+    std::vector<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>> rehashed;
+    rehashed.reserve(subtables_.size());
+    for (auto& subtable : subtables_) {
+        if (subtable->old_table_.capacity_ != 0) {
+            rehashed.push_back(*subtable);
+            rehashed.back().FinishMigration();
+            tables.push_back(&rehashed.back());
+        } else {
+            tables.push_back(subtable.get());
+        }
+    }
+    SnapshotHeader_ header = MakeHeader(false);
+    std::vector<SnapshotSubtable_> descriptors(tables.size());
+    for (size_t i = 0; i < tables.size(); ++i) {
+        descriptors[i] = {tables[i]->table_.capacity_, tables[i]->size_, 0, tables[i]->load_factor_,
+                          tables[i]->table_.seed_};
+    }
+    SnapshotLayout(descriptors);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(descriptors.data()), descriptors.size() * sizeof(SnapshotSubtable_));
+    size_t written = sizeof(header) + descriptors.size() * sizeof(SnapshotSubtable_);
+    std::vector<char> buffer;
+    auto pad = [&](size_t offset) {
+        buffer.assign(offset - written, 0);
+        out.write(buffer.data(), buffer.size());
+        written = offset;
     };
+    for (size_t i = 0; i < tables.size(); ++i) {
+        const auto& array = tables[i]->table_;
+        pad(descriptors[i].offset);
+        out.write(reinterpret_cast<const char*>(array.meta_), array.capacity_ + MetaPadding);
+        written += array.capacity_ + MetaPadding;
+        pad(AlignSnapshot(written));
+        // Empty buckets are written as zeros, not as whatever their memory holds
+        const size_t group = 1024;
+        buffer.resize(group * sizeof(array.buckets_[0]));
+        for (size_t start = 0; start < array.capacity_; start += group) {
+            size_t count = std::min(group, array.capacity_ - start);
+            std::fill(buffer.begin(), buffer.end(), 0);
+            for (size_t j = 0; j < count; ++j) {
+                if (array.meta_[start + j] != EmptyMeta) {
+                    std::memcpy(buffer.data() + j * sizeof(array.buckets_[0]), &array.buckets_[start + j],
+                                sizeof(array.buckets_[0]));
+                }
+            }
+            out.write(buffer.data(), count * sizeof(array.buckets_[0]));
+        }
+        written += array.capacity_ * sizeof(array.buckets_[0]);
+    }
+    if (!out) {
+        throw std::runtime_error("can not write the snapshot");
+    }
+}
 
-    class const_iterator {
-    public:
-        const_iterator() = default;
-
-        const_iterator(const std::array<std::shared_ptr<SubTable<KeyType, ValueType, Hash>>, SubtableSize>* subtables,
-                       size_t pos, typename SubTable<KeyType, ValueType, Hash>::iterator it);
-
-        const_iterator& operator++();
-
-        const_iterator operator++(int);
-
-        const std::pair<const KeyType, ValueType>& operator*();
-
-        const std::pair<const KeyType, ValueType>* operator->();
-
-        bool operator==(const const_iterator& other) const;
-
-        bool operator!=(const const_iterator& other) const;
-
-    private:
-        const std::array<std::shared_ptr<SubTable<KeyType, ValueType, Hash>>, SubtableSize>* subtables_;
-        size_t pos_;
-        typename SubTable<KeyType, ValueType, Hash>::iterator it_;
+// Replaces the map with a snapshot written by save(out), the arrays are read as they are
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::load(std::istream& in) {
+    static_assert(std::is_trivially_copyable_v<KeyType> && std::is_trivially_copyable_v<ValueType>,
+                  "load(in) needs trivially copyable types, use load(in, reader)");
+    SnapshotHeader_ header;
+    std::vector<SnapshotSubtable_> descriptors;
+    ReadHeader(in, header, descriptors, false);
+    HashMap map(options_, hasher_, key_equal_, allocator_);
+    map.RestoreSubtables(header, descriptors);
+    size_t read = sizeof(header) + descriptors.size() * sizeof(SnapshotSubtable_);
+    auto skip = [&](size_t offset) {
+        in.ignore(offset - read);
+        read = offset;
     };
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        auto& table = *map.subtables_[i];
+        table.table_ = SnapshotArray_(descriptors[i].capacity, table.allocator_);
+        auto& array = table.table_;
+        array.seed_ = descriptors[i].seed;
+        skip(descriptors[i].offset);
+        in.read(reinterpret_cast<char*>(array.meta_), array.capacity_ + MetaPadding);
+        read += array.capacity_ + MetaPadding;
+        skip(AlignSnapshot(read));
+        in.read(reinterpret_cast<char*>(array.buckets_), array.capacity_ * sizeof(array.buckets_[0]));
+        read += array.capacity_ * sizeof(array.buckets_[0]);
+        if (!in) {
+            // Nothing was destroyed in the buckets yet, so the array is dropped as empty
+            std::fill(array.meta_, array.meta_ + array.capacity_ + MetaPadding, EmptyMeta);
+            throw std::runtime_error("the snapshot is truncated");
+        }
+        table.size_ = descriptors[i].size;
+    }
+    map.CheckHashes();
+    *this = std::move(map);
+}
 
-    explicit HashMap(const Hash& hasher = Hash());
-
-    template<class InputIterator>
-    HashMap(InputIterator begin, InputIterator end, Hash hasher = Hash());
-
-    HashMap(std::initializer_list<std::pair<KeyType, ValueType>> list, const Hash& hasher = Hash());
-
-    HashMap(const HashMap &other);
-
-    HashMap &operator=(const HashMap &other);
-
-    size_t size() const;
-
-    bool empty() const;
-
-    Hash hash_function() const;
-
-    void insert(std::pair<KeyType, ValueType> element);
-
-    void erase(KeyType key);
-
-    iterator find(KeyType key);
-
-    const_iterator find(KeyType key) const;
-
-    ValueType &operator[](KeyType key);
+/*
+    Writes the options, the size of every subtable and then every element with writer(out, element),
+    for keys and values which are not trivially copyable. The size of the subtables lets load presize them.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Writer>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::save(std::ostream& out, Writer writer) const {
+    if (subtables_.empty()) {
+        HashMap(options_, hasher_, key_equal_, allocator_).save(out, writer);
+        return;
+    }
+    SnapshotHeader_ header = MakeHeader(true);
+    std::vector<SnapshotSubtable_> descriptors(subtables_.size());
+    for (size_t i = 0; i < subtables_.size(); ++i) {
+        descriptors[i] = {subtables_[i]->bucket_count(), subtables_[i]->size(), 0, subtables_[i]->load_factor_, 0};
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(descriptors.data()), descriptors.size() * sizeof(SnapshotSubtable_));
+    for (auto& subtable : subtables_) {
+        const auto& table = *subtable;
+        table.for_each([&](const Element_& element) {
+            writer(out, element);
+        });
+    }
+    if (!out) {
+        throw std::runtime_error("can not write the snapshot");
+    }
+}
 
-    const ValueType &at(KeyType key) const;
+// Replaces the map with a snapshot written by save(out, writer), reader(in) returns the next element
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Reader>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::load(std::istream& in, Reader reader) {
+    SnapshotHeader_ header;
+    std::vector<SnapshotSubtable_> descriptors;
+    ReadHeader(in, header, descriptors, true);
+    HashMap map(options_, hasher_, key_equal_, allocator_);
+    map.RestoreSubtables(header, descriptors);
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        map.subtables_[i]->reserve(descriptors[i].size);
+    }
+    for (uint64_t i = 0; i < header.size; ++i) {
+        Stored_ element = reader(in);
+        if (!in) {
+            throw std::runtime_error("the snapshot is truncated");
+        }
+        map.insert(std::move(element));
+    }
+    *this = std::move(map);
+}
 
-    iterator begin();
+#if defined(__unix__) || defined(__APPLE__)
+/*
+    Replaces the map with a snapshot written by save(out) which is mapped into memory instead of being read,
+    so the map is ready at once and lookups run against the mapped pages. The mapping is private: a change
+    of the map copies only the touched pages and never reaches the file, a grown subtable leaves it.
+    The file must not be changed while it is mapped.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::load_mapped(const std::string& path) {
+    static_assert(std::is_trivially_copyable_v<KeyType> && std::is_trivially_copyable_v<ValueType>,
+                  "load_mapped needs trivially copyable types");
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        throw std::runtime_error("can not open the snapshot " + path);
+    }
+    struct stat status;
+    if (::fstat(file, &status) != 0 || (size_t)status.st_size < sizeof(SnapshotHeader_)) {
+        ::close(file);
+        throw std::runtime_error("the snapshot is truncated");
+    }
+    size_t length = status.st_size;
+    void* memory = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    ::close(file);
+    if (memory == MAP_FAILED) {
+        throw std::runtime_error("can not map the snapshot " + path);
+    }
+    std::shared_ptr<void> mapping(memory, [length](void* memory) {
+        ::munmap(memory, length);
+    });
+    char* base = static_cast<char*>(memory);
+    SnapshotHeader_ header;
+    std::memcpy(&header, base, sizeof(header));
+    CheckHeader(header, false);
+    if (length < sizeof(header) + header.subtable_count * sizeof(SnapshotSubtable_)) {
+        throw std::runtime_error("the snapshot is truncated");
+    }
+    std::vector<SnapshotSubtable_> descriptors(header.subtable_count);
+    std::memcpy(descriptors.data(), base + sizeof(header), descriptors.size() * sizeof(SnapshotSubtable_));
+    std::vector<SnapshotSubtable_> expected = descriptors;
+    if (SnapshotLayout(expected) > length) {
+        throw std::runtime_error("the snapshot is truncated");
+    }
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        if (expected[i].offset != descriptors[i].offset) {
+            throw std::runtime_error("the snapshot is corrupted");
+        }
+    }
+    HashMap map(options_, hasher_, key_equal_, allocator_);
+    map.RestoreSubtables(header, descriptors);
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        auto& table = *map.subtables_[i];
+        size_t capacity = descriptors[i].capacity;
+        auto* meta = reinterpret_cast<uint8_t*>(base + descriptors[i].offset);
+        auto* buckets = reinterpret_cast<SnapshotBucket_*>(
+                base + AlignSnapshot(descriptors[i].offset + capacity + MetaPadding));
+        table.table_ = SnapshotArray_(capacity, meta, buckets);
+        table.table_.seed_ = descriptors[i].seed;
+        table.size_ = descriptors[i].size;
+        table.mapping_ = mapping;
+    }
+    map.CheckHashes();
+    *this = std::move(map);
+}
+#endif
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SnapshotHeader_ HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::MakeHeader(bool streamed) const {
+    SnapshotHeader_ header = {{'D', 'Y', 'S', 'E', 'C', 'T', 'H', 'M'}, SnapshotVersion, 0x01020304, streamed,
+                              sizeof(KeyType), sizeof(ValueType), sizeof(SnapshotBucket_), size_, subtables_.size(),
+                              options_.candidates, options_.displacement_window, options_.incremental_rehash,
+                              options_.max_load_factor, options_.displacement_load_factor};
+    return header;
+}
 
-    iterator end();
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ReadHeader(std::istream& in, SnapshotHeader_& header,
+                                                                               std::vector<SnapshotSubtable_>& descriptors,
+                                                                               bool streamed) {
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in) {
+        throw std::runtime_error("the snapshot is truncated");
+    }
+    CheckHeader(header, streamed);
+    descriptors.resize(header.subtable_count);
+    in.read(reinterpret_cast<char*>(descriptors.data()), descriptors.size() * sizeof(SnapshotSubtable_));
+    if (!in) {
+        throw std::runtime_error("the snapshot is truncated");
+    }
+    if (!streamed) {
+        std::vector<SnapshotSubtable_> expected = descriptors;
+        SnapshotLayout(expected);
+        for (size_t i = 0; i < descriptors.size(); ++i) {
+            if (expected[i].offset != descriptors[i].offset) {
+                throw std::runtime_error("the snapshot is corrupted");
+            }
+        }
+    }
+}
 
-    const_iterator begin() const;
+// Rejects snapshots of another version, another kind, another machine or other types
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CheckHeader(const SnapshotHeader_& header, bool streamed) const {
+    if (std::memcmp(header.magic, "DYSECTHM", sizeof(header.magic)) != 0) {
+        throw std::runtime_error("not a snapshot");
+    }
+    if (header.version != SnapshotVersion || header.byte_order != 0x01020304) {
+        throw std::runtime_error("the snapshot has another version or byte order");
+    }
+    if (header.streamed != streamed) {
+        throw std::runtime_error(streamed ? "the snapshot is a memory layout, load it without a reader"
+                                          : "the snapshot is streamed, load it with a reader");
+    }
+    if (!streamed && (header.key_size != sizeof(KeyType) || header.value_size != sizeof(ValueType) ||
+                      header.bucket_size != sizeof(SnapshotBucket_))) {
+        throw std::runtime_error("the snapshot has other types");
+    }
+    if (header.subtable_count == 0 || (header.subtable_count & (header.subtable_count - 1)) != 0 ||
+        header.candidates == 0) {
+        throw std::runtime_error("the snapshot is corrupted");
+    }
+}
 
-    const_iterator end() const;
+// Replaces the subtables with empty ones under the options of the snapshot
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::RestoreSubtables(const SnapshotHeader_& header,
+                                                                                     const std::vector<SnapshotSubtable_>& descriptors) {
+    options_.subtable_count = header.subtable_count;
+    options_.candidates = header.candidates;
+    options_.displacement_window = header.displacement_window;
+    options_.incremental_rehash = header.incremental_rehash;
+    options_.max_load_factor = header.max_load_factor;
+    options_.displacement_load_factor = header.displacement_load_factor;
+    size_ = header.streamed ? 0 : header.size;
+    subtables_.clear();
+    InitializeSubtables();
+    for (size_t i = 0; i < descriptors.size(); ++i) {
+        subtables_[i]->load_factor_ = std::min(std::max(descriptors[i].load_factor, MinLoadFactor), MaxLoadFactor);
+        size_t capacity = descriptors[i].capacity;
+        if (!header.streamed && (capacity == 0 || (capacity & (capacity - 1)) != 0 || descriptors[i].size >= capacity)) {
+            throw std::runtime_error("the snapshot is corrupted");
+        }
+    }
+}
 
-    void clear();
+/*
+    A snapshot of a map with another hash function (or another seed of it) would load fine and find nothing,
+    so the first element of every subtable is checked to be in its home bucket and in one of its candidates.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CheckHashes() const {
+    for (size_t i = 0; i < subtables_.size(); ++i) {
+        const auto& array = subtables_[i]->table_;
+        size_t position = NextOccupied(array.meta_, array.meta_ + array.capacity_) - array.meta_;
+        if (position == array.capacity_ || array.meta_[position] == SaturatedMeta) {
+            continue;
+        }
+        size_t hash = HashOf(Layout_::Key(array.buckets_[position].Value()));
+        bool candidate = false;
+        for (size_t j = 0; j < options_.candidates; ++j) {
+            candidate = candidate || Candidate(hash, j) == i;
+        }
+        size_t home = (position + array.capacity_ - (array.meta_[position] - 1)) & (array.capacity_ - 1);
+        if (!candidate || home != array.Home(hash)) {
+            throw std::runtime_error("the snapshot was written with another hash function");
+        }
+    }
+}
 
-private:
-    Hash hasher_;
-    size_t size_;
-    std::array<std::shared_ptr<SubTable<KeyType, ValueType, Hash>>, SubtableSize> subtables_;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::AlignSnapshot(size_t offset) {
+    return (offset + SnapshotAlignment - 1) / SnapshotAlignment * SnapshotAlignment;
+}
 
-    void InitializeSubtables();
-};
+// Sets the offsets of the subtables in a snapshot from their capacities and returns the size of the snapshot
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SnapshotLayout(std::vector<SnapshotSubtable_>& descriptors) {
+    static_assert(alignof(SnapshotBucket_) <= SnapshotAlignment, "buckets are aligned too much for a snapshot");
+    size_t offset = AlignSnapshot(sizeof(SnapshotHeader_) + descriptors.size() * sizeof(SnapshotSubtable_));
+    for (auto& descriptor : descriptors) {
+        if (descriptor.capacity > std::numeric_limits<size_t>::max() / 2 / sizeof(SnapshotBucket_)) {
+            throw std::runtime_error("the snapshot is corrupted");
+        }
+        descriptor.offset = offset;
+        offset = AlignSnapshot(offset + descriptor.capacity + MetaPadding);
+        offset = AlignSnapshot(offset + descriptor.capacity * sizeof(SnapshotBucket_));
+    }
+    return offset;
+}
 
-template<class KeyType, class ValueType, class Hash>
-HashMap<KeyType, ValueType, Hash>::HashMap(const Hash& hasher) : hasher_(hasher), size_(0) {
-    InitializeSubtables();
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+double HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::MaxLoadFactorInUse() const {
+    return options_.candidates > 1 ? options_.displacement_load_factor : options_.max_load_factor;
 }
 
-template<class KeyType, class ValueType, class Hash>
-template<class InputIterator>
-HashMap<KeyType, ValueType, Hash>::HashMap(InputIterator begin, InputIterator end, Hash hasher) : hasher_(hasher),
-                                                                                                    size_(0) {
-    InitializeSubtables();
-    for (auto it = begin; it != end; ++it) {
-        insert(*it);
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubtableLimit() const {
+    if (options_.size_limit == 0) {
+        return 0;
     }
+    return std::max<size_t>(options_.size_limit / subtables_.size(), 1);
 }
 
-template<class KeyType, class ValueType, class Hash>
-HashMap<KeyType, ValueType, Hash>::HashMap(std::initializer_list<std::pair<KeyType, ValueType>> list,
-                                           const Hash& hasher) : hasher_(hasher), size_(0) {
-    InitializeSubtables();
-    for (auto it = list.begin(); it != list.end(); ++it) {
-        insert(*it);
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::InitializeSubtables() {
+    size_t count = 1;
+    while (count < options_.subtable_count) {
+        count *= 2;
+    }
+    options_.subtable_count = count;
+    options_.candidates = std::max<size_t>(options_.candidates, 1);
+    subtables_.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        subtables_[i] = NewSubtable(i);
     }
 }
 
-template<class KeyType, class ValueType, class Hash>
-HashMap<KeyType, ValueType, Hash>::HashMap(const HashMap &other) : hasher_(other.hasher_), size_(other.size_) {
-    InitializeSubtables();
-    for (size_t i = 0; i < SubtableSize; ++i) {
-        subtables_[i] = other.subtables_[i];
+// A moved-from map has no subtables, they are created again with its options before it is changed
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::ReviveSubtables() {
+    if (subtables_.empty()) {
+        InitializeSubtables();
     }
 }
 
-template<class KeyType, class ValueType, class Hash>
-HashMap<KeyType, ValueType, Hash> &HashMap<KeyType, ValueType, Hash>::operator=(const HashMap &other) {
-    if (this != &other) {
-        clear();
-        hasher_ = other.hasher_;
-        size_ = other.size_;
-        for (size_t i = 0; i < SubtableSize; ++i) {
-            subtables_[i] = other.subtables_[i];
-        }
-    }
-    return *this;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+std::shared_ptr<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>> HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::NewSubtable(size_t index) const {
+    Allocator allocator = SubtableAllocator(index);
+    auto subtable = std::allocate_shared<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>>(SubtableAllocator_(allocator), hasher_, key_equal_,
+                                                                                 allocator);
+    subtable->max_load_factor((float)MaxLoadFactorInUse());
+    subtable->min_load_factor((float)options_.min_load_factor);
+    subtable->incremental_rehash(options_.incremental_rehash);
+    subtable->size_limit(SubtableLimit());
+    subtable->max_psl(options_.max_psl);
+    return subtable;
 }
 
-template<class KeyType, class ValueType, class Hash>
-size_t HashMap<KeyType, ValueType, Hash>::size() const {
-    return size_;
+/*
+    Snapshots of a map share their subtables until one of them changes a subtable: the subtable is cloned then
+    and the snapshot gets its own one. Everything that may change a subtable, including non-const iterators,
+    gets it through Mutable. The acquire fence makes the last release of the other copy visible,
+    so the subtable is not changed while a snapshot in another thread is still cloning it.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>&
+            HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Mutable(std::shared_ptr<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>>& subtable) {
+    if (subtable.use_count() > 1) {
+        subtable = CloneSubtable(*subtable, subtable->get_allocator());
+    } else {
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *subtable;
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool HashMap<KeyType, ValueType, Hash>::empty() const {
-    return size_ == 0;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+std::shared_ptr<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>> HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CloneSubtable(const SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>& subtable,
+                                                                                          const Allocator& allocator) {
+    return std::allocate_shared<SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>>(SubtableAllocator_(allocator), subtable, allocator);
 }
 
-template<class KeyType, class ValueType, class Hash>
-Hash HashMap<KeyType, ValueType, Hash>::hash_function() const {
-    return hasher_;
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+Allocator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CopyAllocator(const Allocator& allocator) {
+    return std::allocator_traits<Allocator>::select_on_container_copy_construction(allocator);
 }
 
-template<class KeyType, class ValueType, class Hash>
-void HashMap<KeyType, ValueType, Hash>::insert(std::pair<KeyType, ValueType> element) {
-    size_t hash = hasher_(element.first)  & (SubtableSize - 1);
-    if (subtables_[hash]->insert(element)) {
-        ++size_;
+// Shared subtables come from the own allocator, so only a snapshot with an equal one shares them
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::AssignSubtables(const HashMap& other, bool share) {
+    if (share && allocator_ == other.allocator_) {
+        subtables_ = other.subtables_;
+        return;
     }
+    Subtables_ subtables(allocator_);
+    for (size_t i = 0; i < other.subtables_.size(); ++i) {
+        subtables.push_back(CloneSubtable(*other.subtables_[i], SubtableAllocator(i)));
+    }
+    subtables_ = std::move(subtables);
 }
 
-template<class KeyType, class ValueType, class Hash>
-void HashMap<KeyType, ValueType, Hash>::erase(KeyType key) {
-    size_t hash = hasher_(key) & (SubtableSize - 1);
-    if (subtables_[hash]->erase(key)) {
-        --size_;
+// The allocator of the map placed on the node of the subtable, the subtable object and its arrays come from it
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+Allocator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::SubtableAllocator(size_t index) const {
+    if constexpr (PlacesOnNode<Allocator>::value) {
+        if (options_.numa_nodes != 0) {
+            return allocator_.on_node((int)(index * options_.numa_nodes / options_.subtable_count));
+        }
+    } else {
+        (void)index;
     }
+    return allocator_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::iterator HashMap<KeyType, ValueType, Hash>::find(KeyType key) {
-    size_t hash = hasher_(key) & (SubtableSize - 1);
-    auto it = subtables_[hash]->find(key);
-    if (it != subtables_[hash]->end()) {
-        return iterator(&subtables_, hash, it);
-    }
-    return end();
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::IsShared(size_t subtable) const {
+    return subtables_[subtable].use_count() > 1;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::const_iterator HashMap<KeyType, ValueType, Hash>::find(KeyType key) const {
-    size_t hash = hasher_(key) & (SubtableSize - 1);
-    auto it = subtables_[hash]->find(key);
-    if (it != subtables_[hash]->end()) {
-        return const_iterator(&subtables_, hash, it);
+// Takes size_ from the subtables after they were changed without HashMap, as the parallel operations do
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::CountSize() {
+    size_ = 0;
+    for (auto& subtable : subtables_) {
+        size_ += subtable->size();
     }
-    return end();
 }
 
-template<class KeyType, class ValueType, class Hash>
-ValueType &HashMap<KeyType, ValueType, Hash>::operator[](KeyType key) {
-    size_t hash = hasher_(key) & (SubtableSize - 1);
-    if (subtables_[hash]->insert(std::make_pair(key, ValueType()))) {
-        ++size_;
+/*
+    The first candidate is taken from the high bits of the hash, which the subtables do not use for buckets.
+    The others are taken from the middle bits of the hash multiplied by an odd constant,
+    which makes them independent of the first one.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Candidate(size_t hash, size_t index) const {
+    if (index == 0) {
+        return (hash >> SubtableHashShift) & (subtables_.size() - 1);
     }
-    return find(key)->second;
+    uint64_t mixed = (static_cast<uint64_t>(hash) + index) * 0x9E3779B97F4A7C15ull;
+    return static_cast<size_t>(mixed >> 32) & (subtables_.size() - 1);
 }
 
-template<class KeyType, class ValueType, class Hash>
-const ValueType &HashMap<KeyType, ValueType, Hash>::at(KeyType key) const {
-    size_t hash = hasher_(key) & (SubtableSize - 1);
-    return subtables_[hash]->at(key);
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::HashOf(const Key& key) const {
+    return HashMix<Hash>::Mix(hasher_(key));
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::iterator HashMap<KeyType, ValueType, Hash>::begin() {
-    for (size_t i = 0; i < SubtableSize; ++i) {
-        if (!subtables_[i]->empty()) {
-            return iterator(&subtables_, i, subtables_[i]->begin());
+// Returns the subtable which contains the key or subtables_.size() if there is no such key
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class Key>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::FindSubtable(const Key& key, size_t hash) const {
+    for (size_t i = 0; i < options_.candidates && !subtables_.empty(); ++i) {
+        size_t subtable = Candidate(hash, i);
+        if (subtables_[subtable]->IsExist(key, hash)) {
+            return subtable;
         }
     }
-    return end();
+    return subtables_.size();
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::iterator HashMap<KeyType, ValueType, Hash>::end() {
-    return iterator(&subtables_, SubtableSize, subtables_[SubtableSize - 1]->end());
+// Hashes count <= BatchWindow keys into hashes and prefetches their home buckets in every candidate subtable
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::PrefetchBatch(const KeyType* keys, size_t count, size_t* hashes) const {
+    for (size_t i = 0; i < count; ++i) {
+        hashes[i] = HashOf(keys[i]);
+        Prefetch(hashes[i]);
+    }
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::const_iterator HashMap<KeyType, ValueType, Hash>::begin() const {
-    for (size_t i = 0; i < SubtableSize; ++i) {
-        if (!subtables_[i]->empty()) {
-            return const_iterator(&subtables_, i, subtables_[i]->begin());
-        }
+// Prefetches the home bucket of the hash in every candidate subtable
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Prefetch(size_t hash) const {
+    for (size_t i = 0; i < options_.candidates && !subtables_.empty(); ++i) {
+        subtables_[Candidate(hash, i)]->Prefetch(hash);
     }
-    return end();
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::const_iterator HashMap<KeyType, ValueType, Hash>::end() const {
-    return const_iterator(&subtables_, SubtableSize, subtables_[SubtableSize - 1]->end());
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+double HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Load(size_t subtable) const {
+    return (double)subtables_[subtable]->size_ / (double)subtables_[subtable]->bucket_count();
 }
 
-template<class KeyType, class ValueType, class Hash>
-void HashMap<KeyType, ValueType, Hash>::clear() {
-    for (size_t i = 0; i < SubtableSize; ++i) {
-        subtables_[i]->clear();
+/*
+    With one candidate the key is looked up and placed in a single pass over its subtable.
+    With several candidates all of them are searched first and the element is constructed only if the key is absent.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+template<class... Args>
+std::pair<typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator, bool>
+    HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::EmplaceHashed(const KeyType& key, size_t hash, Args&&... args) {
+    ReviveSubtables();
+    if (options_.candidates > 1) {
+        size_t subtable = FindSubtable(key, hash);
+        if (subtable != subtables_.size()) {
+            return {iterator(&subtables_, subtable, Mutable(subtables_[subtable]).FindHashed(key, hash)), false};
+        }
+        return {InsertDisplacing(Stored_(std::forward<Args>(args)...), hash), true};
     }
-    size_ = 0;
+    size_t subtable = Candidate(hash, 0);
+    auto& table = Mutable(subtables_[subtable]);
+    size_t size = table.size();
+    auto result = table.EmplaceHashed(key, hash, std::forward<Args>(args)...);
+    // An insert into a subtable at its size limit evicts an element
+    size_ += table.size() - size;
+    return {iterator(&subtables_, subtable, result.first), result.second};
+}
+
+// Inserts the element which is in none of its candidates
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator
+              HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::InsertDisplacing(Stored_ element,
+                                                                                             size_t hash) {
+    size_t target = subtables_.size();
+    for (size_t i = 0; i < options_.candidates; ++i) {
+        size_t subtable = Candidate(hash, i);
+        if (!subtables_[subtable]->IsFull() && (target == subtables_.size() || Load(subtable) < Load(target))) {
+            target = subtable;
+        }
+    }
+    if (target == subtables_.size()) {
+        target = Displace(hash);
+    }
+    if (target == subtables_.size()) {
+        target = Candidate(hash, 0);
+        for (size_t i = 1; i < options_.candidates; ++i) {
+            if (Load(Candidate(hash, i)) > Load(target)) {
+                target = Candidate(hash, i);
+            }
+        }
+        Mutable(subtables_[target]).Grow();
+    }
+    auto& table = Mutable(subtables_[target]);
+    size_t size = table.size();
+    auto it = table.Place(std::move(element), hash);
+    size_ += table.size() - size;
+    return iterator(&subtables_, target, it);
 }
 
-template<class KeyType, class ValueType, class Hash>
-void HashMap<KeyType, ValueType, Hash>::InitializeSubtables() {
-    for (size_t i = 0; i < SubtableSize; ++i) {
-        subtables_[i].reset(new SubTable<KeyType, ValueType, Hash>(hasher_));
+/*
+    All candidates of the new key are full. Looks through displacement_window elements of every candidate,
+    starting from the home position of the new key, for an element that has a candidate with free space and
+    moves it there. Returns the subtable which got free space or subtables_.size() if nothing can be moved.
+*/
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+size_t HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::Displace(size_t hash) {
+    for (size_t i = 0; i < options_.candidates; ++i) {
+        size_t subtable = Candidate(hash, i);
+        auto& table = *subtables_[subtable];
+        auto& array = table.table_;
+        size_t position = array.Home(hash);
+        for (size_t checked = 0; checked < options_.displacement_window && checked < array.capacity_; ++checked) {
+            if (array.meta_[position] != EmptyMeta) {
+                size_t victim_hash = table.HashAt(array, position);
+                for (size_t j = 0; j < options_.candidates; ++j) {
+                    size_t alternative = Candidate(victim_hash, j);
+                    if (alternative != subtable && !subtables_[alternative]->IsFull() &&
+                        !subtables_[alternative]->AtLimit()) {
+                        auto& source = Mutable(subtables_[subtable]);
+                        Mutable(subtables_[alternative]).Place(std::move(source.table_.buckets_[position].Slot()),
+                                                               victim_hash);
+                        source.ErasePosition(source.table_, position);
+                        return subtable;
+                    }
+                }
+            }
+            position = array.NextPos(position);
+        }
     }
+    return subtables_.size();
 }
 
-template<class KeyType, class ValueType, class Hash>
-HashMap<KeyType, ValueType, Hash>::iterator::iterator(
-        std::array<std::shared_ptr<SubTable<KeyType, ValueType, Hash>>, SubtableSize>* subtables,
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::iterator(
+        Subtables_* subtables,
                                                       size_t pos,
-                                                      typename SubTable<KeyType, ValueType, Hash>::iterator it) :
+                                            typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator it) :
                                                       subtables_(subtables), pos_(pos), it_(it) {}
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::iterator &HashMap<KeyType, ValueType, Hash>::iterator::operator++() {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator++() {
     ++it_;
-    if (it_.it_ == it_.end_) {
+    NextSubtable();
+    return *this;
+}
+
+// If it_ has passed its subtable, goes to the first element of the next subtable which is not empty
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::NextSubtable() {
+    if (it_ != (*subtables_)[pos_]->end()) {
+        return;
+    }
+    do {
         ++pos_;
-        while (pos_ < SubtableSize && (*subtables_)[pos_]->empty()) {
-            ++pos_;
-        }
-        if (pos_ < SubtableSize) {
-            it_ = (*subtables_)[pos_]->begin();
-        } else {
-            it_ = (*subtables_)[SubtableSize - 1]->end();
-        }
+    } while (pos_ < subtables_->size() && (*subtables_)[pos_]->empty());
+    if (pos_ < subtables_->size()) {
+        it_ = Mutable((*subtables_)[pos_]).begin();
+    } else {
+        it_ = typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator();
     }
-    return *this;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::iterator HashMap<KeyType, ValueType, Hash>::iterator::operator++(int) {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator++(int) {
     iterator tmp = *this;
     ++(*this);
     return tmp;
 }
 
-template<class KeyType, class ValueType, class Hash>
-std::pair<const KeyType, ValueType> &HashMap<KeyType, ValueType, Hash>::iterator::operator*() {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename ElementLayout<KeyType, ValueType>::Element &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator*() {
     return *it_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-std::pair<const KeyType, ValueType> *HashMap<KeyType, ValueType, Hash>::iterator::operator->() {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename ElementLayout<KeyType, ValueType>::Element *HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator->() {
     return it_.operator->();
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool HashMap<KeyType, ValueType, Hash>::iterator::operator==(const iterator &other) const {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator==(const iterator &other) const {
     return subtables_ == other.subtables_ && pos_ == other.pos_ && it_ == other.it_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool HashMap<KeyType, ValueType, Hash>::iterator::operator!=(const iterator &other) const {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::iterator::operator!=(const iterator &other) const {
     return !(*this == other);
 }
 
-template<class KeyType, class ValueType, class Hash>
-HashMap<KeyType, ValueType, Hash>::const_iterator::const_iterator(
-        const std::array<std::shared_ptr<SubTable<KeyType, ValueType, Hash>>, SubtableSize>* subtables,
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::const_iterator(
+        const Subtables_* subtables,
         size_t pos,
-        typename SubTable<KeyType, ValueType, Hash>::iterator it) : subtables_(subtables), pos_(pos), it_(it) {}
+        typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator it) : subtables_(subtables), pos_(pos),
+                                                                                           it_(it) {}
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::const_iterator &HashMap<KeyType, ValueType, Hash>::const_iterator::operator++() {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator++() {
     ++it_;
-    if (it_.it_ == it_.end_) {
+    NextSubtable();
+    return *this;
+}
+
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+void HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::NextSubtable() {
+    const auto& table = *(*subtables_)[pos_];
+    if (it_ != table.end()) {
+        return;
+    }
+    do {
         ++pos_;
-        while (pos_ < SubtableSize && (*subtables_)[pos_]->empty()) {
-            ++pos_;
-        }
-        if (pos_ < SubtableSize) {
-            it_ = (*subtables_)[pos_]->begin();
-        } else {
-            it_ = (*subtables_)[SubtableSize - 1]->end();
-        }
+    } while (pos_ < subtables_->size() && (*subtables_)[pos_]->empty());
+    if (pos_ < subtables_->size()) {
+        const auto& next = *(*subtables_)[pos_];
+        it_ = next.begin();
+    } else {
+        it_ = typename SubTable<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator();
     }
-    return *this;
 }
 
-template<class KeyType, class ValueType, class Hash>
-typename HashMap<KeyType, ValueType, Hash>::const_iterator
-        HashMap<KeyType, ValueType, Hash>::const_iterator::operator++(int) {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+typename HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator
+        HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator++(int) {
     const_iterator tmp = *this;
     ++(*this);
     return tmp;
 }
 
-template<class KeyType, class ValueType, class Hash>
-const std::pair<const KeyType, ValueType> &HashMap<KeyType, ValueType, Hash>::const_iterator::operator*() {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+const typename ElementLayout<KeyType, ValueType>::Element &HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator*() {
     return *it_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-const std::pair<const KeyType, ValueType> *HashMap<KeyType, ValueType, Hash>::const_iterator::operator->() {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+const typename ElementLayout<KeyType, ValueType>::Element *HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator->() {
     return it_.operator->();
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool HashMap<KeyType, ValueType, Hash>::const_iterator::operator==(const const_iterator &other) const {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator==(const const_iterator &other) const {
     return subtables_ == other.subtables_ && pos_ == other.pos_ && it_ == other.it_;
 }
 
-template<class KeyType, class ValueType, class Hash>
-bool HashMap<KeyType, ValueType, Hash>::const_iterator::operator!=(const const_iterator &other) const {
+template<class KeyType, class ValueType, class Hash, class KeyEqual, class Probe, class Allocator>
+bool HashMap<KeyType, ValueType, Hash, KeyEqual, Probe, Allocator>::const_iterator::operator!=(const const_iterator &other) const {
     return !(*this == other);
 }
 
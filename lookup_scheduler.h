@@ -0,0 +1,145 @@
+/*
+    LookupScheduler is a small single-threaded scheduler of coroutines which look up keys with find_async.
+
+    A LookupTask is a coroutine which co_awaits find_async (see FindAwaitable): every co_await prefetches
+    the home bucket of its key and puts the task back into the scheduler's queue, so the other tasks run
+    and issue their own prefetches before it resumes. With enough tasks in flight the cache misses
+    of their lookups overlap, like in find_batch, but every task keeps its own control flow between lookups.
+
+    At most window tasks run at once, the others wait in the order they were spawned. A wider window hides more
+    latency until the prefetched lines start to evict one another. Needs C++20 coroutines.
+*/
+
+#ifndef MY_OWN_HASH_TABLE_LOOKUP_SCHEDULER_H
+#define MY_OWN_HASH_TABLE_LOOKUP_SCHEDULER_H
+
+#include "hash_map.h"
+
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+
+#include <deque>
+#include <exception>
+
+// How many lookup tasks a LookupScheduler runs at once by default
+const size_t LookupWindow = 32;
+
+class LookupScheduler;
+
+// The coroutine type of the lookups run by a LookupScheduler, it starts only when the scheduler runs it
+class LookupTask {
+public:
+    struct promise_type {
+        LookupScheduler* scheduler_ = nullptr;
+        std::exception_ptr exception_;
+
+        LookupTask get_return_object() {
+            return LookupTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            exception_ = std::current_exception();
+        }
+
+        // Called by FindAwaitable after the prefetch, the task is resumed after the ones queued before it
+        void schedule(std::coroutine_handle<> handle);
+    };
+
+    LookupTask(LookupTask&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    LookupTask(const LookupTask& other) = delete;
+
+    LookupTask& operator=(const LookupTask& other) = delete;
+
+    ~LookupTask() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+private:
+    explicit LookupTask(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+
+    friend LookupScheduler;
+};
+
+class LookupScheduler {
+public:
+    explicit LookupScheduler(size_t window = LookupWindow) : window_(std::max<size_t>(window, 1)) {}
+
+    LookupScheduler(const LookupScheduler& other) = delete;
+
+    LookupScheduler& operator=(const LookupScheduler& other) = delete;
+
+    ~LookupScheduler() {
+        for (auto handle : waiting_) {
+            handle.destroy();
+        }
+        for (auto handle : ready_) {
+            handle.destroy();
+        }
+    }
+
+    // The scheduler owns the task from now on, it starts in run()
+    void spawn(LookupTask task) {
+        auto handle = std::exchange(task.handle_, nullptr);
+        handle.promise().scheduler_ = this;
+        waiting_.push_back(handle);
+    }
+
+    /*
+        Runs the tasks until all of them are done. The exception of a failed task is rethrown from run,
+        the other tasks stay in the scheduler and the next run continues them.
+    */
+    void run() {
+        while (!ready_.empty() || !waiting_.empty()) {
+            while (running_ < window_ && !waiting_.empty()) {
+                ready_.push_back(waiting_.front());
+                waiting_.pop_front();
+                ++running_;
+            }
+            auto handle = std::coroutine_handle<LookupTask::promise_type>::from_address(ready_.front().address());
+            ready_.pop_front();
+            handle.resume();
+            if (handle.done()) {
+                --running_;
+                std::exception_ptr exception = handle.promise().exception_;
+                handle.destroy();
+                if (exception) {
+                    std::rethrow_exception(exception);
+                }
+            }
+        }
+    }
+
+    size_t window() const {
+        return window_;
+    }
+
+private:
+    size_t window_;
+    size_t running_ = 0;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::deque<std::coroutine_handle<>> waiting_;
+
+    friend LookupTask::promise_type;
+};
+
+inline void LookupTask::promise_type::schedule(std::coroutine_handle<> handle) {
+    scheduler_->ready_.push_back(handle);
+}
+
+#endif
+
+#endif //MY_OWN_HASH_TABLE_LOOKUP_SCHEDULER_H
@@ -1,11 +1,23 @@
+#define MY_OWN_HASH_TABLE_STATS
 #include "hash_map.h"
+#include "concurrent_hash_map.h"
+#include "frozen_hash_map.h"
+#include "lookup_scheduler.h"
 #include <iostream>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
 #include <cstdlib>
+#include <fstream>
 #include <functional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <list>
 #include <map>
-#include <random>
-#include <unordered_map>
+#include <memory_resource>
+#include <sstream>
 
 void fail(const char *message) {
     std::cerr << "Fail:\n";
@@ -255,305 +267,1533 @@ namespace internal_tests {
         std::cerr << "ok!\n";
     }
 
-    void my_check() {
-        std::cerr << "my_check...\n";
+    template<class Probe>
+    void check_probe_policy() {
+        auto collide_hash = [](int x) -> size_t {
+            return x % 7;
+        };
+        SubTable<int, int, decltype(collide_hash), std::equal_to<int>, Probe> table(collide_hash);
+        for (int i = 0; i < 2000; ++i) {
+            table[i] = i;
+        }
+        for (int i = 0; i < 2000; i += 2) {
+            table.erase(i);
+        }
+        if (table.size() != 1000)
+            fail("wrong size");
+        for (int i = 0; i < 2000; ++i) {
+            auto it = table.find(i);
+            if ((it == table.end()) != (i % 2 == 0))
+                fail("wrong find with long probe sequences");
+            if (it != table.end() && it->second != i)
+                fail("wrong value with long probe sequences");
+        }
+    }
 
-        HashMap<int, int> map;
+    void check_probe_policies() {
+        std::cerr << "check probe policies...\n";
+        check_probe_policy<ScalarProbe>();
+        check_probe_policy<DefaultProbe>();
+        std::cerr << "ok!\n";
+    }
 
-        const int N = 10'000'000;
+    void check_displacement() {
+        std::cerr << "check displacement between subtables...\n";
+        HashMapOptions options;
+        options.candidates = 2;
+        HashMap<int, int> map(options);
+        for (int i = 0; i < 100000; ++i) {
+            map.insert(std::make_pair(i * 7, i));
+        }
+        for (int i = 0; i < 100000; i += 3) {
+            map.erase(i * 7);
+        }
+        size_t count = 0;
+        for (auto& element : map) {
+            if (element.first != element.second * 7 || element.second % 3 == 0)
+                fail("wrong element after displacement");
+            ++count;
+        }
+        if (count != map.size() || map.size() != 66666)
+            fail("wrong size");
+        for (int i = 0; i < 100000; ++i) {
+            if ((map.find(i * 7) == map.end()) != (i % 3 == 0))
+                fail("wrong find after displacement");
+        }
+        std::cerr << "ok!\n";
+    }
 
-        std::mt19937 gen(time(0));
+    void check_sizing() {
+        std::cerr << "check subtable count and sizing...\n";
+        HashMap<int, int> map(1000);
+        if (map.subtable_count() != 1024)
+            fail("subtable count is not rounded to a power of two");
+        map.reserve(100000);
+        size_t buckets = map.bucket_count();
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i;
+        }
+        if (map.bucket_count() != buckets)
+            fail("reserve doesn't prevent rehash");
+        map.max_load_factor(0.25f);
+        if (map.max_load_factor() != 0.25f || map.load_factor() > 0.25f)
+            fail("wrong max_load_factor");
+        SubTable<int, int> table;
+        for (int i = 0; i < 100; ++i) {
+            table[i] = i;
+        }
+        table.rehash(1000);
+        if (table.bucket_count() != 1024)
+            fail("wrong rehash");
+        table.rehash(0);
+        if (table.bucket_count() != 256 || table.size() != 100 || table.at(42) != 42)
+            fail("wrong rehash");
+        std::cerr << "ok!\n";
+    }
 
-        long double start = clock();
+    void check_shrink() {
+        std::cerr << "check shrink...\n";
+        HashMap<int, int> map(4);
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i;
+        }
+        size_t peak = map.bucket_count();
+        for (int i = 0; i < 100000; ++i) {
+            if (i % 100 != 0)
+                map.erase(i);
+        }
+        if (map.bucket_count() != peak)
+            fail("a map shrinks without min_load_factor");
+        HashMap<int, int> copy = map;
+        map.shrink_to_fit();
+        if (map.bucket_count() * 16 > peak || copy.bucket_count() != peak)
+            fail("wrong shrink_to_fit");
+        for (int i = 0; i < 100000; ++i) {
+            if (map.contains(i) != (i % 100 == 0))
+                fail("wrong elements after shrink_to_fit");
+        }
+        for (size_t step : {0, 4}) {
+            HashMapOptions options;
+            options.subtable_count = 4;
+            options.min_load_factor = 0.1;
+            options.incremental_rehash = step;
+            HashMap<int, int> sparse(options);
+            for (int round = 0; round < 3; ++round) {
+                for (int i = 0; i < 50000; ++i) {
+                    sparse[i] = i;
+                }
+                if (sparse.bucket_count() < peak / 2)
+                    fail("wrong growth with min_load_factor");
+                for (int i = 0; i < 50000; ++i) {
+                    if (i % 1000 != 0)
+                        sparse.erase(i);
+                }
+                for (int i = 0; i < 50000; ++i) {
+                    if (sparse.contains(i) != (i % 1000 == 0))
+                        fail("wrong elements after shrinking");
+                }
+            }
+            // An incremental shrink starts only after the previous rehash is finished, so it lags behind
+            if (sparse.bucket_count() > (step == 0 ? 4 * 128 : peak / 2))
+                fail("a sparse map does not shrink");
+            sparse.parallel_erase_if([](const std::pair<const int, int>&) {
+                return true;
+            });
+            sparse.min_load_factor(0.9);
+            sparse.shrink_to_fit();
+            if (sparse.min_load_factor() != 0.9f || sparse.bucket_count() != 4 * 8 || !sparse.empty())
+                fail("wrong shrink of an empty map");
+        }
+        std::cerr << "ok!\n";
+    }
 
-        for (int i = 0; i < N; i++) {
-            int key = gen() % (N * 10);
-            map.insert({key, i});
-            auto it = map.begin();
-            if (i % (N / 10) == 0) {
-                std::cerr << i << std::endl;
+    void check_incremental_rehash() {
+        std::cerr << "check incremental rehash...\n";
+        SubTable<int, int> table;
+        table.incremental_rehash(2);
+        for (int i = 0; i < 50000; ++i) {
+            table.insert(std::make_pair(i, i));
+            if (i % 997 == 0) {
+                size_t count = 0;
+                for (auto& element : table) {
+                    if (element.first != element.second)
+                        fail("wrong element during incremental rehash");
+                    ++count;
+                }
+                if (count != table.size() || table.size() != (size_t)i + 1)
+                    fail("wrong size during incremental rehash");
+                for (int j = 0; j <= i; j += 7) {
+                    if (table.find(j) == table.end())
+                        fail("lost element during incremental rehash");
+                }
             }
         }
+        for (int i = 0; i < 50000; i += 2) {
+            table.erase(i);
+        }
+        for (int i = 0; i < 50000; ++i) {
+            if ((table.find(i) == table.end()) != (i % 2 == 0))
+                fail("wrong erase during incremental rehash");
+        }
+        std::cerr << "ok!\n";
+    }
 
-        std::cerr << (clock() - start) / CLOCKS_PER_SEC << std::endl;
+    struct CountedValue {
+        static int constructed;
+        int value;
+        CountedValue(int value = 0) : value(value) {
+            ++constructed;
+        }
+    };
 
-        if (1) {
-            long double start1 = clock();
-            std::unordered_map<int, int> st;
+    struct CopyCounted {
+        static int copies;
+        int value;
+        CopyCounted(int value = 0) : value(value) {}
+        CopyCounted(const CopyCounted& other) : value(other.value) {
+            ++copies;
+        }
+        CopyCounted(CopyCounted&& other) noexcept : value(other.value) {}
+        CopyCounted& operator=(const CopyCounted& other) {
+            value = other.value;
+            ++copies;
+            return *this;
+        }
+        CopyCounted& operator=(CopyCounted&& other) noexcept {
+            value = other.value;
+            return *this;
+        }
+        bool operator==(const CopyCounted& other) const {
+            return value == other.value;
+        }
+    };
 
-            for (int i = 0; i < N; i++) {
-                int key = gen() % (N * 10);
-                st.insert({key, i});
-                if (i % (N / 10) == 0) {
-                    std::cerr << i << std::endl;
-                }
+    struct CopyCountedHash {
+        size_t operator()(const CopyCounted& key) const {
+            return std::hash<int>()(key.value);
+        }
+    };
+
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view key) const {
+            return std::hash<std::string_view>()(key);
+        }
+    };
+
+    struct CaseInsensitiveHash {
+        size_t operator()(const std::string& key) const {
+            std::string lower;
+            for (char c : key) {
+                lower += (char)std::tolower(c);
             }
+            return std::hash<std::string>()(lower);
+        }
+    };
 
-            std::cerr << "not me " << (clock() - start1) / CLOCKS_PER_SEC << std::endl;
+    struct CaseInsensitiveEqual {
+        bool operator()(const std::string& a, const std::string& b) const {
+            if (a.size() != b.size())
+                return false;
+            for (size_t i = 0; i < a.size(); ++i) {
+                if (std::tolower(a[i]) != std::tolower(b[i]))
+                    return false;
+            }
+            return true;
         }
+    };
+
+    struct AvalanchingHash {
+        using is_avalanching = void;
+        size_t operator()(uint64_t key) const {
+            return key;
+        }
+    };
 
-        //std::cerr << "ok!\n";
+    void check_hash_mix() {
+        std::cerr << "check hash mix...\n";
+        std::vector<int> low(8), high(8);
+        for (int i = 0; i < 8000; ++i) {
+            size_t hash = HashMix<std::hash<int>>::Mix(std::hash<int>()(i * 8));
+            ++low[hash & 7];
+            ++high[(hash >> SubtableHashShift) & 7];
+        }
+        for (int i = 0; i < 8; ++i) {
+            if (low[i] < 800 || high[i] < 800)
+                fail("weak hash is not mixed");
+        }
+        if (HashMix<AvalanchingHash>::Mix(12345) != 12345)
+            fail("strong hash is mixed");
+        HashMap<uint64_t, int, AvalanchingHash> map;
+        for (uint64_t i = 0; i < 1000; ++i) {
+            map[i * 0x9E3779B97F4A7C15ull] = (int)i;
+        }
+        for (uint64_t i = 0; i < 1000; ++i) {
+            if (map.at(i * 0x9E3779B97F4A7C15ull) != (int)i)
+                fail("wrong map with a strong hash");
+        }
+        std::cerr << "ok!\n";
     }
 
-    void my_check2() {
-        std::cerr << "my_check2...\n";
+    void check_copy_on_write() {
+        std::cerr << "check copy on write...\n";
+        HashMap<int, std::string> map;
+        for (int i = 0; i < 5000; ++i) {
+            map[i] = std::to_string(i);
+        }
+        HashMap<int, std::string> snapshot = map.snapshot();
+        const auto& shared = snapshot;
+        const auto& original = map;
+        if (&shared.find(7)->second != &original.find(7)->second)
+            fail("snapshot does not share subtables");
+        // A plain copy does not alias the elements of the original
+        std::string& reference = map[1];
+        HashMap<int, std::string> copy(original);
+        reference = "one";
+        if (copy.at(1) != "1" || &copy.find(1)->second == &original.find(1)->second)
+            fail("copy aliases the original");
+        reference = "1";
+        map.erase(7);
+        map[3] = "three";
+        map[6000] = "6000";
+        if (snapshot.size() != 5000 || !snapshot.contains(7) || snapshot.at(3) != "3" || snapshot.contains(6000))
+            fail("change of the original is seen in the copy");
+        if (map.size() != 5000 || map.contains(7) || map.at(3) != "three" || map.at(6000) != "6000")
+            fail("wrong original after copy");
+        HashMap<int, std::string> other;
+        other = snapshot;
+        for (auto& element : other) {
+            element.second += "!";
+        }
+        if (snapshot.at(10) != "10" || other.at(10) != "10!")
+            fail("change through iterator is seen in the copy");
+        snapshot.clear();
+        if (!snapshot.empty() || other.size() != 5000 || map.size() != 5000)
+            fail("clear of the copy is seen in the original");
+        size_t count = 0;
+        for (auto it = other.begin(); it != other.end(); ++it) {
+            ++count;
+        }
+        if (count != 5000)
+            fail("wrong iteration after copy");
+        std::cerr << "ok!\n";
+    }
 
-        auto simple_hash = [](unsigned long long x) -> size_t {
-            return x % 2;
-        };
-        //HashMap<int, int, decltype(simple_hash)> map(simple_hash);
-        HashMap<int, int> map;
+    // Counts the memory it gives, so a test can see that all memory of a map comes from its allocator
+    class CountingResource : public std::pmr::memory_resource {
+    public:
+        size_t allocated = 0;
+        size_t used = 0;
 
-        const int N = 1'00'000;
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            allocated += bytes;
+            used += bytes;
+            return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        }
 
-        std::mt19937 gen(228);
+        void do_deallocate(void* pointer, size_t bytes, size_t alignment) override {
+            used -= bytes;
+            std::pmr::new_delete_resource()->deallocate(pointer, bytes, alignment);
+        }
 
-        long double start = clock();
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
 
-        for (int i = 0; i < N; i++) {
-            int key = gen() % (N * 10);
-            map[key] = 0;
-            map.find(key);
-            for (auto j : map) {
-                j.second++;
-            }
-            if (i % (N / 10) == 0) {
-                std::cerr << i << std::endl;
+    void check_allocators() {
+        std::cerr << "check allocators...\n";
+        using PmrMap = HashMap<int, std::pmr::string, std::hash<int>, std::equal_to<int>, DefaultProbe,
+                               std::pmr::polymorphic_allocator<std::pair<const int, std::pmr::string>>>;
+        CountingResource resource, other_resource;
+        {
+            PmrMap map(&resource);
+            for (int i = 0; i < 5000; ++i) {
+                map[i] = std::string(40, (char)('a' + i % 26)).c_str();
             }
+            if (resource.allocated == 0 || map[7].get_allocator().resource() != &resource)
+                fail("pmr map does not use its resource");
+            PmrMap copy = map;
+            if (copy.get_allocator().resource() != std::pmr::get_default_resource() || copy.at(7) != map.at(7))
+                fail("wrong copy of pmr map");
+            PmrMap shared(&resource);
+            shared = map;
+            PmrMap moved(&other_resource);
+            moved = std::move(map);
+            if (moved.size() != 5000 || moved.at(30) != shared.at(30) ||
+                moved.at(30).get_allocator().resource() != &other_resource)
+                fail("wrong move of pmr map between resources");
+            moved.erase(30);
+            if (!shared.contains(30) || copy.size() != 5000)
+                fail("wrong pmr map after move");
         }
+        if (resource.used != 0 || other_resource.used != 0)
+            fail("pmr map leaks memory");
+        std::pmr::monotonic_buffer_resource arena;
+        SubTable<int, int, std::hash<int>, std::equal_to<int>, DefaultProbe,
+                 std::pmr::polymorphic_allocator<std::pair<const int, int>>> table(&arena);
+        for (int i = 0; i < 1000; ++i) {
+            table.insert({i, i});
+        }
+        if (table.size() != 1000 || table.at(999) != 999)
+            fail("wrong table in an arena");
 
-//        for (int i = 0; i < N; i++) {
-//            int key = gen() % (N * 10);
-//            map.erase(key);
-//            if (i % (N / 10) == 0) {
-//                std::cerr << i << std::endl;
-//            }
-//        }
-
-        std::cerr << (clock() - start) / CLOCKS_PER_SEC << std::endl;
+        HugePageAllocator<int> huge;
+        int* buffer = huge.allocate(HugePageSize);
+        if (reinterpret_cast<uintptr_t>(buffer) % HugePageSize != 0)
+            fail("huge page allocation is not aligned");
+        huge.deallocate(buffer, HugePageSize);
+        HashMap<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, DefaultProbe,
+                HugePageAllocator<std::pair<const uint64_t, uint64_t>>> large;
+        large.reserve(1 << 20);
+        for (uint64_t i = 0; i < (1 << 18); ++i) {
+            large[i] = i * 3;
+        }
+        for (uint64_t i = 0; i < (1 << 18); i += 97) {
+            if (large.at(i) != i * 3)
+                fail("wrong map with huge pages");
+        }
+        std::cerr << "ok!\n";
+    }
 
-        if (1) {
-            long double start1 = clock();
-            std::unordered_map<int, int> st;
+    void check_for_each() {
+        std::cerr << "check for each...\n";
+        HashMap<int, int> map;
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i;
+        }
+        for (int i = 0; i < 100000; ++i) {
+            if (i % 20 != 0)
+                map.erase(i);
+        }
+        long long iterated = 0, visited = 0;
+        size_t count = 0;
+        for (auto& element : map) {
+            iterated += element.second;
+            ++count;
+        }
+        map.for_each([&](std::pair<const int, int>& element) {
+            visited += element.second;
+            element.second *= 2;
+        });
+        if (count != map.size() || iterated != visited)
+            fail("wrong iteration of a sparse map");
+        const auto& constant = map;
+        long long doubled = 0;
+        constant.for_each([&](const std::pair<const int, int>& element) {
+            doubled += element.second;
+        });
+        size_t in_subtables = 0;
+        constant.for_each_subtable([&](const SubTable<int, int>& subtable) {
+            in_subtables += subtable.size();
+        });
+        if (doubled != 2 * visited || in_subtables != map.size())
+            fail("wrong for_each");
+        SubTable<int, int> table;
+        table.incremental_rehash(4);
+        for (int i = 0; i < 1000; ++i) {
+            table.insert({i, 1});
+        }
+        int total = 0;
+        table.for_each([&](std::pair<const int, int>& element) {
+            total += element.second;
+        });
+        if (total != 1000)
+            fail("wrong for_each during incremental rehash");
+        std::cerr << "ok!\n";
+    }
 
-            for (int i = 0; i < N; i++) {
-                int key = gen() % (N * 10);
-                st[key] = 0;
-                st.find(key);
-                for (auto j : st) {
-                    j.second++;
-                }
-                if (i % (N / 10) == 0) {
-                    std::cerr << i << std::endl;
-                }
+    void check_parallel() {
+        std::cerr << "check parallel operations...\n";
+        std::vector<std::pair<int, int>> rows;
+        for (int i = 0; i < 200000; ++i) {
+            rows.push_back({i * 7, i});
+        }
+        HashMap<int, int> map(64);
+        map[7] = -1;
+        map.parallel_insert(rows.begin(), rows.end());
+        if (map.size() != rows.size() || map.at(7) != -1 || map.at(14) != 2 || map.at(7 * 199999) != 199999)
+            fail("wrong parallel insert");
+        HashMapOptions options;
+        options.candidates = 2;
+        HashMap<int, int> dysect(options);
+        for (int i = 0; i < 1000; ++i) {
+            dysect[i * 7] = -1;
+        }
+        std::list<std::pair<int, int>> list(rows.begin(), rows.end());
+        dysect.parallel_insert(list.begin(), list.end(), ThreadExecutor{3});
+        if (dysect.size() != rows.size() || dysect.at(7) != -1 || dysect.at(7 * 1000) != 1000)
+            fail("wrong parallel insert with candidates");
+        std::atomic<long long> sum{0};
+        map.parallel_for_each([&](std::pair<const int, int>& element) {
+            element.second += 1;
+        });
+        const auto& constant = map;
+        constant.parallel_for_each([&](const std::pair<const int, int>& element) {
+            sum += element.second;
+        });
+        if (sum != 199999LL * 200000 / 2 - 2 + 200000)
+            fail("wrong parallel for_each");
+        auto sequential = [](size_t count, const auto& task) {
+            for (size_t i = 0; i < count; ++i) {
+                task(i);
             }
+        };
+        size_t erased = map.parallel_erase_if([](const std::pair<const int, int>& element) {
+            return element.second % 2 == 0;
+        }, sequential);
+        if (erased != 100000 || map.size() != 100000 || map.contains(7) || !map.contains(14))
+            fail("wrong parallel erase_if");
+        SubTable<int, int> table;
+        for (int i = 0; i < 10000; ++i) {
+            table.insert({i, i});
+        }
+        if (table.erase_if([](const std::pair<const int, int>& element) { return element.first % 3 != 0; }) != 6666 ||
+            table.size() != 3334 || !table.contains(9999) || table.contains(9998))
+            fail("wrong erase_if");
+        std::cerr << "ok!\n";
+    }
 
-//            for (int i = 0; i < N; i++) {
-//                int key = gen() % (N * 10);
-//                st.erase(key);
-//                if (i % (N / 10) == 0) {
-//                    //std::cerr << i << std::endl;
-//                }
-//            }
+    struct OtherHash {
+        size_t operator()(int x) const {
+            return std::hash<int>()(x) * 31 + 7;
+        }
+    };
 
-            std::cerr << (clock() - start1) / CLOCKS_PER_SEC << std::endl;
+    void check_snapshot() {
+        std::cerr << "check snapshot...\n";
+        HashMapOptions options;
+        options.subtable_count = 8;
+        options.candidates = 2;
+        options.incremental_rehash = 16;
+        HashMap<int, int> map(options);
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i * 3;
+        }
+        for (int i = 0; i < 100000; i += 7) {
+            map.erase(i);
+        }
+        std::stringstream image;
+        map.save(image);
+        HashMap<int, int> loaded;
+        loaded.load(image);
+        if (loaded.size() != map.size() || loaded.bucket_count() != map.bucket_count())
+            fail("wrong size after load");
+        for (int i = 0; i < 100000; ++i) {
+            auto it = loaded.find(i);
+            if ((i % 7 == 0) != (it == loaded.end()) || (it != loaded.end() && it->second != i * 3))
+                fail("wrong element after load");
+        }
+        const char* path = "test_hashmap_snapshot.bin";
+        {
+            std::ofstream file(path, std::ios::binary);
+            map.save(file);
+        }
+        HashMap<int, int> mapped;
+        mapped.load_mapped(path);
+        HashMap<int, int> copy = mapped;
+        for (int i = 0; i < 100000; ++i) {
+            if ((i % 7 == 0) != !mapped.contains(i))
+                fail("wrong element in a mapped snapshot");
+        }
+        for (int i = 0; i < 200000; i += 2) {
+            mapped[i] = -i;
+        }
+        for (int i = 0; i < 200000; ++i) {
+            if (i % 2 == 0 ? mapped[i] != -i : (i < 100000 && i % 7 != 0) != mapped.contains(i))
+                fail("wrong change of a mapped snapshot");
+        }
+        if (copy.size() != map.size() || copy[2] != 6)
+            fail("a copy of a mapped snapshot has changed");
+        mapped.load_mapped(path);
+        if (mapped.size() != map.size() || mapped[1] != 3)
+            fail("the file of a mapped snapshot has changed");
+        HashMap<int, int, OtherHash> other;
+        try {
+            other.load_mapped(path);
+            fail("a snapshot of another hash function is loaded");
+        } catch (const std::runtime_error&) {
+        }
+        std::remove(path);
+        HashMap<long long, int> wider;
+        image.clear();
+        image.seekg(0);
+        try {
+            wider.load(image);
+            fail("a snapshot of other types is loaded");
+        } catch (const std::runtime_error&) {
+        }
+        std::stringstream truncated(image.str().substr(0, image.str().size() / 2));
+        try {
+            loaded.load(truncated);
+            fail("a truncated snapshot is loaded");
+        } catch (const std::runtime_error&) {
         }
+        if (loaded.size() != map.size() || loaded[1] != 3)
+            fail("a failed load has changed the map");
 
-        //std::cerr << "ok!\n";
+        HashMap<std::string, std::string> strings;
+        for (int i = 0; i < 10000; ++i) {
+            strings[std::to_string(i)] = std::string(i % 50, 'a');
+        }
+        std::stringstream stream;
+        strings.save(stream, [](std::ostream& out, const std::pair<const std::string, std::string>& element) {
+            out << element.first << ' ' << element.second.size() << '\n';
+        });
+        HashMap<std::string, std::string> restored;
+        restored.load(stream, [](std::istream& in) {
+            std::string key;
+            size_t size = 0;
+            in >> key >> size;
+            return std::make_pair(key, std::string(size, 'a'));
+        });
+        if (restored.size() != strings.size())
+            fail("wrong size after a streamed load");
+        for (int i = 0; i < 10000; ++i) {
+            if (restored[std::to_string(i)] != std::string(i % 50, 'a'))
+                fail("wrong element after a streamed load");
+        }
+        std::cerr << "ok!\n";
     }
 
-    const int N = 1'000'000;
-    std::vector<std::pair<int, int>> v(N);
-
-    void insert_test() {
-        std::cerr << "Insertion test\n My own map:" << "   ";
-        std::mt19937_64 gen;
-        {
-            HashMap<int, int> map;
-            double start = clock() * 1.0;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
-                if (i == 5'0'000) {
-                    auto d = 2;
-                }
-            }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
+    void check_stats() {
+        std::cerr << "check stats...\n";
+        HashMap<int, int> map(4);
+        for (int i = 0; i < 10000; ++i) {
+            map[i] = i;
         }
-        std::cerr << "System map:" << "   ";
-        {
-            std::unordered_map<int, int> map;
-            double start = clock() * 1.0;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
+        for (int i = 0; i < 20000; ++i) {
+            map.find(i);
+        }
+        for (int i = 0; i < 10000; i += 2) {
+            map.erase(i);
+        }
+        map.erase(-1);
+        auto stats = map.stats();
+        if (stats.size != 5000 || stats.subtables.size() != 4 || stats.capacity != map.bucket_count())
+            fail("wrong sizes in stats");
+        if (stats.find.hits != 10000 || stats.find.misses != 10000 || stats.insert.misses != 10000 ||
+            stats.insert.hits != 0 || stats.erase.hits != 5000 || stats.erase.misses != 1)
+            fail("wrong probe counters");
+        if (stats.find.hit_probes < stats.find.hits || stats.find.miss_probes < stats.find.misses)
+            fail("wrong probe lengths");
+        size_t histogram = 0;
+        for (auto& subtable : stats.subtables) {
+            for (size_t count : subtable.psl_histogram) {
+                histogram += count;
             }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
+            if (subtable.psl_histogram.size() != subtable.max_psl + 1 || subtable.rehash_count == 0)
+                fail("wrong subtable stats");
         }
+        if (histogram != map.size() || stats.imbalance < 1 || stats.imbalance > 1.2 || stats.mean_psl > stats.max_psl)
+            fail("wrong PSL stats");
+        map.reset_stats();
+        stats = map.stats();
+        if (stats.find.hits != 0 || stats.rehash_count != 0 || stats.size != 5000)
+            fail("wrong reset of stats");
+        std::cerr << "ok!\n";
     }
 
-    void erase_test() {
-            std::cerr << "Erase test\n My own map:" << "   ";
-            std::mt19937_64 gen;
-            {
-                HashMap<int, int> map;
-                for (int i = 0; i < N; i++) {
-                    map.insert(v[i]);
-                }
-                double start = clock() * 1.0;
-                for (int i = 0; i < N; i++) {
-                    map.erase(v[i].first);
-                }
-                std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
-            }
-            std::cerr << "System map:" << "   ";
-            {
-                std::unordered_map<int, int> map;
-                for (int i = 0; i < N; i++) {
-                    map.insert(v[i]);
-                }
-                double start = clock() * 1.0;
-                for (int i = 0; i < N; i++) {
-                    map.erase(v[i].first);
-                }
-                std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
-            }
+    void check_hash_set() {
+        std::cerr << "check hash set...\n";
+        HashSet<uint32_t> set = {1, 2, 3};
+        for (uint32_t i = 0; i < 100000; ++i) {
+            set.insert(i * 7);
+        }
+        set.emplace(5u);
+        for (uint32_t i = 0; i < 100000; i += 2) {
+            set.erase(i * 7);
+        }
+        if (set.size() != 50000 + 4 || !set.contains(1) || !set.contains(5) || set.contains(14) || !set.contains(21))
+            fail("wrong elements of a set");
+        uint64_t sum = 0;
+        size_t count = 0;
+        for (const uint32_t& key : set) {
+            sum += key;
+            ++count;
+        }
+        set.for_each([&](const uint32_t& key) {
+            sum -= key;
+        });
+        if (count != set.size() || sum != 0 || *set.find(21) != 21)
+            fail("wrong iteration of a set");
+
+        CountingResource set_resource, map_resource;
+        HashSet<uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, DefaultProbe,
+                std::pmr::polymorphic_allocator<uint64_t>> keys(&set_resource);
+        HashMap<uint64_t, uint64_t, std::hash<uint64_t>, std::equal_to<uint64_t>, DefaultProbe,
+                std::pmr::polymorphic_allocator<std::pair<const uint64_t, uint64_t>>> pairs(&map_resource);
+        for (uint64_t i = 0; i < 100000; ++i) {
+            keys.insert(i);
+            pairs.insert({i, i});
+        }
+        if (keys.bucket_count() != pairs.bucket_count() || set_resource.used * 10 > map_resource.used * 6)
+            fail("a set stores values");
+        std::cerr << "ok!\n";
     }
 
-    void find_test() {
-        std::cerr << "Find test\n My own map:" << "   ";
-        std::mt19937_64 gen;
-        {
-            HashMap<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
-            }
-            double start = clock() * 1.0;
-            for (int i = 0; i < N; i++) {
-                map.find(v[i].first);
+    void check_trivial_relocation() {
+        std::cerr << "check relocation of trivially copyable elements...\n";
+        // All keys land in the last buckets of the array, so the clusters are long, saturated and wrap around
+        auto tail_hash = [](uint64_t x) -> size_t {
+            return ~size_t(0) - x % 5;
+        };
+        SubTable<uint64_t, uint64_t, decltype(tail_hash)> table(tail_hash);
+        std::map<uint64_t, uint64_t> expected;
+        uint64_t state = 1;
+        for (int step = 0; step < 20000; ++step) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            uint64_t key = (state >> 33) % 3000;
+            if ((state >> 20) % 3 == 0) {
+                if (table.erase(key) != expected.erase(key))
+                    fail("wrong erase of relocated elements");
+            } else {
+                table[key] = step;
+                expected[key] = step;
             }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
         }
-        std::cerr << "System map:" << "   ";
-        {
-            std::unordered_map<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
-            }
-            double start = clock() * 1.0;
-            for (int i = 0; i < N; i++) {
-                map.find(v[i].first);
-            }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
+        SubTable<uint64_t, uint64_t, decltype(tail_hash)> copy(table);
+        table.clear();
+        if (copy.size() != expected.size())
+            fail("wrong size after relocation");
+        for (const auto& [key, value] : expected) {
+            auto it = copy.find(key);
+            if (it == copy.end() || it->second != value)
+                fail("lost element after relocation");
+        }
+
+        HashMap<uint32_t, uint32_t> map;
+        for (uint32_t i = 0; i < 200000; ++i) {
+            map[i] = i;
+        }
+        for (uint32_t i = 0; i < 200000; i += 3) {
+            map.erase(i);
         }
+        HashMap<uint32_t, uint32_t> shared = map.snapshot();
+        shared[1] = 0;
+        for (uint32_t i = 0; i < 200000; ++i) {
+            auto it = map.find(i);
+            if ((it == map.end()) != (i % 3 == 0) || (it != map.end() && it->second != i))
+                fail("wrong elements after relocation");
+        }
+        if (shared.size() != map.size() || shared[1] != 0 || shared[2] != 2)
+            fail("wrong copy of relocated elements");
+        std::cerr << "ok!\n";
     }
 
-    void find_emp_test() {
-        std::cerr << "Find void elements test, but map has N elements\n My own map:" << "   ";
-        std::mt19937_64 gen;
-        {
-            HashMap<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
-            }
-            double start = clock() * 1.0;
-            for (int i = 0; i < N; i++) {
-                (*map.find(v[i].first)).second++;
+    void check_size_limit() {
+        std::cerr << "check size limit...\n";
+        SubTable<int, int> table;
+        table.size_limit(100);
+        for (int i = 0; i < 10000; ++i) {
+            table[i] = i;
+            if (table.size() > 100 || table.find(i) == table.end())
+                fail("wrong eviction from a subtable");
+        }
+        size_t count = 0;
+        for (auto& [key, value] : table) {
+            if (key != value)
+                fail("wrong element after eviction");
+            ++count;
+        }
+        if (count != table.size() || table.size() != 100)
+            fail("wrong size after eviction");
+
+        HashMapOptions options;
+        options.size_limit = 4096;
+        HashMap<int, int> cache(options);
+        for (int i = 0; i < 100000; ++i) {
+            cache[i + 1000] = i;
+            for (int hot = i % 10; hot < 100; hot += 10) {
+                cache.find(hot);
+                cache.try_emplace(hot, hot);
             }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
         }
-        std::cerr << "System map:" << "   ";
-        {
-            std::unordered_map<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
+        if (cache.size() > 4096 || cache.size() < 3500 || cache.size() != (size_t)std::distance(cache.begin(), cache.end()))
+            fail("wrong size of a cache");
+        size_t hot_left = 0;
+        for (int hot = 0; hot < 100; ++hot) {
+            hot_left += cache.count(hot);
+        }
+        if (hot_left < 90 || !cache.contains(100999))
+            fail("CLOCK evicted used elements");
+        if (cache.stats().evictions < 90000)
+            fail("evictions are not counted");
+
+        HashMap<int, int> batch_cache(options);
+        std::vector<int> hot_keys;
+        for (int hot = 0; hot < 100; ++hot) {
+            hot_keys.push_back(hot);
+        }
+        std::vector<HashMap<int, int>::iterator> found(hot_keys.size());
+        for (int i = 0; i < 100000; ++i) {
+            if (i < 100) {
+                batch_cache[i] = i;
             }
-            double start = clock() * 1.0;
-            for (int i = 0; i < N; i++) {
-                (*map.find(v[i].first)).second++;
+            batch_cache[i + 1000] = i;
+            if (i % 10 == 0) {
+                batch_cache.find_batch(hot_keys.data(), hot_keys.size(), found.data());
             }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
         }
+        hot_left = 0;
+        for (int hot = 0; hot < 100; ++hot) {
+            hot_left += batch_cache.count(hot);
+        }
+        if (hot_left < 90)
+            fail("CLOCK evicted elements found by find_batch");
+        cache.size_limit(500);
+        if (cache.size() > 500 || cache.size_limit() != 500)
+            fail("wrong size after the limit is lowered");
+        cache.size_limit(0);
+        for (int i = 0; i < 10000; ++i) {
+            cache[-i - 1] = i;
+        }
+        if (cache.size() < 10000)
+            fail("unlimited map evicts");
+        std::cerr << "ok!\n";
     }
 
-    void clear_test() {
-        std::cerr << "Clear map with N elements\n My own map:" << "   ";
-        std::mt19937_64 gen;
-        {
-            HashMap<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
-            }
-            double start = clock() * 1.0;
-            map.clear();
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
+    void check_erase_iterator() {
+        std::cerr << "check erase by iterator...\n";
+        // Clusters wrap around the end of the array, their backward shifts move elements from the first buckets
+        auto tail_hash = [](int x) -> size_t {
+            return ~size_t(0) - x % 7;
+        };
+        SubTable<int, int, decltype(tail_hash)> table(tail_hash);
+        for (int i = 0; i < 1000; ++i) {
+            table[i] = i;
+        }
+        std::map<int, int> seen;
+        for (auto it = table.begin(); it != table.end();) {
+            ++seen[it->first];
+            it = it->first % 2 == 0 ? table.erase(it) : std::next(it);
+        }
+        for (auto& [key, times] : seen) {
+            if (times != 1)
+                fail("erase by iterator passes an element twice");
+        }
+        if (seen.size() != 1000 || table.size() != 500)
+            fail("erase by iterator skips elements");
+        for (int i = 0; i < 1000; ++i) {
+            if (table.contains(i) != (i % 2 == 1))
+                fail("wrong elements after erase by iterator");
+        }
+        auto found = table.find(501);
+        found = table.erase(found);
+        if (table.contains(501) || table.size() != 499)
+            fail("wrong erase of a found element");
+
+        HashMapOptions options;
+        options.incremental_rehash = 16;
+        HashMap<int, int> map(options);
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i;
+        }
+        HashMap<int, int> copy = map;
+        size_t passed = 0;
+        for (auto it = map.begin(); it != map.end();) {
+            ++passed;
+            it = it->first % 3 == 0 ? map.erase(it) : std::next(it);
         }
-        std::cerr << "System map:" << "   ";
+        if (passed != 100000 || map.size() != 66666 || (size_t)std::distance(map.begin(), map.end()) != map.size())
+            fail("wrong sweep over the map");
+        for (int i = 0; i < 100000; ++i) {
+            if (map.contains(i) != (i % 3 != 0) || !copy.contains(i))
+                fail("wrong elements after the sweep");
+        }
+        HashMap<int, int> other = copy.snapshot();
+        const HashMap<int, int>& shared = copy;
+        int first = shared.begin()->first;
+        auto next = copy.erase(shared.begin());
+        if (copy.size() != 99999 || copy.contains(first) || next == copy.end() || !other.contains(first) ||
+            other.size() != 100000)
+            fail("erase by iterator changed a shared subtable");
+        std::cerr << "ok!\n";
+    }
+
+    size_t string_hashes = 0;
+    size_t string_compares = 0;
+
+    template<bool Stores>
+    struct CountingStringHash {
+        size_t operator()(const std::string& key) const {
+            ++string_hashes;
+            return std::hash<std::string>()(key);
+        }
+    };
+
+    template<>
+    struct CountingStringHash<true> : CountingStringHash<false> {
+        using stores_hash = void;
+    };
+
+    struct CountingStringEqual {
+        bool operator()(const std::string& a, const std::string& b) const {
+            ++string_compares;
+            return a == b;
+        }
+    };
+
+    template<bool Stores>
+    void count_string_work(size_t& hashes, size_t& compares) {
+        HashMapOptions options;
+        options.candidates = 2;
+        HashMap<std::string, int, CountingStringHash<Stores>, CountingStringEqual> map(options);
+        string_hashes = 0;
+        for (int i = 0; i < 20000; ++i) {
+            map["https://example.com/some/long/path/" + std::to_string(i)] = i;
+        }
+        hashes = string_hashes;
+        for (int i = 0; i < 20000; i += 2) {
+            map.erase("https://example.com/some/long/path/" + std::to_string(i));
+        }
+        HashMap<std::string, int, CountingStringHash<Stores>, CountingStringEqual> copy = map;
+        copy.rehash(copy.bucket_count() * 2);
+        string_compares = 0;
+        for (int i = 0; i < 20000; ++i) {
+            auto it = copy.find("https://example.com/some/long/path/" + std::to_string(i));
+            if ((it == copy.end()) != (i % 2 == 0) || (it != copy.end() && it->second != i))
+                fail("wrong find with stored hashes");
+        }
+        compares = string_compares;
+    }
+
+    void check_stored_hash() {
+        std::cerr << "check stored hashes...\n";
+        size_t hashes = 0, compares = 0, stored_hashes = 0, stored_compares = 0;
+        count_string_work<false>(hashes, compares);
+        count_string_work<true>(stored_hashes, stored_compares);
+        if (stored_hashes != 20000 || hashes <= stored_hashes)
+            fail("rehash hashes stored keys again");
+        if (stored_compares != 10000 || compares < stored_compares)
+            fail("keys with other hashes are compared");
+        std::cerr << "ok!\n";
+    }
+
+    void check_adaptive_growth() {
+        std::cerr << "check adaptive growth...\n";
+        HashMapOptions options;
+        options.subtable_count = 1;
+        options.max_psl = 16;
+        // Every key has the same low bits, they all start at one bucket until the table is reseeded
+        HashMap<uint64_t, int, AvalanchingHash> flooded(options);
+        for (uint64_t i = 0; i < 20000; ++i) {
+            flooded[i << 20] = (int)i;
+        }
+        for (uint64_t i = 0; i < 20000; ++i) {
+            auto it = flooded.find(i << 20);
+            if (it == flooded.end() || it->second != (int)i)
+                fail("wrong element in a reseeded map");
+        }
+        if (flooded.stats().reseeds == 0 || flooded.stats().max_psl > 200)
+            fail("flooded map is not reseeded");
+        std::stringstream image;
+        flooded.save(image);
+        HashMap<uint64_t, int, AvalanchingHash> loaded;
+        loaded.load(image);
+        if (loaded.size() != flooded.size() || loaded.at(123ull << 20) != 123)
+            fail("wrong reseeded map after load");
+
+        HashMapOptions dense;
+        dense.subtable_count = 1;
+        dense.max_load_factor = 0.9;
+        dense.max_psl = 64;
+        HashMap<int, int> adaptive(dense), plain;
+        for (int i = 0; i < 100000; ++i) {
+            adaptive[i] = i;
+            plain[i] = i;
+        }
+        if (adaptive.stats().reseeds != 0 || adaptive.load_factor() <= plain.load_factor() || adaptive.max_psl() != 64)
+            fail("adaptive map does not run denser");
+        for (int i = 0; i < 100000; i += 3) {
+            if (adaptive.at(i) != i)
+                fail("wrong element in an adaptive map");
+        }
+        std::cerr << "ok!\n";
+    }
+
+    void check_memory_usage() {
+        std::cerr << "check memory usage...\n";
+        HashMapOptions options;
+        options.subtable_count = 4;
+        HashMap<int, int> map(options);
+        for (int i = 0; i < 10000; ++i) {
+            map[i] = i;
+        }
+        HashMapMemoryUsage usage = map.memory_usage();
+        MemoryUsage parts;
+        for (auto& part : usage.subtables) {
+            parts += part;
+        }
+        if (usage.subtables.size() != 4 || usage.elements != 10000 || parts.buckets != usage.buckets ||
+            usage.metadata != map.bucket_count() + 4 * MetaPadding ||
+            usage.buckets < map.bucket_count() * sizeof(std::pair<int, int>) || usage.payload != 0 ||
+            usage.total() <= usage.buckets + usage.metadata)
+            fail("wrong memory usage");
+
+        using PmrMap = HashMap<int, std::pmr::string, std::hash<int>, std::equal_to<int>, DefaultProbe,
+                               std::pmr::polymorphic_allocator<std::pair<const int, std::pmr::string>>>;
+        CountingResource resource;
         {
-            std::unordered_map<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
+            PmrMap strings(options, std::hash<int>(), std::equal_to<int>(), &resource);
+            for (int i = 0; i < 5000; ++i) {
+                strings[i] = std::string(40, 'x').c_str();
             }
-            double start = clock() * 1.0;
-            map.clear();
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
+            // Every byte from the resource is counted, the map object itself is not allocated from it
+            HashMapMemoryUsage counted = strings.memory_usage([](const std::pair<const int, std::pmr::string>& element) {
+                return element.second.capacity() + 1;
+            });
+            if (counted.payload != 5000 * 41 || counted.total() - sizeof(PmrMap) != resource.used)
+                fail("memory usage does not match the allocations");
+        }
+        std::cerr << "ok!\n";
+    }
+
+    void check_numa_placement() {
+        std::cerr << "check NUMA placement...\n";
+        using NumaAllocated = NumaAllocator<std::pair<const int, int>>;
+        using NumaMap = HashMap<int, int, std::hash<int>, std::equal_to<int>, DefaultProbe, NumaAllocated>;
+        using NumaTable = SubTable<int, int, std::hash<int>, std::equal_to<int>, DefaultProbe, NumaAllocated>;
+        HashMapOptions options;
+        options.subtable_count = 8;
+        options.numa_nodes = 2;
+        NumaMap map(options);
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i;
         }
+        for (int i = 0; i < 100000; i += 7) {
+            if (map.at(i) != i)
+                fail("wrong value in a placed map");
+        }
+        size_t index = 0;
+        bool placed = true;
+        map.for_each_subtable([&](const NumaTable& subtable) {
+            placed = placed && map.subtable_node(index) == (int)(index / 4) && subtable.get_allocator().node() == map.subtable_node(index);
+            ++index;
+        });
+        if (!placed || HashMap<int, int>(options).subtable_node(0) != -1)
+            fail("subtables are not placed on their nodes");
+        NumaMap copy = map;
+        copy[-1] = 1;
+        if (copy.size() != 100001 || map.size() != 100000)
+            fail("wrong copy of a placed map");
+
+        size_t subtable = map.subtable_index(100000);
+        map.with_subtable(subtable, [](NumaTable& table) {
+            table[100000] = 1;
+        });
+        long long sum = 0;
+        for (size_t i = 0; i < options.subtable_count; ++i) {
+            sum += map.with_subtable(i, [](const NumaTable& table) {
+                long long part = 0;
+                for (auto& element : table) {
+                    part += element.second;
+                }
+                return part;
+            });
+        }
+        if (map.size() != 100001 || map.at(100000) != 1 || sum != 100000LL * 99999 / 2 + 1 || map.subtable_index(5) != map.subtable_index(5))
+            fail("wrong work on a subtable");
+
+        // Every thread fills and then halves its own subtables
+        HashMap<int, int> parallel(options);
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < options.subtable_count; ++t) {
+            workers.emplace_back([&parallel, t]() {
+                parallel.with_subtable(t, [&parallel, t](SubTable<int, int>& table) {
+                    for (int i = 0; i < 100000; ++i) {
+                        if (parallel.subtable_index(i) == t) {
+                            table[i] = i;
+                        }
+                    }
+                });
+                parallel.with_subtable(t, [](SubTable<int, int>& table) {
+                    table.erase_if([](const std::pair<const int, int>& element) {
+                        return element.first % 2 == 1;
+                    });
+                });
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        size_t visited = 0;
+        for (auto& element : parallel) {
+            visited += element.first % 2 == 0;
+        }
+        if (parallel.size() != 50000 || visited != 50000)
+            fail("wrong size after work on subtables from several threads");
+        std::cerr << "ok!\n";
     }
 
-    void iterator_test() {
-        std::cerr << "Iterate N elements\n My own map:" << "   ";
-        std::mt19937_64 gen;
+    void check_frozen_map() {
+        std::cerr << "check frozen map...\n";
+        HashMap<int, int> map;
+        for (int i = 0; i < 100000; ++i) {
+            map[i * 3] = i;
+        }
+        FrozenHashMap<int, int> frozen(map);
+        if (frozen.size() != map.size() || (size_t)std::distance(frozen.begin(), frozen.end()) != map.size())
+            fail("wrong size of a frozen map");
+        for (int i = 0; i < 300000; ++i) {
+            auto element = frozen.find(i);
+            if (i % 3 == 0 ? element == frozen.end() || element->second != i / 3 : element != frozen.end())
+                fail("wrong find in a frozen map");
+        }
+        bool thrown = false;
+        try {
+            frozen.at(1);
+        } catch (const std::out_of_range&) {
+            thrown = true;
+        }
+        if (!thrown || frozen.at(30) != 10 || frozen.count(31) != 0 || !frozen.contains(299997))
+            fail("wrong at in a frozen map");
+        std::vector<int> keys;
+        for (int i = 0; i < 1000; ++i) {
+            keys.push_back(i * 7);
+        }
+        std::vector<FrozenHashMap<int, int>::const_iterator> found(keys.size());
+        frozen.find_batch(keys.data(), keys.size(), found.data());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (found[i] != frozen.find(keys[i]))
+                fail("wrong find_batch in a frozen map");
+        }
+
+        FrozenHashMap<int, int> copy = frozen;
+        FrozenHashMap<int, int> moved = std::move(frozen);
+        FrozenHashMap<int, int> empty(HashMap<int, int>{});
+        if (copy.at(300) != 100 || moved.at(300) != 100 || !frozen.empty() || frozen.contains(300) ||
+                !empty.empty() || empty.find(0) != empty.end())
+            fail("wrong copy of a frozen map");
+        copy = empty;
+        if (!copy.empty() || moved.size() != 100000)
+            fail("wrong assignment of a frozen map");
+
+        using PmrMap = HashMap<int, std::pmr::string, std::hash<int>, std::equal_to<int>, DefaultProbe,
+                               std::pmr::polymorphic_allocator<std::pair<const int, std::pmr::string>>>;
+        using PmrFrozen = FrozenHashMap<int, std::pmr::string, std::hash<int>, std::equal_to<int>,
+                                        std::pmr::polymorphic_allocator<std::pair<const int, std::pmr::string>>>;
+        CountingResource resource, other_resource;
         {
-            HashMap<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
+            PmrMap source(&resource), empty_source(&resource), empty_other(&other_resource);
+            for (int i = 0; i < 1000; ++i) {
+                source[i] = std::string(40, (char)('a' + i % 26)).c_str();
             }
-            double start = clock() * 1.0;
-            for (auto& it : map) {
-                it.second++;
-            }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
+            PmrFrozen frozen_source(source);
+            PmrFrozen assigned(empty_other);
+            size_t before = other_resource.allocated;
+            assigned = frozen_source;
+            if (assigned.get_allocator().resource() != &other_resource || other_resource.allocated == before ||
+                    assigned.size() != 1000 || assigned.at(30) != frozen_source.at(30) ||
+                    assigned.at(30).get_allocator().resource() != &other_resource)
+                fail("wrong copy assignment of a pmr frozen map");
+            PmrFrozen moved(empty_source);
+            moved = std::move(assigned);
+            if (moved.get_allocator().resource() != &resource || moved.size() != 1000 || !assigned.empty() ||
+                    moved.at(999) != frozen_source.at(999))
+                fail("wrong move assignment of a pmr frozen map");
+            moved.swap(frozen_source);
+            if (moved.size() != 1000 || frozen_source.at(7) != source.at(7))
+                fail("wrong swap of pmr frozen maps");
         }
-        std::cerr << "System map:" << "   ";
-        {
-            std::unordered_map<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
+        if (resource.used != 0 || other_resource.used != 0)
+            fail("pmr frozen map leaks memory");
+
+        HashSet<std::string, StringHash, std::equal_to<>> words;
+        for (int i = 0; i < 1000; ++i) {
+            words.insert(std::to_string(i));
+        }
+        FrozenHashSet<std::string, StringHash, std::equal_to<>> frozen_words(words);
+        if (frozen_words.size() != 1000 || !frozen_words.contains(std::string_view("999")) || frozen_words.contains("1000"))
+            fail("wrong frozen set");
+        std::cerr << "ok!\n";
+    }
+
+    void check_merge_and_set_operations() {
+        std::cerr << "check merge and set operations...\n";
+        HashMap<int, std::string> map;
+        for (int i = 0; i < 1000; ++i) {
+            map[i] = std::to_string(i);
+        }
+        auto node = map.extract(5);
+        if (!node || node.key() != 5 || node.mapped() != "5" || map.size() != 999 || map.contains(5) || map.extract(5))
+            fail("wrong extract");
+        node.key() = 5000;
+        auto inserted = map.insert(std::move(node));
+        if (!inserted.inserted || !inserted.node.empty() || inserted.position->first != 5000 || map.at(5000) != "5")
+            fail("wrong insert of a node");
+        auto taken = map.extract(map.find(6));
+        taken.key() = 7;
+        auto rejected = map.insert(std::move(taken));
+        if (rejected.inserted || rejected.node.mapped() != "6" || rejected.position->second != "7" || map.size() != 999)
+            fail("wrong insert of a node with an existing key");
+        if (map.erase_if([](const std::pair<const int, std::string>& element) { return element.first % 2 == 0; }) != 500 ||
+                map.size() != 499 || map.contains(0) || !map.contains(1))
+            fail("wrong erase_if");
+
+        for (size_t threads : {1, 4}) {
+            HashMap<int, std::string> target;
+            HashMap<int, std::string> source;
+            for (int i = 0; i < 20000; ++i) {
+                (i < 10000 ? target : source)[i] = std::to_string(i);
+                if (i % 4 == 0) {
+                    target[i] = "target";
+                }
             }
-            double start = clock() * 1.0;
-            for (auto& it : map) {
-                it.second++;
+            HashMap<int, std::string> shared = source.snapshot();
+            target.merge(source, ThreadExecutor{threads});
+            bool merged = target.size() == 20000 && source.size() == 2500 && shared.size() == 10000;
+            for (int i = 0; i < 20000; ++i) {
+                merged = merged && target.at(i) == (i % 4 == 0 ? "target" : std::to_string(i));
+                merged = merged && source.contains(i) == (i >= 10000 && i % 4 == 0);
             }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
+            if (!merged)
+                fail("wrong merge");
+
+            HashMapOptions options;
+            options.candidates = 2;
+            HashMap<int, std::string> displaced(options);
+            displaced[1] = "one";
+            displaced.merge(std::move(shared));
+            if (displaced.size() != 10001 || displaced.at(15000) != "15000" || displaced.at(1) != "one")
+                fail("wrong merge into a map with another layout");
+
+            HashMap<int, std::string> odd;
+            for (int i = 1; i < 20000; i += 2) {
+                odd[i] = "";
+            }
+            HashMap<int, std::string> common = target;
+            if (common.intersect(odd, ThreadExecutor{threads}) != 10000 || common.size() != 10000 ||
+                    !common.contains(1) || common.contains(2))
+                fail("wrong intersect");
+            if (target.subtract(odd, ThreadExecutor{threads}) != 10000 || target.size() != 10000 ||
+                    target.contains(1) || !target.contains(2) || common.size() != 10000)
+                fail("wrong subtract");
+            if (target.subtract(target) != 10000 || !target.empty() || target.intersect(target) != 0)
+                fail("wrong set operation with itself");
         }
+
+        HashSet<std::string> words;
+        words.insert("a");
+        words.insert("b");
+        auto word = words.extract("a");
+        HashSet<std::string> other;
+        other.insert("b");
+        other.insert(std::move(word));
+        words.merge(other);
+        if (words.size() != 2 || other.size() != 1 || !words.contains("a") || !other.contains("b"))
+            fail("wrong extract and merge of sets");
+        std::cerr << "ok!\n";
     }
 
-    void skobki_test() {
-        std::cerr << "Acess to element by [] N elements\n My own map:" << "   ";
-        std::mt19937_64 gen;
-        {
-            HashMap<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+    // Looks up the keys first, first + step, ... below last and counts the right values
+    LookupTask find_keys(const HashMap<int, int>& map, int first, int step, int last, size_t& found) {
+        for (int key = first; key < last; key += step) {
+            auto it = co_await map.find_async(key);
+            if (it != map.end() && it->second == key * 2) {
+                ++found;
             }
-            double start = clock() * 1.0;
-            for (int i = 0; i < N; i++) {
-                map[v[i].first]++;
-            }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
         }
-        std::cerr << "System map:" << "   ";
-        {
-            std::unordered_map<int, int> map;
-            for (int i = 0; i < N; i++) {
-                map.insert(v[i]);
+    }
+
+    LookupTask increment(SubTable<int, int>& table, int key) {
+        auto it = co_await table.find_async(key);
+        if (it == table.end()) {
+            throw std::out_of_range("no such key");
+        }
+        ++it->second;
+    }
+
+    void check_find_async() {
+        std::cerr << "check find_async...\n";
+        HashMap<int, int> map;
+        for (int i = 0; i < 100000; ++i) {
+            map[i] = i * 2;
+        }
+        size_t found = 0;
+        LookupScheduler scheduler(16);
+        for (int i = 0; i < 64; ++i) {
+            scheduler.spawn(find_keys(map, i, 64, 200000, found));
+        }
+        scheduler.run();
+        if (found != 100000)
+            fail("wrong find_async in HashMap");
+
+        SubTable<int, int> table;
+        for (int i = 0; i < 1000; ++i) {
+            table[i] = 0;
+        }
+        for (int i = 0; i < 1000; ++i) {
+            scheduler.spawn(increment(table, i % 10));
+        }
+        scheduler.spawn(increment(table, -1));
+        scheduler.spawn(increment(table, 10));
+        bool thrown = false;
+        try {
+            scheduler.run();
+        } catch (const std::out_of_range&) {
+            thrown = true;
+        }
+        scheduler.run();
+        if (!thrown || table[0] != 100 || table[9] != 100 || table[10] != 1)
+            fail("wrong find_async in SubTable");
+        std::cerr << "ok!\n";
+    }
+#endif
+
+    void check_transparent() {
+        std::cerr << "check transparent lookup...\n";
+        HashMap<std::string, int, StringHash, std::equal_to<>> map;
+        for (int i = 0; i < 1000; ++i) {
+            map[std::to_string(i)] = i;
+        }
+        std::string buffer = "123456";
+        std::string_view slice(buffer.data(), 3);
+        if (map.find(slice) == map.end() || map.find(slice)->second != 123 || map.at(slice) != 123)
+            fail("wrong transparent find");
+        if (!map.contains(slice) || map.count(std::string_view("1000")) != 0 || !map.contains("999"))
+            fail("wrong transparent contains");
+        map.erase(slice);
+        if (map.contains(slice) || map.size() != 999)
+            fail("wrong transparent erase");
+        SubTable<std::string, int, StringHash, std::equal_to<>> table;
+        table["abc"] = 1;
+        const auto& const_table = table;
+        if (const_table.find(std::string_view("abc")) == const_table.end() || !table.contains(std::string_view("abc")))
+            fail("wrong transparent find in SubTable");
+        HashMap<std::string, int, CaseInsensitiveHash, CaseInsensitiveEqual> custom;
+        custom["Key"] = 1;
+        custom["KEY"] = 2;
+        if (custom.size() != 1 || custom.at("key") != 2 || custom.count("kEy") != 1)
+            fail("KeyEqual is not used");
+        std::cerr << "ok!\n";
+    }
+
+    void check_move() {
+        std::cerr << "check move...\n";
+        CopyCounted::copies = 0;
+        HashMap<CopyCounted, CopyCounted, CopyCountedHash> map;
+        for (int i = 0; i < 10000; ++i) {
+            map.insert(std::make_pair(CopyCounted(i), CopyCounted(i)));
+            map.try_emplace(CopyCounted(i / 2), i);
+            map[CopyCounted(i)].value = i;
+        }
+        map.rehash(100000);
+        if (map.find(CopyCounted(5)) == map.end() || CopyCounted::copies != 0)
+            fail("elements were copied");
+        const CopyCounted* address = &map.find(CopyCounted(7))->second;
+        HashMap<CopyCounted, CopyCounted, CopyCountedHash> moved(std::move(map));
+        if (&moved.find(CopyCounted(7))->second != address || moved.size() != 10000 || map.size() != 0)
+            fail("wrong move constructor");
+        map = std::move(moved);
+        if (&map.find(CopyCounted(7))->second != address || map.size() != 10000)
+            fail("wrong move assignment");
+        // The moved-from map is a valid empty map
+        const auto& moved_from = moved;
+        bool contained = true;
+        CopyCounted key(1);
+        HashMap<CopyCounted, CopyCounted, CopyCountedHash>::const_iterator found;
+        moved_from.contains_batch(&key, 1, &contained);
+        moved_from.find_batch(&key, 1, &found);
+        size_t subtable = moved_from.subtable_index(key);
+        moved.erase(key);
+        if (moved.find(key) != moved.end() || moved_from.find(key) != moved_from.end() || moved.contains(key) ||
+                moved.begin() != moved.end() || contained || found != moved_from.end() ||
+                subtable >= moved.subtable_count() || moved_from.with_subtable(subtable, [](const auto& table) {
+                    return table.size();
+                }) != 0)
+            fail("moved-from map is not an empty map");
+        moved.insert(std::make_pair(CopyCounted(1), CopyCounted(2)));
+        if (moved.size() != 1 || moved.at(CopyCounted(1)).value != 2 || CopyCounted::copies != 0)
+            fail("moved-from map is not usable");
+        HashMap<CopyCounted, CopyCounted, CopyCountedHash> taken(std::move(moved));
+        moved[CopyCounted(3)].value = 4;
+        moved.erase(CopyCounted(3));
+        moved.clear();
+        if (!moved.empty() || taken.size() != 1 || moved.contains(CopyCounted(1)))
+            fail("moved-from map is not usable after the move constructor");
+        SubTable<std::string, std::string> table;
+        table["key"] = "value";
+        SubTable<std::string, std::string> other(std::move(table));
+        if (other.at("key") != "value" || !table.empty() || table.find("key") != table.end())
+            fail("wrong SubTable move constructor");
+        for (int i = 0; i < 100; ++i) {
+            table[std::to_string(i)] = std::to_string(i);
+        }
+        other = std::move(table);
+        if (other.size() != 100 || other.at("42") != "42" || table.begin() != table.end())
+            fail("wrong SubTable move assignment");
+        std::cerr << "ok!\n";
+    }
+
+    void check_emplace() {
+        std::cerr << "check emplace...\n";
+        HashMap<int, CountedValue> map;
+        auto result = map.try_emplace(1, 10);
+        if (!result.second || result.first->first != 1 || result.first->second.value != 10)
+            fail("try_emplace did not insert");
+        CountedValue::constructed = 0;
+        result = map.try_emplace(1, 20);
+        if (result.second || result.first->second.value != 10 || CountedValue::constructed != 0)
+            fail("try_emplace constructed a value for an existing key");
+        map[1].value = 30;
+        if (CountedValue::constructed != 0 || map.size() != 1)
+            fail("operator[] constructed a value for an existing key");
+        result = map.insert_or_assign(1, CountedValue(40));
+        if (result.second || map.at(1).value != 40)
+            fail("insert_or_assign did not assign");
+        result = map.insert_or_assign(2, CountedValue(50));
+        if (!result.second || map.at(2).value != 50)
+            fail("insert_or_assign did not insert");
+        result = map.emplace(3, 60);
+        if (!result.second || result.first->second.value != 60 || map.emplace(3, 70).second || map.size() != 3)
+            fail("wrong emplace");
+        SubTable<int, std::string> table;
+        for (int i = 0; i < 1000; ++i) {
+            auto it = table.try_emplace(i, 3, 'a').first;
+            if (it->first != i || it->second != "aaa")
+                fail("wrong iterator from try_emplace");
+        }
+        if (table.size() != 1000 || table.try_emplace(7).second || table[7] != "aaa")
+            fail("wrong SubTable::try_emplace");
+        std::cerr << "ok!\n";
+    }
+
+    void check_batch() {
+        std::cerr << "check batch...\n";
+        for (size_t candidates = 1; candidates <= 2; ++candidates) {
+            HashMapOptions options;
+            options.candidates = candidates;
+            HashMap<int, int> map(options);
+            std::vector<std::pair<int, int>> elements;
+            for (int i = 0; i < 1000; ++i) {
+                elements.emplace_back(i * 3, i);
+            }
+            map.insert_batch(elements.data(), elements.size());
+            map.insert_batch(elements.data(), 10);
+            if (map.size() != elements.size())
+                fail("wrong size after insert_batch");
+            std::vector<int> keys;
+            for (int i = 0; i < 3000; ++i) {
+                keys.push_back(i);
             }
-            double start = clock() * 1.0;
-            for (int i = 0; i < N; i++) {
-                map[v[i].first]++;
+            std::vector<HashMap<int, int>::iterator> found(keys.size());
+            map.find_batch(keys.data(), keys.size(), found.data());
+            std::unique_ptr<bool[]> contains(new bool[keys.size()]);
+            const HashMap<int, int>& const_map = map;
+            const_map.contains_batch(keys.data(), keys.size(), contains.get());
+            for (size_t i = 0; i < keys.size(); ++i) {
+                bool expected = keys[i] % 3 == 0;
+                if (contains[i] != expected || (found[i] != map.end()) != expected)
+                    fail("wrong batch lookup");
+                if (expected && found[i]->second != keys[i] / 3)
+                    fail("wrong value from find_batch");
             }
-            std::cerr << (clock() * 1.0 - start) / CLOCKS_PER_SEC << std::endl;
         }
+        // Results stay valid while a later key of the batch is looked up in the middle of an incremental rehash
+        HashMapOptions options;
+        options.incremental_rehash = 1;
+        options.subtable_count = 1;
+        HashMap<int, int> migrating(options);
+        size_t buckets = 0;
+        for (int i = 0; buckets == 0 || migrating.bucket_count() == buckets; ++i) {
+            buckets = buckets == 0 ? migrating.bucket_count() : buckets;
+            migrating[i] = i;
+        }
+        int inserted = (int)migrating.size();
+        std::vector<int> keys(4 * 1024);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            keys[i] = (int)i;
+        }
+        std::vector<HashMap<int, int>::iterator> found(keys.size());
+        migrating.find_batch(keys.data(), keys.size(), found.data());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if ((found[i] != migrating.end()) != (keys[i] < inserted) || (keys[i] < inserted && found[i]->second != keys[i]))
+                fail("find_batch invalidates its results during a rehash");
+        }
+        std::cerr << "ok!\n";
+    }
+
+    // Trivially copyable, so ConcurrentHashMap reads it optimistically, but it can not be default-constructed
+    struct NoDefaultValue {
+        explicit NoDefaultValue(int value) : value(value) {}
+
+        int value;
+    };
+
+    void check_concurrent() {
+        std::cerr << "check concurrent...\n";
+        const int threads = 4;
+        const int per_thread = 20000;
+        ConcurrentHashMap<int, int> map(8);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&map, t]() {
+                for (int i = t * per_thread; i < (t + 1) * per_thread; ++i) {
+                    if (!map.insert(std::make_pair(i, i)))
+                        fail("concurrent insert of a new key failed");
+                }
+            });
+        }
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&map]() {
+                for (int i = 0; i < threads * per_thread; ++i) {
+                    int value;
+                    if (map.find(i, value) && value != i)
+                        fail("concurrent find returned a wrong value");
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        if (map.size() != (size_t)threads * per_thread)
+            fail("wrong size after concurrent inserts");
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&map]() {
+                for (int i = 0; i < 1000; ++i) {
+                    map.update(i % 10, [](int& value) { ++value; });
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (int i = 0; i < 10; ++i) {
+            int value;
+            if (!map.find(i, value) || value != i + threads * 100)
+                fail("lost concurrent update");
+        }
+        if (map.erase_if([](const std::pair<const int, int>& element) { return element.first % 2 == 0; }) !=
+                                                                                    (size_t)threads * per_thread / 2)
+            fail("wrong erase_if");
+        size_t count = 0;
+        map.for_each([&count](const std::pair<const int, int>& element) {
+            if (element.first % 2 == 0)
+                fail("erase_if left an element");
+            ++count;
+        });
+        if (count != map.size() || map.contains(2) || !map.contains(3))
+            fail("wrong state after erase_if");
+        ConcurrentHashMap<std::string, std::string> strings;
+        if (!strings.insert_or_assign("a", "b") || strings.insert_or_assign("a", "c") || strings.size() != 1)
+            fail("wrong insert_or_assign");
+        std::string value;
+        if (!strings.find("a", value) || value != "c" || strings.contains("b"))
+            fail("wrong find with non-trivial types");
+        ConcurrentHashMap<int, NoDefaultValue> optimistic;
+        optimistic.insert({1, NoDefaultValue(5)});
+        if (!optimistic.contains(1) || optimistic.contains(2))
+            fail("wrong contains with a value without default constructor");
+        std::cerr << "ok!\n";
     }
 
+    int CountedValue::constructed = 0;
+    int CopyCounted::copies = 0;
+
     void run_all() {
         const_check();
         exception_check();
@@ -562,20 +1802,36 @@ namespace internal_tests {
         check_destructor();
         check_copy();
         check_iterators();
-
-        std::mt19937_64 gen;
-
-        for (int i = 0; i < N; i++) {
-            v[i] = {gen(), gen()};
-        }
-
-        insert_test();
-        erase_test();
-        find_test();
-        find_emp_test();
-        clear_test();
-        iterator_test();
-        skobki_test();
+        check_probe_policies();
+        check_displacement();
+        check_sizing();
+        check_shrink();
+        check_incremental_rehash();
+        check_concurrent();
+        check_batch();
+        check_emplace();
+        check_move();
+        check_transparent();
+        check_hash_mix();
+        check_copy_on_write();
+        check_allocators();
+        check_for_each();
+        check_parallel();
+        check_snapshot();
+        check_stats();
+        check_hash_set();
+        check_trivial_relocation();
+        check_size_limit();
+        check_erase_iterator();
+        check_stored_hash();
+        check_numa_placement();
+        check_adaptive_growth();
+        check_memory_usage();
+        check_frozen_map();
+        check_merge_and_set_operations();
+#ifdef MY_OWN_HASH_TABLE_COROUTINES
+        check_find_async();
+#endif
     }
 } // namespace internal_tests
 